@@ -11,6 +11,8 @@
  */
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* More information about the BGA device itself is available from
@@ -59,8 +61,34 @@ int bga_set_mode(bga_p device, unsigned int width, unsigned int height,
  */
 int bga_set_pixel(bga_p device, unsigned int x, unsigned int y, char *value);
 
+/* Draw into a back buffer in normal memory instead of the frame buffer.
+ * Nothing drawn appears on screen until bga_present is called, which copies
+ * only the regions that have changed. The back buffer is reallocated on each
+ * bga_set_mode. Returns 0 on success, or -1 if the back buffer could not be
+ * allocated, in which case drawing continues to go to the frame buffer.
+ */
+int bga_set_double_buffered(bga_p device, bool enable);
+
+/* Fill a rectangle with the pixel value, formatted as for bga_set_pixel. The
+ * rectangle is clipped to the screen. Returns 0 on success.
+ */
+int bga_fill_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, char *value);
+
+/* Copy a rectangle of pixels, already in the device's format, to (x, y).
+ * Rows of src are src_stride bytes apart. The rectangle is clipped to the
+ * screen. Returns 0 on success.
+ */
+int bga_blit_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, const void *src, size_t src_stride);
+
+/* Copy everything drawn since the last call from the back buffer to the frame
+ * buffer. Does nothing when not double buffered. Returns 0 on success.
+ */
+int bga_present(bga_p device);
+
 /* Get a pointer to the frame buffer. You can output to the screen by directly
- * writing into this buffer. To do this correctly you will have to consult the
+ * writing into this buffer, bypassing any back buffer. To do this correctly you will have to consult the
  * Bochs documentation for formatting details.
  */
 void *bga_get_framebuffer(bga_p device);
@@ -17,11 +17,32 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <bga/bga.h>
 
+/* Number of separate dirty rectangles tracked before they are merged into one */
+#define MAX_DIRTY 16
+
+#define BGA_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define BGA_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+struct rect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
 struct bga {
     void *framebuffer;
 
+    /* Drawing goes here instead of the frame buffer when double buffering. */
+    char *back_buffer;
+    bool double_buffered;
+    /* Regions of the back buffer changed since the last present. */
+    struct rect dirty[MAX_DIRTY];
+    unsigned int num_dirty;
+
     /* IO port functions. */
     uint16_t (*read)(uint16_t port);
     void (*write)(uint16_t port, uint16_t value);
@@ -98,10 +119,136 @@ bga_p bga_init(void *framebuffer,
 
 int bga_destroy(bga_p device)
 {
+    free(device->back_buffer);
     free(device);
     return 0;
 }
 
+/* Bytes between successive pixels and bytes of each pixel that are copied
+ * from a value. Returns -1 for an unsupported bpp.
+ *
+ * XXX: None of these other than 24-bit have been tested and they are most
+ * likely incorrect.
+ */
+static int pixel_size(unsigned int bpp, unsigned int *coord_factor, size_t *len)
+{
+    switch (bpp) {
+    case 8: {
+        *coord_factor = 1;
+        *len = 1;
+        break;
+    }
+    case 15:
+    case 16: {
+        *coord_factor = 2;
+        *len = 2;
+        break;
+    }
+    case 24: {
+        *coord_factor = 3;
+        *len = 3;
+        break;
+    }
+    case 32: {
+        *coord_factor = 4;
+        *len = 3;
+        break;
+    }
+    default: {
+        /* Unsupported BPP. */
+        return -1;
+    }
+    }
+    return 0;
+}
+
+static size_t frame_size(bga_p device, unsigned int coord_factor)
+{
+    return (size_t)device->width * device->height * coord_factor;
+}
+
+/* Where drawing operations write to. */
+static char *draw_buffer(bga_p device)
+{
+    return device->back_buffer ? device->back_buffer : (char *)device->framebuffer;
+}
+
+static int alloc_back_buffer(bga_p device)
+{
+    unsigned int coord_factor;
+    size_t len;
+
+    free(device->back_buffer);
+    device->back_buffer = NULL;
+    device->num_dirty = 0;
+    if (!device->double_buffered || device->width == 0 || device->height == 0) {
+        return 0;
+    }
+    if (pixel_size(device->bpp, &coord_factor, &len) != 0) {
+        return -1;
+    }
+
+    /* Start from what is on screen so a partial redraw looks right. */
+    device->back_buffer = malloc(frame_size(device, coord_factor));
+    if (device->back_buffer == NULL) {
+        return -1;
+    }
+    memcpy(device->back_buffer, device->framebuffer, frame_size(device, coord_factor));
+    return 0;
+}
+
+/* Record a changed region of the back buffer. Once there are too many regions
+ * they are all merged into their bounding box.
+ */
+static void mark_dirty(bga_p device, struct rect r)
+{
+    if (device->back_buffer == NULL) {
+        return;
+    }
+    if (device->num_dirty != 0) {
+        /* Extend the last region if this continues it, as consecutive
+         * bga_set_pixel calls along a row do.
+         */
+        struct rect *last = &device->dirty[device->num_dirty - 1];
+        if (r.y == last->y && r.height == last->height && r.x == last->x + last->width) {
+            last->width += r.width;
+            return;
+        }
+    }
+    for (unsigned int i = 0; i < device->num_dirty; i++) {
+        struct rect *d = &device->dirty[i];
+        if (r.x >= d->x && r.y >= d->y && r.x + r.width <= d->x + d->width &&
+            r.y + r.height <= d->y + d->height) {
+            /* Already covered. */
+            return;
+        }
+    }
+    if (device->num_dirty == MAX_DIRTY) {
+        for (unsigned int i = 0; i < device->num_dirty; i++) {
+            struct rect *d = &device->dirty[i];
+            unsigned int right = BGA_MAX(r.x + r.width, d->x + d->width);
+            unsigned int bottom = BGA_MAX(r.y + r.height, d->y + d->height);
+            r.x = BGA_MIN(r.x, d->x);
+            r.y = BGA_MIN(r.y, d->y);
+            r.width = right - r.x;
+            r.height = bottom - r.y;
+        }
+        device->num_dirty = 0;
+    }
+    device->dirty[device->num_dirty++] = r;
+}
+
+/* Clip a rectangle to the screen. Returns false if nothing is left. */
+static bool clip_rect(bga_p device, struct rect *r)
+{
+    if (r->x >= device->width || r->y >= device->height) {
+        return false;
+    }
+    r->width = BGA_MIN(r->width, device->width - r->x);
+    r->height = BGA_MIN(r->height, device->height - r->y);
+    return r->width != 0 && r->height != 0;
+}
+
 int bga_set_mode(bga_p device, unsigned int width, unsigned int height, unsigned int bpp)
 {
     /* We need to disable the device to change these parameters. */
@@ -123,7 +270,14 @@ int bga_set_mode(bga_p device, unsigned int width, unsigned int height, unsigned
     /* Finally re-enable the device to have the settings take effect. */
     enable(device);
 
-    return 0;
+    /* The back buffer has to match the new mode. */
+    return alloc_back_buffer(device);
+}
+
+int bga_set_double_buffered(bga_p device, bool enable)
+{
+    device->double_buffered = enable;
+    return alloc_back_buffer(device);
 }
 
 int bga_set_pixel(bga_p device, unsigned int x, unsigned int y, char *value)
@@ -132,41 +286,109 @@ int bga_set_pixel(bga_p device, unsigned int x, unsigned int y, char *value)
     unsigned int coord_factor;
     size_t len;
 
-    /* XXX: None of these other than 24-bit have been tested and they are most
-     * likely incorrect.
-     */
+    if (pixel_size(device->bpp, &coord_factor, &len) != 0) {
+        return -1;
+    }
 
-    switch (device->bpp) {
-    case 8: {
-        coord_factor = 1;
-        len = 1;
-        break;
+    /* Determine where we need to write and copy the pixel data over. */
+    target = draw_buffer(device) + (y * device->width + x) * coord_factor;
+    (void)memcpy(target, value, len);
+    mark_dirty(device, (struct rect) {
+        x, y, 1, 1
+    });
+
+    return 0;
+}
+
+int bga_fill_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, char *value)
+{
+    unsigned int coord_factor;
+    size_t len;
+    struct rect r = { x, y, width, height };
+
+    if (pixel_size(device->bpp, &coord_factor, &len) != 0) {
+        return -1;
     }
-    case 15:
-    case 16: {
-        coord_factor = 2;
-        len = 2;
-        break;
+    if (!clip_rect(device, &r)) {
+        return 0;
     }
-    case 24: {
-        coord_factor = 3;
-        len = 3;
-        break;
+
+    char *buffer = draw_buffer(device);
+    size_t stride = (size_t)device->width * coord_factor;
+    size_t row_len = (size_t)r.width * coord_factor;
+    char *first = buffer + r.y * stride + r.x * coord_factor;
+
+    /* Build the first row by doubling, then copy it to the rest, so all of
+     * the work is done by memcpy.
+     */
+    for (unsigned int i = 0; i < coord_factor; i++) {
+        first[i] = i < len ? value[i] : 0;
     }
-    case 32: {
-        coord_factor = 4;
-        len = 3;
-        break;
+    for (size_t done = coord_factor; done < row_len; done *= 2) {
+        memcpy(first + done, first, BGA_MIN(done, row_len - done));
     }
-    default: {
-        /* Unsupported BPP. */
+    for (unsigned int row = 1; row < r.height; row++) {
+        memcpy(first + row * stride, first, row_len);
+    }
+    mark_dirty(device, r);
+
+    return 0;
+}
+
+int bga_blit_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, const void *src, size_t src_stride)
+{
+    unsigned int coord_factor;
+    size_t len;
+    struct rect r = { x, y, width, height };
+
+    if (pixel_size(device->bpp, &coord_factor, &len) != 0) {
         return -1;
     }
+    if (!clip_rect(device, &r)) {
+        return 0;
     }
 
-    /* Determine where we need to write and copy the pixel data over. */
-    target = ((char *)device->framebuffer) + (y * device->width + x) * coord_factor;
-    (void)memcpy(target, value, len);
+    char *buffer = draw_buffer(device);
+    size_t stride = (size_t)device->width * coord_factor;
+    for (unsigned int row = 0; row < r.height; row++) {
+        memcpy(buffer + (r.y + row) * stride + r.x * coord_factor,
+               (const char *)src + row * src_stride, (size_t)r.width * coord_factor);
+    }
+    mark_dirty(device, r);
+
+    return 0;
+}
+
+int bga_present(bga_p device)
+{
+    unsigned int coord_factor;
+    size_t len;
+
+    if (device->back_buffer == NULL) {
+        /* Drawing went straight to the screen. */
+        return 0;
+    }
+    if (pixel_size(device->bpp, &coord_factor, &len) != 0) {
+        return -1;
+    }
+
+    size_t stride = (size_t)device->width * coord_factor;
+    for (unsigned int i = 0; i < device->num_dirty; i++) {
+        struct rect *d = &device->dirty[i];
+        size_t offset = d->y * stride + d->x * coord_factor;
+        if (d->width == device->width) {
+            /* Whole rows are contiguous. */
+            memcpy((char *)device->framebuffer + offset, device->back_buffer + offset, d->height * stride);
+            continue;
+        }
+        for (unsigned int row = 0; row < d->height; row++) {
+            memcpy((char *)device->framebuffer + offset + row * stride, device->back_buffer + offset + row * stride,
+                   (size_t)d->width * coord_factor);
+        }
+    }
+    device->num_dirty = 0;
 
     return 0;
 }
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Host benchmark for the BGA back buffer. The frame buffer is malloc'd and
+ * the IO port registers are emulated, so it builds and runs on the host:
+ *
+ *   cc -O2 -I arch_include/x86 tests/bga_bench.c src/arch-x86/bga.c -o bga_bench
+ *   ./bga_bench
+ *
+ * It first checks that fill, blit and present produce the expected frame
+ * buffer contents, then times drawing a 200x200 square 100 times, pixel by
+ * pixel and with bga_fill_rect, each followed by bga_present. The fake frame
+ * buffer is ordinary cached memory, so this measures the CPU cost of the
+ * paths, not the saving in writes to uncached device memory.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bga/bga.h>
+
+#define WIDTH       1024
+#define HEIGHT      768
+#define BPP         32
+#define SQUARE      200
+#define ITERATIONS  100
+
+/* The BGA index and data ports, see bga.c */
+#define BGA_INDEX_PORT  0x1ce
+
+static uint16_t regs[16];
+static uint16_t index_reg;
+
+static void fake_write(uint16_t port, uint16_t value)
+{
+    if (port == BGA_INDEX_PORT) {
+        index_reg = value;
+    } else {
+        regs[index_reg % 16] = value;
+    }
+}
+
+static uint16_t fake_read(uint16_t port)
+{
+    return port == BGA_INDEX_PORT ? index_reg : regs[index_reg % 16];
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint32_t pixel_at(uint8_t *fb, unsigned int x, unsigned int y)
+{
+    uint32_t value;
+    memcpy(&value, fb + (y * WIDTH + x) * 4, sizeof(value));
+    return value;
+}
+
+static int check(uint8_t *fb)
+{
+    char colour[4] = {1, 2, 3, 0};
+    uint32_t source[6] = {7, 8, 9, 10, 11, 12};
+
+    memset(fb, 0, WIDTH * HEIGHT * 4);
+    bga_p device = bga_init(fb, fake_write, fake_read);
+    bga_set_mode(device, WIDTH, HEIGHT, BPP);
+    bga_set_double_buffered(device, true);
+
+    bga_fill_rect(device, 10, 10, 5, 3, colour);
+    /* clipped at the bottom right corner */
+    bga_blit_rect(device, WIDTH - 2, HEIGHT - 1, 3, 2, source, 3 * sizeof(uint32_t));
+    if (pixel_at(fb, 10, 10) != 0) {
+        printf("Drawing reached the frame buffer before bga_present\n");
+        return -1;
+    }
+    bga_present(device);
+
+    for (unsigned int y = 0; y < HEIGHT; y++) {
+        for (unsigned int x = 0; x < WIDTH; x++) {
+            uint32_t expected = 0;
+            if (x >= 10 && x < 15 && y >= 10 && y < 13) {
+                expected = 0x030201;
+            } else if (y == HEIGHT - 1 && x >= WIDTH - 2) {
+                expected = source[x - (WIDTH - 2)];
+            }
+            if (pixel_at(fb, x, y) != expected) {
+                printf("Pixel (%u, %u) is 0x%x, expected 0x%x\n", x, y, pixel_at(fb, x, y), expected);
+                return -1;
+            }
+        }
+    }
+    bga_destroy(device);
+    return 0;
+}
+
+int main(void)
+{
+    uint8_t *fb = malloc(WIDTH * HEIGHT * 4);
+    if (!fb) {
+        return 1;
+    }
+    if (check(fb)) {
+        return 1;
+    }
+
+    char colour[4] = {1, 2, 3, 0};
+    for (int buffered = 0; buffered < 2; buffered++) {
+        bga_p device = bga_init(fb, fake_write, fake_read);
+        bga_set_mode(device, WIDTH, HEIGHT, BPP);
+        bga_set_double_buffered(device, buffered);
+
+        double start = now_ns();
+        for (int i = 0; i < ITERATIONS; i++) {
+            for (unsigned int y = 0; y < SQUARE; y++) {
+                for (unsigned int x = 0; x < SQUARE; x++) {
+                    bga_set_pixel(device, x + i, y, colour);
+                }
+            }
+            bga_present(device);
+        }
+        double per_pixel = (now_ns() - start) / ITERATIONS;
+
+        start = now_ns();
+        for (int i = 0; i < ITERATIONS; i++) {
+            bga_fill_rect(device, i, 0, SQUARE, SQUARE, colour);
+            bga_present(device);
+        }
+        double fill = (now_ns() - start) / ITERATIONS;
+
+        printf("%s: set_pixel %8.1f us, fill_rect %8.1f us per %ux%u square and present\n",
+               buffered ? "back buffer" : "direct     ", per_pixel / 1000, fill / 1000, SQUARE, SQUARE);
+        bga_destroy(device);
+    }
+    free(fb);
+    return 0;
+}
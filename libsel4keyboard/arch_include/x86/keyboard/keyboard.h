@@ -18,10 +18,26 @@
  * interrupts then this is the irq number they will appear on */
 #define KEYBOARD_IRQ 1
 
+/* Number of scancode bytes that can be queued by sel4keyboard_handle_irq
+ * before further input is dropped. Must be a power of two.
+ */
+#define SEL4KEYBOARD_RING_SIZE 256
+
 /* Callbacks used below. */
 typedef uint8_t (*in8_fn)(uint16_t port);
 typedef void (*out8_fn)(uint16_t port, uint8_t value);
 
+/* Called by sel4keyboard_handle_irq after it has queued new scancodes, e.g.
+ * to signal a notification the reader is waiting on.
+ */
+typedef void (*sel4keyboard_notify_fn)(void *cookie);
+
+/* Called by sel4keyboard_wait_scancode to block until
+ * sel4keyboard_handle_irq might have queued more scancodes, e.g. by waiting
+ * on the keyboard IRQ notification and calling sel4keyboard_handle_irq.
+ */
+typedef void (*sel4keyboard_wait_fn)(void *cookie);
+
 /* Initialise the driver.
  *  enable_interrupt - Set the keyboard controller to generate interrupts
  *      when scancodes are generated.
@@ -34,7 +50,40 @@ void sel4keyboard_init(int enable_interrupt, in8_fn in8, out8_fn out8);
  */
 void sel4keyboard_reset(void);
 
-/* Read a scancode. Returns 0 if there wasn't one.
+/* Read a scancode. Returns 0 if there wasn't one. Scancodes queued by
+ * sel4keyboard_handle_irq are returned first. The controller is only polled
+ * until sel4keyboard_handle_irq or sel4keyboard_set_notify is first called,
+ * after which this only reads the queue. The first of those calls must not
+ * run concurrently with this.
  *  scancode - Location to store the read scancode
  */
 int sel4keyboard_get_scancode(int *scancode);
+
+/* Set a function to call when sel4keyboard_handle_irq queues scancodes. Pass
+ * NULL to stop notifications.
+ */
+void sel4keyboard_set_notify(sel4keyboard_notify_fn notify, void *cookie);
+
+/* Handle a keyboard interrupt by moving every byte waiting in the controller
+ * into the scancode queue. The caller still has to acknowledge the IRQ. This
+ * may run on a different thread to the reader. Returns the number of bytes
+ * queued. Bytes that arrive while the queue is full are dropped.
+ */
+int sel4keyboard_handle_irq(void);
+
+/* Take a scancode from the queue filled by sel4keyboard_handle_irq without
+ * touching the controller. Returns 0 if the queue was empty.
+ *  scancode - Location to store the read scancode
+ */
+int sel4keyboard_read_scancode(int *scancode);
+
+/* Take a scancode from the queue filled by sel4keyboard_handle_irq, calling
+ * wait until one is available.
+ *  scancode - Location to store the read scancode
+ *  wait - Function that blocks until more scancodes may have been queued
+ *  cookie - Passed to wait
+ */
+void sel4keyboard_wait_scancode(int *scancode, sel4keyboard_wait_fn wait, void *cookie);
+
+/* Get the number of scancode bytes dropped because the queue was full. */
+unsigned int sel4keyboard_dropped(void);
@@ -10,6 +10,7 @@
  * @TAG(DATA61_BSD)
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <keyboard/keyboard.h>
 #include <assert.h>
@@ -52,9 +53,37 @@
 #define KEYBOARD_CCB_IRQ_ENABLE     0x01
 #define KEYBOARD_CCB_IRQ_DISABLE    0x00
 
+/* Bit of the status register (read from KEYBOARD_INPUT_CONTROL) that is set
+ * while a byte is waiting in KEYBOARD_OUTPUT_BUFFER.
+ */
+#define KEYBOARD_STATUS_OUTPUT_FULL 0x01
+
+/* Upper bound on bytes taken from the controller in one interrupt, so that a
+ * misbehaving device can't keep the handler spinning.
+ */
+#define KEYBOARD_IRQ_MAX_DRAIN      16
+
 static in8_fn io_in8;
 static out8_fn io_out8;
 
+/* Scancodes received by sel4keyboard_handle_irq. It is single producer (the
+ * interrupt handler) and single consumer (the reader), so the indices are
+ * only ever written by one side each and no lock is needed.
+ */
+static struct {
+    uint8_t data[SEL4KEYBOARD_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    /* Set once the interrupt path is in use. From then on only
+     * sel4keyboard_handle_irq reads the controller, as a second reader could
+     * take a byte out of order while a drain is still unpublished.
+     */
+    bool irq_mode;
+    sel4keyboard_notify_fn notify;
+    void *cookie;
+} ring;
+
 static inline uint8_t ps2_poll_output(void)
 {
     return io_in8(KEYBOARD_OUTPUT_BUFFER);
@@ -67,7 +96,7 @@ static uint8_t _ps2_read_control(void)
 
 static inline uint8_t ps2_read_output(void)
 {
-    while ((_ps2_read_control() & 0x1) == 0);
+    while ((_ps2_read_control() & KEYBOARD_STATUS_OUTPUT_FULL) == 0);
     return ps2_poll_output();
 }
 
@@ -132,12 +161,95 @@ void sel4keyboard_reset()
     ps2_single_control(0xA7);
 }
 
+static int ring_pop(int *scancode)
+{
+    uint32_t tail = ring.tail;
+    /* Pairs with the release in sel4keyboard_handle_irq so the byte is
+     * visible before the index that publishes it.
+     */
+    if (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail) {
+        return 0;
+    }
+    *scancode = ring.data[tail % SEL4KEYBOARD_RING_SIZE];
+    /* The byte must be read before the slot is handed back. */
+    __atomic_store_n(&ring.tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
 int sel4keyboard_get_scancode(int *scancode)
 {
+    /* Anything already queued by the interrupt handler comes first. */
+    if (ring_pop(scancode)) {
+        return 1;
+    }
+    if (__atomic_load_n(&ring.irq_mode, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
     /* see if there is a waiting scancode */
-    if ((_ps2_read_control() & 0x1) == 0) {
+    if ((_ps2_read_control() & KEYBOARD_STATUS_OUTPUT_FULL) == 0) {
         return 0;
     }
     *scancode = ps2_poll_output();
     return 1;
 }
+
+void sel4keyboard_set_notify(sel4keyboard_notify_fn notify, void *cookie)
+{
+    ring.notify = notify;
+    ring.cookie = cookie;
+    __atomic_store_n(&ring.irq_mode, true, __ATOMIC_RELEASE);
+}
+
+int sel4keyboard_handle_irq(void)
+{
+    uint32_t head = ring.head;
+    int queued = 0;
+
+    __atomic_store_n(&ring.irq_mode, true, __ATOMIC_RELEASE);
+
+    /* Take everything the controller has, not just the byte that raised the
+     * interrupt, as multi-byte scancodes often arrive back to back.
+     */
+    for (int i = 0; i < KEYBOARD_IRQ_MAX_DRAIN; i++) {
+        if ((_ps2_read_control() & KEYBOARD_STATUS_OUTPUT_FULL) == 0) {
+            break;
+        }
+        uint8_t byte = ps2_poll_output();
+        if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == SEL4KEYBOARD_RING_SIZE) {
+            /* The reader has fallen too far behind. The byte still has to be
+             * read to clear the interrupt.
+             */
+            ring.dropped++;
+            continue;
+        }
+        ring.data[head % SEL4KEYBOARD_RING_SIZE] = byte;
+        head++;
+        queued++;
+    }
+
+    if (queued) {
+        /* Publish all of the bytes at once, then wake the reader. */
+        __atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+        if (ring.notify) {
+            ring.notify(ring.cookie);
+        }
+    }
+    return queued;
+}
+
+int sel4keyboard_read_scancode(int *scancode)
+{
+    return ring_pop(scancode);
+}
+
+void sel4keyboard_wait_scancode(int *scancode, sel4keyboard_wait_fn wait, void *cookie)
+{
+    while (!ring_pop(scancode)) {
+        wait(cookie);
+    }
+}
+
+unsigned int sel4keyboard_dropped(void)
+{
+    return ring.dropped;
+}
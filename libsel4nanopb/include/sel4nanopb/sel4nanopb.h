@@ -17,3 +17,54 @@
 /* bind a nanopb stream to the IPC buffer of the thread */
 pb_ostream_t pb_ostream_from_IPC(seL4_Word offset);
 pb_istream_t pb_istream_from_IPC(seL4_Word offset);
+
+/*
+ * Streams over a shared memory region that is used in chunks: the encoder
+ * writes straight into the region and calls flush whenever it is full (and
+ * once more from pb_ostream_region_flush at the end), the decoder reads
+ * straight out of it and calls refill whenever it has consumed everything.
+ * This allows messages larger than the region without intermediate copies.
+ */
+typedef struct sel4nanopb_region {
+    pb_byte_t *buffer;
+    size_t size;
+    /* bytes written (ostream) or consumed (istream) in the current chunk */
+    size_t pos;
+    /* bytes available in the current chunk (istream) */
+    size_t fill;
+    /* hand buffer[0, pos) to the reader, after which it is reused from the start */
+    bool (*flush)(struct sel4nanopb_region *region, void *cookie);
+    /* wait for the next chunk and set fill to its size, zero at the end of the stream */
+    bool (*refill)(struct sel4nanopb_region *region, void *cookie);
+    void *cookie;
+} sel4nanopb_region_t;
+
+pb_ostream_t pb_ostream_from_region(sel4nanopb_region_t *region);
+/* flush whatever the encoder left in the region */
+bool pb_ostream_region_flush(pb_ostream_t *stream);
+/* fill should hold the size of the first chunk, or be 0 to refill before the first read */
+pb_istream_t pb_istream_from_region(sel4nanopb_region_t *region);
+
+/*
+ * Streams over a single producer, single consumer byte ring in shared memory.
+ * The header and data live in the shared region; size must be a power of two.
+ * When the ring is full (ostream) or empty (istream) wait is called, which
+ * should notify the other side and block until it has made progress, or return
+ * false to abort the stream.
+ */
+typedef struct sel4nanopb_ring_header {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} sel4nanopb_ring_header_t;
+
+typedef struct sel4nanopb_ring {
+    sel4nanopb_ring_header_t *header;
+    pb_byte_t *data;
+    size_t size;
+    bool (*wait)(struct sel4nanopb_ring *ring, void *cookie);
+    void *cookie;
+} sel4nanopb_ring_t;
+
+pb_ostream_t pb_ostream_from_ring(sel4nanopb_ring_t *ring);
+/* an istream from a ring has no length, so decoding stops at the end of a delimited message */
+pb_istream_t pb_istream_from_ring(sel4nanopb_ring_t *ring);
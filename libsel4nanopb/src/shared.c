@@ -0,0 +1,180 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#include <stdint.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <utils/fence.h>
+#include <utils/util.h>
+#include <sel4nanopb/sel4nanopb.h>
+
+static bool region_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    sel4nanopb_region_t *region = stream->state;
+
+    while (count > 0) {
+        if (region->pos == region->size) {
+            if (!region->flush(region, region->cookie)) {
+                PB_RETURN_ERROR(stream, "region flush failed");
+            }
+            region->pos = 0;
+        }
+        size_t chunk = MIN(count, region->size - region->pos);
+        memcpy(region->buffer + region->pos, buf, chunk);
+        region->pos += chunk;
+        buf += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+pb_ostream_t pb_ostream_from_region(sel4nanopb_region_t *region)
+{
+    region->pos = 0;
+    pb_ostream_t stream = {
+        .callback = region_write,
+        .state = region,
+        .max_size = SIZE_MAX,
+        .bytes_written = 0,
+    };
+    return stream;
+}
+
+bool pb_ostream_region_flush(pb_ostream_t *stream)
+{
+    sel4nanopb_region_t *region = stream->state;
+    if (region->pos == 0) {
+        return true;
+    }
+    if (!region->flush(region, region->cookie)) {
+        PB_RETURN_ERROR(stream, "region flush failed");
+    }
+    region->pos = 0;
+    return true;
+}
+
+static bool region_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+    sel4nanopb_region_t *region = stream->state;
+
+    while (count > 0) {
+        if (region->pos == region->fill) {
+            region->pos = 0;
+            region->fill = 0;
+            if (!region->refill(region, region->cookie)) {
+                PB_RETURN_ERROR(stream, "region refill failed");
+            }
+            if (region->fill == 0) {
+                /* end of stream */
+                stream->bytes_left = 0;
+                return false;
+            }
+        }
+        size_t chunk = MIN(count, region->fill - region->pos);
+        memcpy(buf, region->buffer + region->pos, chunk);
+        buf += chunk;
+        region->pos += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+pb_istream_t pb_istream_from_region(sel4nanopb_region_t *region)
+{
+    region->pos = 0;
+    pb_istream_t stream = {
+        .callback = region_read,
+        .state = region,
+        .bytes_left = SIZE_MAX,
+    };
+    return stream;
+}
+
+static bool ring_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    sel4nanopb_ring_t *ring = stream->state;
+    uint32_t head = ring->header->head;
+
+    while (count > 0) {
+        size_t space = ring->size - (head - ring->header->tail);
+        if (space == 0) {
+            if (!ring->wait(ring, ring->cookie)) {
+                PB_RETURN_ERROR(stream, "ring wait failed");
+            }
+            continue;
+        }
+        /* the tail has to be read before overwriting what it released */
+        THREAD_MEMORY_ACQUIRE();
+
+        size_t offset = head & (ring->size - 1);
+        size_t chunk = MIN(MIN(count, space), ring->size - offset);
+        memcpy(ring->data + offset, buf, chunk);
+        buf += chunk;
+        count -= chunk;
+        head += chunk;
+
+        THREAD_MEMORY_RELEASE();
+        ring->header->head = head;
+    }
+    return true;
+}
+
+pb_ostream_t pb_ostream_from_ring(sel4nanopb_ring_t *ring)
+{
+    pb_ostream_t stream = {
+        .callback = ring_write,
+        .state = ring,
+        .max_size = SIZE_MAX,
+        .bytes_written = 0,
+    };
+    return stream;
+}
+
+static bool ring_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+    sel4nanopb_ring_t *ring = stream->state;
+    uint32_t tail = ring->header->tail;
+
+    while (count > 0) {
+        size_t avail = ring->header->head - tail;
+        if (avail == 0) {
+            if (!ring->wait(ring, ring->cookie)) {
+                stream->bytes_left = 0;
+                PB_RETURN_ERROR(stream, "ring wait failed");
+            }
+            continue;
+        }
+        THREAD_MEMORY_ACQUIRE();
+
+        size_t offset = tail & (ring->size - 1);
+        size_t chunk = MIN(MIN(count, avail), ring->size - offset);
+        memcpy(buf, ring->data + offset, chunk);
+        buf += chunk;
+        count -= chunk;
+        tail += chunk;
+
+        /* done reading before releasing the space to the producer */
+        THREAD_MEMORY_RELEASE();
+        ring->header->tail = tail;
+    }
+    return true;
+}
+
+pb_istream_t pb_istream_from_ring(sel4nanopb_ring_t *ring)
+{
+    pb_istream_t stream = {
+        .callback = ring_read,
+        .state = ring,
+        .bytes_left = SIZE_MAX,
+    };
+    return stream;
+}
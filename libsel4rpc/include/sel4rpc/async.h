@@ -0,0 +1,109 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sel4/sel4.h>
+
+/*
+ * Asynchronous RPC over a shared memory region.
+ *
+ * The region holds a submission ring (client to server) and a completion ring
+ * (server to client). Each slot carries a protobuf encoded RpcMessage of up to
+ * slot_size bytes, tagged with a caller chosen id that is echoed back in the
+ * completion, so any number of requests can be outstanding and completions
+ * can be matched up out of order. Each side signals the other's notification
+ * after producing a batch of entries.
+ *
+ * Caps cannot be transferred through shared memory: requests that return a cap
+ * still have to go through the synchronous sel4rpc_call. Every message
+ * currently in rpc.proto returns a cap, so this transport only carries
+ * messages added to rpc.proto by the user of the library.
+ */
+
+struct _RpcMessage;
+typedef struct _RpcMessage RpcMessage;
+
+/* shared ring indices, each on its own cache line */
+typedef struct sel4rpc_ring_header {
+    volatile uint32_t head;
+    char pad0[64 - sizeof(uint32_t)];
+    volatile uint32_t tail;
+    char pad1[64 - sizeof(uint32_t)];
+} sel4rpc_ring_header_t;
+
+typedef struct sel4rpc_ring {
+    sel4rpc_ring_header_t *header;
+    char *slots;
+    uint32_t num_slots;
+    size_t slot_size;
+} sel4rpc_ring_t;
+
+typedef struct sel4rpc_async {
+    /* client produces into sq and consumes from cq, the server the reverse */
+    sel4rpc_ring_t sq;
+    sel4rpc_ring_t cq;
+    /* notification of the other side, signalled after producing entries */
+    seL4_CPtr signal;
+    /* notification of this side, waited on for new entries */
+    seL4_CPtr wait;
+} sel4rpc_async_t;
+
+/*
+ * Handler run by the server for each submission. It fills in reply, which is
+ * posted to the completion ring with the id of the request.
+ */
+typedef int (*sel4rpc_async_handler_t)(void *data, RpcMessage *request, RpcMessage *reply);
+
+/*
+ * Attach to a shared region. Both sides must pass the same size and slot_size,
+ * and the region must be zeroed before either side starts using it.
+ * @param async         async rpc handle to initialise
+ * @param shared        local mapping of the shared region
+ * @param shared_size   size of the shared region in bytes
+ * @param slot_size     maximum encoded size of a single message, plus header
+ * @param signal        notification to signal the other side on
+ * @param wait          notification this side waits on
+ * @return 0 on success, -1 if the region cannot hold at least one slot per ring
+ */
+int sel4rpc_async_init(sel4rpc_async_t *async, void *shared, size_t shared_size,
+                       size_t slot_size, seL4_CPtr signal, seL4_CPtr wait);
+
+/*
+ * Queue a request without notifying the server, so that several requests can
+ * be submitted before a single sel4rpc_async_kick.
+ * @return 0 on success, -1 if the submission ring is full or msg does not fit a slot
+ */
+int sel4rpc_async_submit(sel4rpc_async_t *async, RpcMessage *msg, uint64_t id);
+
+/* Notify the other side that new entries are available */
+void sel4rpc_async_kick(sel4rpc_async_t *async);
+
+/*
+ * Dequeue a completion if one is available.
+ * @return 1 if reply and id were filled in, 0 if there was no completion, -1 on a decode error
+ */
+int sel4rpc_async_poll(sel4rpc_async_t *async, RpcMessage *reply, uint64_t *id);
+
+/* As sel4rpc_async_poll, but blocks on the notification until a completion arrives */
+int sel4rpc_async_wait(sel4rpc_async_t *async, RpcMessage *reply, uint64_t *id);
+
+/*
+ * Server side: handle pending submissions, as long as there is room in the
+ * completion ring and at most one ring's worth per call, and notify the client
+ * once for the whole batch.
+ * @return number of requests handled
+ */
+int sel4rpc_async_server_process(sel4rpc_async_t *async, sel4rpc_async_handler_t handler, void *data);
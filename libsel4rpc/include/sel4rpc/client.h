@@ -25,3 +25,9 @@ typedef struct sel4rpc_client_env {
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic);
 int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
                  seL4_CPtr capPtr, seL4_Word capDepth);
+/*
+ * Send a memory_batch request along with a cap to the CNode that the
+ * server should allocate the objects into (or delete them from).
+ * On return msg->msg.ret holds the error code and one cookie per object.
+ */
+int sel4rpc_call_batch(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr cnode);
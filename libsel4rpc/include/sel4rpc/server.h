@@ -19,9 +19,49 @@
 
 #define SEL4RPC_MSG_MAGIC (0xcafed00d)
 
+/* upper bound (exclusive) on the RpcMessage tags that can have a handler registered */
+#define SEL4RPC_MAX_HANDLERS (32)
+
 struct sel4rpc_env;
 
 typedef int (*sel4rpc_handler_t)(struct sel4rpc_env *env, void *data, RpcMessage *rpcMsg);
+typedef void (*sel4rpc_lock_fn_t)(void *lock_data);
+typedef uint64_t (*sel4rpc_clock_fn_t)(void);
+
+/* updated atomically, so workers do not contend on a lock for them */
+typedef struct sel4rpc_server_stats {
+    uint64_t count;
+    uint64_t errors;
+    /* time spent in the handler once its lock is held, in units of the
+     * dispatch clock, zero if there is none */
+    uint64_t total_time;
+    uint64_t max_time;
+} sel4rpc_server_stats_t;
+
+/*
+ * Handler table shared by any number of server threads receiving on the same
+ * endpoint. Each handler runs under its own lock, if it has one. Handlers
+ * registered as serialised use the table's lock, which is needed for anything
+ * that touches the (not thread safe) vka.
+ */
+typedef struct sel4rpc_dispatch {
+    struct sel4rpc_dispatch_entry {
+        sel4rpc_handler_t handler;
+        void *data;
+        sel4rpc_lock_fn_t lock;
+        sel4rpc_lock_fn_t unlock;
+        void *lock_data;
+    } handlers[SEL4RPC_MAX_HANDLERS];
+
+    sel4rpc_lock_fn_t lock;
+    sel4rpc_lock_fn_t unlock;
+    void *lock_data;
+
+    sel4rpc_clock_fn_t clock;
+
+    sel4rpc_server_stats_t stats[SEL4RPC_MAX_HANDLERS];
+} sel4rpc_dispatch_t;
+
 typedef struct sel4rpc_env {
     vka_t *vka;
 
@@ -31,11 +71,76 @@ typedef struct sel4rpc_env {
     void *data;
 
     simple_t *simple;
+
+    /* slot that client CNode caps for batch requests are received into,
+     * seL4_CapNull unless sel4rpc_server_enable_cap_recv was called */
+    cspacepath_t cap_recv;
+
+    /* message info of the request being handled, used to check
+     * whether a cap was actually transferred into cap_recv */
+    seL4_MessageInfo_t recv_info;
+
+    /* the request being handled used the fixed-layout encoding,
+     * so the reply is sent in it too */
+    bool fast_reply;
+
+    /* handler table used if no handler function was given */
+    sel4rpc_dispatch_t *dispatch;
 } sel4rpc_server_env_t;
 
 int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
                         sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple);
+/*
+ * Allocate a slot for receiving client CNode caps and set it as the cap
+ * receive path of the calling thread. Batch requests are rejected unless
+ * this has been called from the thread that receives on the endpoint.
+ */
+int sel4rpc_server_enable_cap_recv(sel4rpc_server_env_t *env);
+/*
+ * Handle a request that has just been received. sel4rpc_server_recv_info
+ * takes the message info returned by the receive, which batch requests need
+ * to check that the client's CNode cap arrived. sel4rpc_server_recv assumes
+ * no cap was transferred, so batch requests handled through it fail.
+ */
 int sel4rpc_server_recv(sel4rpc_server_env_t *env);
+int sel4rpc_server_recv_info(sel4rpc_server_env_t *env, seL4_MessageInfo_t info);
 int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie);
 int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg);
 
+/*
+ * Initialise a handler table with the handlers for the messages in rpc.proto.
+ * lock and unlock may be NULL if only one thread serves the endpoint, and
+ * clock may be NULL if handler latency should not be measured.
+ */
+int sel4rpc_dispatch_init(sel4rpc_dispatch_t *dispatch, sel4rpc_lock_fn_t lock,
+                          sel4rpc_lock_fn_t unlock, void *lock_data, sel4rpc_clock_fn_t clock);
+/*
+ * Install (or replace) the handler for the RpcMessage member with tag which_msg.
+ * If serialise is set it runs under the table's lock, otherwise under no lock.
+ */
+int sel4rpc_dispatch_register(sel4rpc_dispatch_t *dispatch, pb_size_t which_msg,
+                              sel4rpc_handler_t handler, void *data, bool serialise);
+/*
+ * As sel4rpc_dispatch_register, but the handler runs under the given lock, so
+ * handlers that share state can be serialised without holding up the rest of
+ * the table. lock and unlock may be NULL for a handler that needs no lock.
+ */
+int sel4rpc_dispatch_register_locked(sel4rpc_dispatch_t *dispatch, pb_size_t which_msg,
+                                     sel4rpc_handler_t handler, void *data,
+                                     sel4rpc_lock_fn_t lock, sel4rpc_lock_fn_t unlock, void *lock_data);
+/* Print per message counts and handler latencies */
+void sel4rpc_dispatch_print_stats(sel4rpc_dispatch_t *dispatch);
+void sel4rpc_server_set_dispatch(sel4rpc_server_env_t *env, sel4rpc_dispatch_t *dispatch);
+
+/*
+ * Set up the state of an additional server thread, sharing everything but the
+ * reply object and the cap receive slot with parent.
+ */
+int sel4rpc_server_worker_init(sel4rpc_server_env_t *worker, sel4rpc_server_env_t *parent,
+                               vka_object_t *reply);
+/*
+ * Receive and handle requests on ep forever. Run by each thread serving the
+ * endpoint, with its own env.
+ */
+void sel4rpc_server_run(sel4rpc_server_env_t *env, seL4_CPtr ep, seL4_Word magic);
+
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <string.h>
+#include <rpc.pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <sel4rpc/async.h>
+
+#include <utils/fence.h>
+#include <utils/util.h>
+#include <utils/zf_log.h>
+
+typedef struct sel4rpc_slot {
+    uint64_t id;
+    uint32_t length;
+    uint32_t pad;
+    uint8_t data[];
+} sel4rpc_slot_t;
+
+static size_t ring_bytes(uint32_t num_slots, size_t slot_size)
+{
+    return sizeof(sel4rpc_ring_header_t) + num_slots * slot_size;
+}
+
+static void ring_init(sel4rpc_ring_t *ring, char *base, uint32_t num_slots, size_t slot_size)
+{
+    ring->header = (sel4rpc_ring_header_t *) base;
+    ring->slots = base + sizeof(sel4rpc_ring_header_t);
+    ring->num_slots = num_slots;
+    ring->slot_size = slot_size;
+}
+
+static sel4rpc_slot_t *ring_slot(sel4rpc_ring_t *ring, uint32_t index)
+{
+    return (sel4rpc_slot_t *)(ring->slots + (index & (ring->num_slots - 1)) * ring->slot_size);
+}
+
+static bool ring_full(sel4rpc_ring_t *ring)
+{
+    return ring->header->head - ring->header->tail == ring->num_slots;
+}
+
+static bool ring_empty(sel4rpc_ring_t *ring)
+{
+    return ring->header->head == ring->header->tail;
+}
+
+/* encode msg into the slot at head and publish it */
+static int ring_produce(sel4rpc_ring_t *ring, RpcMessage *msg, uint64_t id)
+{
+    if (ring_full(ring)) {
+        return -1;
+    }
+
+    sel4rpc_slot_t *slot = ring_slot(ring, ring->header->head);
+    pb_ostream_t stream = pb_ostream_from_buffer(slot->data, ring->slot_size - sizeof(*slot));
+    if (!pb_encode(&stream, &RpcMessage_msg, msg)) {
+        ZF_LOGE("Failed to encode message (%s)", PB_GET_ERROR(&stream));
+        return -1;
+    }
+    slot->id = id;
+    slot->length = stream.bytes_written;
+
+    /* the slot contents must be visible before the new head */
+    THREAD_MEMORY_RELEASE();
+    ring->header->head++;
+    return 0;
+}
+
+/* decode the slot at tail and release it */
+static int ring_consume(sel4rpc_ring_t *ring, RpcMessage *msg, uint64_t *id)
+{
+    if (ring_empty(ring)) {
+        return 0;
+    }
+    THREAD_MEMORY_ACQUIRE();
+
+    sel4rpc_slot_t *slot = ring_slot(ring, ring->header->tail);
+    size_t length = MIN(slot->length, ring->slot_size - sizeof(*slot));
+    pb_istream_t stream = pb_istream_from_buffer(slot->data, length);
+    bool ok = pb_decode(&stream, &RpcMessage_msg, msg);
+    *id = slot->id;
+
+    /* finish reading the slot before handing it back to the producer */
+    THREAD_MEMORY_RELEASE();
+    ring->header->tail++;
+
+    if (!ok) {
+        ZF_LOGE("Failed to decode message (%s)", PB_GET_ERROR(&stream));
+        return -1;
+    }
+    return 1;
+}
+
+int sel4rpc_async_init(sel4rpc_async_t *async, void *shared, size_t shared_size,
+                       size_t slot_size, seL4_CPtr signal, seL4_CPtr wait)
+{
+    slot_size = ROUND_UP(slot_size, sizeof(uint64_t));
+    if (slot_size <= sizeof(sel4rpc_slot_t)) {
+        ZF_LOGE("Slot size %zu too small", slot_size);
+        return -1;
+    }
+
+    /* largest power of two number of slots that fits both rings */
+    uint32_t num_slots = 1;
+    if (2 * ring_bytes(num_slots, slot_size) > shared_size) {
+        ZF_LOGE("Shared region of %zu bytes too small", shared_size);
+        return -1;
+    }
+    while (2 * ring_bytes(num_slots * 2, slot_size) <= shared_size) {
+        num_slots *= 2;
+    }
+
+    char *base = shared;
+    ring_init(&async->sq, base, num_slots, slot_size);
+    ring_init(&async->cq, base + ring_bytes(num_slots, slot_size), num_slots, slot_size);
+    async->signal = signal;
+    async->wait = wait;
+    return 0;
+}
+
+int sel4rpc_async_submit(sel4rpc_async_t *async, RpcMessage *msg, uint64_t id)
+{
+    return ring_produce(&async->sq, msg, id);
+}
+
+void sel4rpc_async_kick(sel4rpc_async_t *async)
+{
+    seL4_Signal(async->signal);
+}
+
+int sel4rpc_async_poll(sel4rpc_async_t *async, RpcMessage *reply, uint64_t *id)
+{
+    /* the server stops processing when the completion ring fills up,
+     * so let it know once there is room again */
+    bool was_full = ring_full(&async->cq);
+    int ret = ring_consume(&async->cq, reply, id);
+    if (ret != 0 && was_full) {
+        sel4rpc_async_kick(async);
+    }
+    return ret;
+}
+
+int sel4rpc_async_wait(sel4rpc_async_t *async, RpcMessage *reply, uint64_t *id)
+{
+    int ret;
+    while ((ret = sel4rpc_async_poll(async, reply, id)) == 0) {
+        seL4_Wait(async->wait, NULL);
+    }
+    return ret;
+}
+
+int sel4rpc_async_server_process(sel4rpc_async_t *async, sel4rpc_async_handler_t handler, void *data)
+{
+    int handled = 0;
+    RpcMessage request;
+    RpcMessage reply;
+    uint64_t id;
+
+    /* bound the work done per call, a client refilling the ring as fast as
+     * it drains would otherwise keep the server here indefinitely */
+    while (handled < async->sq.num_slots && !ring_full(&async->cq)) {
+        int ret = ring_consume(&async->sq, &request, &id);
+        if (ret == 0) {
+            break;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        if (ret < 0 || handler(data, &request, &reply)) {
+            reply.which_msg = RpcMessage_ret_tag;
+            reply.msg.ret.errorCode = 1;
+        }
+
+        if (ring_produce(&async->cq, &reply, id)) {
+            /* the reply does not fit a slot, report the failure instead */
+            memset(&reply, 0, sizeof(reply));
+            reply.which_msg = RpcMessage_ret_tag;
+            reply.msg.ret.errorCode = 1;
+            ring_produce(&async->cq, &reply, id);
+        }
+        handled++;
+    }
+
+    if (handled) {
+        sel4rpc_async_kick(async);
+    }
+    return handled;
+}
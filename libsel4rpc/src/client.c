@@ -19,6 +19,8 @@
 
 #include <utils/zf_log.h>
 
+#include "fastpath.h"
+
 #define IPC_RESERVED_WORDS (1)
 
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic)
@@ -27,20 +29,24 @@ int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word
     client->magic = magic;
 }
 
-int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
-                 seL4_CPtr capPtr, seL4_Word capDepth)
+static int sel4rpc_do_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_Word extra_caps,
+                           seL4_CPtr root, seL4_CPtr capPtr, seL4_Word capDepth)
 {
-    pb_ostream_t stream = pb_ostream_from_IPC(IPC_RESERVED_WORDS);
-    bool ret = pb_encode_delimited(&stream, &RpcMessage_msg, msg);
-    if (!ret) {
-        ZF_LOGE("Failed to encode message (%s)", PB_GET_ERROR(&stream));
-        return -1;
-    }
+    /* use the fixed layout if the message has one, protobuf otherwise */
+    size_t stream_size = sel4rpc_fast_encode(msg, IPC_RESERVED_WORDS);
+    if (stream_size == 0) {
+        pb_ostream_t stream = pb_ostream_from_IPC(IPC_RESERVED_WORDS);
+        bool ret = pb_encode_delimited(&stream, &RpcMessage_msg, msg);
+        if (!ret) {
+            ZF_LOGE("Failed to encode message (%s)", PB_GET_ERROR(&stream));
+            return -1;
+        }
 
-    size_t stream_size = stream.bytes_written / sizeof(seL4_Word);
-    /* add an extra word if bytes_written is not divisible by sizeof(seL4_Word). */
-    if (stream.bytes_written % sizeof(seL4_Word)) {
-        stream_size += 1;
+        stream_size = stream.bytes_written / sizeof(seL4_Word);
+        /* add an extra word if bytes_written is not divisible by sizeof(seL4_Word). */
+        if (stream.bytes_written % sizeof(seL4_Word)) {
+            stream_size += 1;
+        }
     }
 
     /* add an extra word for the magic header */
@@ -50,14 +56,37 @@ int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
     seL4_SetCapReceivePath(root, capPtr, capDepth);
     /* set magic header */
     seL4_SetMR(0, client->magic);
-    seL4_Call(client->server_ep, seL4_MessageInfo_new(0, 0, 0, stream_size));
+    seL4_Call(client->server_ep, seL4_MessageInfo_new(0, 0, extra_caps, stream_size));
+
+    if (sel4rpc_fast_decode(msg, 0)) {
+        return 0;
+    }
 
     pb_istream_t istream = pb_istream_from_IPC(0);
-    ret = pb_decode_delimited(&istream, &RpcMessage_msg, msg);
+    bool ret = pb_decode_delimited(&istream, &RpcMessage_msg, msg);
     if (!ret) {
-        ZF_LOGE("Failed to decode server reply (%s)", PB_GET_ERROR(&stream));
+        ZF_LOGE("Failed to decode server reply (%s)", PB_GET_ERROR(&istream));
         return -1;
     }
 
     return 0;
 }
+
+int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
+                 seL4_CPtr capPtr, seL4_Word capDepth)
+{
+    return sel4rpc_do_call(client, msg, 0, root, capPtr, capDepth);
+}
+
+int sel4rpc_call_batch(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr cnode)
+{
+    if (msg->which_msg != RpcMessage_memory_batch_tag) {
+        ZF_LOGE("Batch call requires a memory_batch message");
+        return -1;
+    }
+
+    /* the server places (or deletes) the caps directly in this CNode,
+     * so nothing is transferred back in the reply */
+    seL4_SetCap(0, cnode);
+    return sel4rpc_do_call(client, msg, 1, seL4_CapNull, seL4_CapNull, 0);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <stdbool.h>
+#include <sel4/sel4.h>
+#include <rpc.pb.h>
+#include <utils/util.h>
+
+#include "fastpath.h"
+
+enum sel4rpc_fast_type {
+    SEL4RPC_FAST_RET = 1,
+    SEL4RPC_FAST_MEMORY,
+    SEL4RPC_FAST_IOPORT,
+    SEL4RPC_FAST_IRQ_SIMPLE,
+    SEL4RPC_FAST_IRQ_IOAPIC,
+    SEL4RPC_FAST_IRQ_MSI,
+};
+
+#define FITS_WORD(v) ((uint64_t)(seL4_Word)(v) == (uint64_t)(v))
+
+static seL4_Word fast_tag(enum sel4rpc_fast_type type)
+{
+    return ((seL4_Word) type << SEL4RPC_FAST_TYPE_SHIFT) | SEL4RPC_FAST_MAGIC;
+}
+
+static seL4_Word fast_put(seL4_Word offset, enum sel4rpc_fast_type type,
+                          const uint64_t *fields, seL4_Word nfields)
+{
+    for (seL4_Word i = 0; i < nfields; i++) {
+        if (!FITS_WORD(fields[i])) {
+            return 0;
+        }
+    }
+
+    seL4_SetMR(offset, fast_tag(type));
+    for (seL4_Word i = 0; i < nfields; i++) {
+        seL4_SetMR(offset + 1 + i, fields[i]);
+    }
+    return nfields + 1;
+}
+
+seL4_Word sel4rpc_fast_encode(RpcMessage *msg, seL4_Word offset)
+{
+    switch (msg->which_msg) {
+    case RpcMessage_ret_tag: {
+        ReturnMessage *ret = &msg->msg.ret;
+        if (ret->cookies_count) {
+            return 0;
+        }
+        uint64_t fields[] = { ret->errorCode, ret->cookie };
+        return fast_put(offset, SEL4RPC_FAST_RET, fields, ARRAY_SIZE(fields));
+    }
+    case RpcMessage_memory_tag: {
+        MemoryAllocMessage *mem = &msg->msg.memory;
+        uint64_t fields[] = { mem->address, mem->size_bits, mem->type, mem->action };
+        return fast_put(offset, SEL4RPC_FAST_MEMORY, fields, ARRAY_SIZE(fields));
+    }
+    case RpcMessage_ioport_tag: {
+        IOPortMessage *ioport = &msg->msg.ioport;
+        uint64_t fields[] = { ioport->start, ioport->end };
+        return fast_put(offset, SEL4RPC_FAST_IOPORT, fields, ARRAY_SIZE(fields));
+    }
+    case RpcMessage_irq_tag:
+        switch (msg->msg.irq.which_type) {
+        case IrqAllocMessage_simple_tag: {
+            IrqAllocMessageSimple *simple = &msg->msg.irq.type.simple;
+            uint64_t fields[] = { simple->setTrigger, simple->irq, simple->trigger };
+            return fast_put(offset, SEL4RPC_FAST_IRQ_SIMPLE, fields, ARRAY_SIZE(fields));
+        }
+        case IrqAllocMessage_ioapic_tag: {
+            IrqAllocMessagex86_IOAPIC *ioapic = &msg->msg.irq.type.ioapic;
+            uint64_t fields[] = { ioapic->ioapic, ioapic->pin, ioapic->level,
+                                  ioapic->polarity, ioapic->vector
+                                };
+            return fast_put(offset, SEL4RPC_FAST_IRQ_IOAPIC, fields, ARRAY_SIZE(fields));
+        }
+        case IrqAllocMessage_msi_tag: {
+            IrqAllocMessagex86_MSI *msi = &msg->msg.irq.type.msi;
+            uint64_t fields[] = { msi->pci_bus, msi->pci_dev, msi->pci_func,
+                                  msi->handle, msi->vector
+                                };
+            return fast_put(offset, SEL4RPC_FAST_IRQ_MSI, fields, ARRAY_SIZE(fields));
+        }
+        default:
+            return 0;
+        }
+    default:
+        return 0;
+    }
+}
+
+bool sel4rpc_fast_decode(RpcMessage *msg, seL4_Word offset)
+{
+    seL4_Word tag = seL4_GetMR(offset);
+    if ((tag & SEL4RPC_FAST_MAGIC_MASK) != SEL4RPC_FAST_MAGIC) {
+        return false;
+    }
+
+#define FIELD(i) seL4_GetMR(offset + 1 + (i))
+    switch (tag >> SEL4RPC_FAST_TYPE_SHIFT) {
+    case SEL4RPC_FAST_RET:
+        msg->which_msg = RpcMessage_ret_tag;
+        msg->msg.ret.errorCode = FIELD(0);
+        msg->msg.ret.cookie = FIELD(1);
+        msg->msg.ret.cookies_count = 0;
+        break;
+    case SEL4RPC_FAST_MEMORY:
+        msg->which_msg = RpcMessage_memory_tag;
+        msg->msg.memory.address = FIELD(0);
+        msg->msg.memory.size_bits = FIELD(1);
+        msg->msg.memory.type = FIELD(2);
+        msg->msg.memory.action = FIELD(3);
+        break;
+    case SEL4RPC_FAST_IOPORT:
+        msg->which_msg = RpcMessage_ioport_tag;
+        msg->msg.ioport.start = FIELD(0);
+        msg->msg.ioport.end = FIELD(1);
+        break;
+    case SEL4RPC_FAST_IRQ_SIMPLE:
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_simple_tag;
+        msg->msg.irq.type.simple.setTrigger = FIELD(0);
+        msg->msg.irq.type.simple.irq = FIELD(1);
+        msg->msg.irq.type.simple.trigger = FIELD(2);
+        break;
+    case SEL4RPC_FAST_IRQ_IOAPIC:
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_ioapic_tag;
+        msg->msg.irq.type.ioapic.ioapic = FIELD(0);
+        msg->msg.irq.type.ioapic.pin = FIELD(1);
+        msg->msg.irq.type.ioapic.level = FIELD(2);
+        msg->msg.irq.type.ioapic.polarity = FIELD(3);
+        msg->msg.irq.type.ioapic.vector = FIELD(4);
+        break;
+    case SEL4RPC_FAST_IRQ_MSI:
+        msg->which_msg = RpcMessage_irq_tag;
+        msg->msg.irq.which_type = IrqAllocMessage_msi_tag;
+        msg->msg.irq.type.msi.pci_bus = FIELD(0);
+        msg->msg.irq.type.msi.pci_dev = FIELD(1);
+        msg->msg.irq.type.msi.pci_func = FIELD(2);
+        msg->msg.irq.type.msi.handle = FIELD(3);
+        msg->msg.irq.type.msi.vector = FIELD(4);
+        break;
+    default:
+        return false;
+    }
+#undef FIELD
+
+    return true;
+}
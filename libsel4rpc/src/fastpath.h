@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sel4/sel4.h>
+#include <rpc.pb.h>
+
+/*
+ * Fixed-layout encoding of the common RPC messages.
+ *
+ * Instead of a delimited protobuf stream, the message registers hold a tag
+ * word followed by the fields of the message, one per word. The low 16 bits
+ * of the tag word are all set: as the first bytes of a delimited protobuf
+ * stream these would encode a length larger than the IPC buffer, so the two
+ * encodings can never be confused. Messages that have no fixed layout, or
+ * whose fields do not fit in a word, fall back to protobuf.
+ */
+#define SEL4RPC_FAST_MAGIC      (0xffff)
+#define SEL4RPC_FAST_MAGIC_MASK (0xffff)
+#define SEL4RPC_FAST_TYPE_SHIFT (16)
+
+/* Maximum number of words a fixed-layout message takes, including the tag */
+#define SEL4RPC_FAST_MAX_WORDS  (6)
+
+/*
+ * Encode msg into the message registers starting at offset.
+ * Returns the number of words written, or 0 if msg has to be sent as protobuf.
+ */
+seL4_Word sel4rpc_fast_encode(RpcMessage *msg, seL4_Word offset);
+
+/*
+ * Decode a fixed-layout message from the message registers starting at offset.
+ * Returns false if the registers do not hold a fixed-layout message.
+ */
+bool sel4rpc_fast_decode(RpcMessage *msg, seL4_Word offset);
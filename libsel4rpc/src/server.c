@@ -11,6 +11,9 @@
  */
 
 #include <autoconf.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
 #include <sel4nanopb/sel4nanopb.h>
 #include <sel4rpc/server.h>
 #include <sel4utils/api.h>
@@ -22,9 +25,12 @@
 #include <pb_encode.h>
 #include <pb_decode.h>
 
+#include <utils/util.h>
 #include <utils/zf_log.h>
 
-static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+#include "fastpath.h"
+
+static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
 {
     cspacepath_t path;
     int error;
@@ -61,7 +67,116 @@ static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
     }
 }
 
-static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+static int sel4rpc_server_reply_batch(sel4rpc_server_env_t *env, int errorCode,
+                                      uint64_t *cookies, pb_size_t count);
+
+static void sel4rpc_server_clear_cap_recv(sel4rpc_server_env_t *env)
+{
+    /* the receive slot has to be empty for the next transfer to succeed */
+    vka_cnode_delete(&env->cap_recv);
+    seL4_SetCapReceivePath(env->cap_recv.root, env->cap_recv.capPtr, env->cap_recv.capDepth);
+}
+
+/* Delete the client's cap to a batch object and free it. If the cap can't be
+ * deleted the client still has the memory, so it is leaked rather than handed
+ * out again */
+static int sel4rpc_batch_free_object(sel4rpc_server_env_t *env, MemoryBatchMessage *batch, uint32_t index,
+                                     uint64_t cookie)
+{
+    seL4_Error error = seL4_CNode_Delete(env->cap_recv.capPtr, batch->cnode_offset + index, batch->cnode_depth);
+    if (error != seL4_NoError) {
+        ZF_LOGE("Failed to delete cap to object %u of batch: %d, leaking it", index, error);
+        return -1;
+    }
+    vka_utspace_free(env->vka, batch->type, batch->size_bits, cookie);
+    return 0;
+}
+
+static int sel4rpc_handle_memory_batch(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
+{
+    MemoryBatchMessage *batch = &rpcMsg->msg.memory_batch;
+    uint64_t cookies[ARRAY_SIZE(batch->cookies)];
+    int error;
+
+    if (env->cap_recv.capPtr == seL4_CapNull) {
+        ZF_LOGE("Batch requests need the server to receive caps");
+        return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+    }
+
+    /* only trust cap_recv if this message put a cap there, otherwise it
+     * may still hold whatever was left from before */
+    if (seL4_MessageInfo_get_extraCaps(env->recv_info) != 1 ||
+        (seL4_MessageInfo_get_capsUnwrapped(env->recv_info) & 1)) {
+        ZF_LOGE("Batch request did not transfer a CNode cap");
+        return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+    }
+
+    if (batch->count == 0 || batch->count > ARRAY_SIZE(cookies)) {
+        ZF_LOGE("Invalid batch size %u", batch->count);
+        sel4rpc_server_clear_cap_recv(env);
+        return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+    }
+
+    if (batch->cnode_depth == 0 || batch->cnode_depth > seL4_WordBits) {
+        ZF_LOGE("Invalid CNode depth %u", batch->cnode_depth);
+        sel4rpc_server_clear_cap_recv(env);
+        return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+    }
+
+    /* objects are retyped straight into the client's CNode, which was
+     * transferred into cap_recv, at consecutive offsets */
+    cspacepath_t path = {
+        .root = env->cap_recv.capPtr,
+        .dest = 0,
+        .destDepth = 0,
+        .window = 1,
+    };
+
+    if (batch->action == Action_FREE) {
+        if (batch->cookies_count != batch->count) {
+            ZF_LOGE("Batch free needs one cookie per object");
+            sel4rpc_server_clear_cap_recv(env);
+            return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+        }
+        int failed = 0;
+        for (uint32_t i = 0; i < batch->count; i++) {
+            failed |= sel4rpc_batch_free_object(env, batch, i, batch->cookies[i]);
+        }
+        sel4rpc_server_clear_cap_recv(env);
+        return sel4rpc_server_reply_batch(env, failed ? 1 : 0, NULL, 0);
+    }
+
+    uint32_t allocated;
+    for (allocated = 0; allocated < batch->count; allocated++) {
+        uintptr_t cookie;
+        path.offset = batch->cnode_offset + allocated;
+        if (batch->any_address) {
+            error = vka_utspace_alloc(env->vka, &path, batch->type, batch->size_bits, &cookie);
+        } else {
+            uintptr_t paddr = batch->address + ((uintptr_t) allocated << batch->size_bits);
+            error = vka_utspace_alloc_at(env->vka, &path, batch->type, batch->size_bits, paddr, &cookie);
+        }
+        if (error) {
+            ZF_LOGE("Failed to alloc object %u of batch: %d\n", allocated, error);
+            break;
+        }
+        cookies[allocated] = cookie;
+    }
+
+    if (allocated != batch->count) {
+        /* all or nothing: undo the partial allocation */
+        for (uint32_t i = 0; i < allocated; i++) {
+            sel4rpc_batch_free_object(env, batch, i, cookies[i]);
+        }
+        sel4rpc_server_clear_cap_recv(env);
+        return sel4rpc_server_reply_batch(env, 1, NULL, 0);
+    }
+
+    sel4rpc_server_clear_cap_recv(env);
+    return sel4rpc_server_reply_batch(env, 0, cookies, allocated);
+}
+
+static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
 {
     cspacepath_t path;
     int error;
@@ -88,7 +203,7 @@ static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
     return ret;
 }
 
-static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
 {
     cspacepath_t path;
     int error;
@@ -136,6 +251,7 @@ static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
     default:
         ZF_LOGE("Unknown IRQ type");
         vka_cspace_free_path(env->vka, path);
+        sel4rpc_server_reply(env, 0, 1, 0);
         return -1;
     }
 
@@ -153,24 +269,136 @@ static int sel4rpc_handle_irq(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
     return ret;
 }
 
+/* handlers for the messages defined in rpc.proto. They all allocate cspace
+ * slots or untypeds from the one vka, so they are all serialised on the
+ * table's lock rather than each having their own */
+static const sel4rpc_handler_t builtin_handlers[] = {
+    [RpcMessage_memory_tag] = sel4rpc_handle_memory,
+    [RpcMessage_ioport_tag] = sel4rpc_handle_ioport,
+    [RpcMessage_irq_tag] = sel4rpc_handle_irq,
+    [RpcMessage_memory_batch_tag] = sel4rpc_handle_memory_batch,
+};
+
 int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg)
 {
-    cspacepath_t path;
-    path.capPtr = seL4_CapNull;
-    switch (rpcMsg->which_msg) {
-    case RpcMessage_memory_tag:
-        return sel4rpc_handle_memory(env, rpcMsg);
-    case RpcMessage_ioport_tag:
-        return sel4rpc_handle_ioport(env, rpcMsg);
-    case RpcMessage_irq_tag:
-        return sel4rpc_handle_irq(env, rpcMsg);
-    default:
-        ZF_LOGE("Not sure what to do!");
+    if (rpcMsg->which_msg < ARRAY_SIZE(builtin_handlers) && builtin_handlers[rpcMsg->which_msg]) {
+        return builtin_handlers[rpcMsg->which_msg](env, NULL, rpcMsg);
     }
 
+    ZF_LOGE("Not sure what to do!");
+    sel4rpc_server_reply(env, 0, 1, 0);
     return -1;
 }
 
+int sel4rpc_dispatch_init(sel4rpc_dispatch_t *dispatch, sel4rpc_lock_fn_t lock,
+                          sel4rpc_lock_fn_t unlock, void *lock_data, sel4rpc_clock_fn_t clock)
+{
+    memset(dispatch, 0, sizeof(*dispatch));
+    dispatch->lock = lock;
+    dispatch->unlock = unlock;
+    dispatch->lock_data = lock_data;
+    dispatch->clock = clock;
+
+    for (size_t i = 0; i < ARRAY_SIZE(builtin_handlers); i++) {
+        if (builtin_handlers[i]) {
+            sel4rpc_dispatch_register(dispatch, i, builtin_handlers[i], NULL, true);
+        }
+    }
+    return 0;
+}
+
+int sel4rpc_dispatch_register(sel4rpc_dispatch_t *dispatch, pb_size_t which_msg,
+                              sel4rpc_handler_t handler, void *data, bool serialise)
+{
+    if (serialise) {
+        return sel4rpc_dispatch_register_locked(dispatch, which_msg, handler, data,
+                                                dispatch->lock, dispatch->unlock, dispatch->lock_data);
+    }
+    return sel4rpc_dispatch_register_locked(dispatch, which_msg, handler, data, NULL, NULL, NULL);
+}
+
+int sel4rpc_dispatch_register_locked(sel4rpc_dispatch_t *dispatch, pb_size_t which_msg,
+                                     sel4rpc_handler_t handler, void *data,
+                                     sel4rpc_lock_fn_t lock, sel4rpc_lock_fn_t unlock, void *lock_data)
+{
+    if (which_msg >= SEL4RPC_MAX_HANDLERS) {
+        ZF_LOGE("Message tag %u out of range", which_msg);
+        return -1;
+    }
+    if (!lock != !unlock) {
+        ZF_LOGE("Need both lock and unlock, or neither");
+        return -1;
+    }
+
+    struct sel4rpc_dispatch_entry *entry = &dispatch->handlers[which_msg];
+    entry->handler = handler;
+    entry->data = data;
+    entry->lock = lock;
+    entry->unlock = unlock;
+    entry->lock_data = lock_data;
+    return 0;
+}
+
+static void sel4rpc_stats_update(sel4rpc_server_stats_t *stats, int err, uint64_t elapsed)
+{
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    if (err) {
+        __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&stats->total_time, elapsed, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stats->max_time, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&stats->max_time, &max, elapsed, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* max now holds the value another worker stored, retry against it */
+    }
+}
+
+static int sel4rpc_dispatch(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+{
+    sel4rpc_dispatch_t *dispatch = env->dispatch;
+    if (rpcMsg->which_msg >= SEL4RPC_MAX_HANDLERS || !dispatch->handlers[rpcMsg->which_msg].handler) {
+        ZF_LOGE("No handler for message %u", rpcMsg->which_msg);
+        /* the client is blocked in Call until something is sent back */
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+
+    struct sel4rpc_dispatch_entry *entry = &dispatch->handlers[rpcMsg->which_msg];
+    if (entry->lock) {
+        entry->lock(entry->lock_data);
+    }
+
+    /* only time the handler itself, not waiting for the lock */
+    uint64_t start = dispatch->clock ? dispatch->clock() : 0;
+    int err = entry->handler(env, entry->data, rpcMsg);
+    uint64_t elapsed = dispatch->clock ? dispatch->clock() - start : 0;
+
+    if (entry->unlock) {
+        entry->unlock(entry->lock_data);
+    }
+
+    sel4rpc_stats_update(&dispatch->stats[rpcMsg->which_msg], err, elapsed);
+    return err;
+}
+
+void sel4rpc_dispatch_print_stats(sel4rpc_dispatch_t *dispatch)
+{
+    printf("%-6s %12s %8s %14s %14s\n", "msg", "count", "errors", "avg time", "max time");
+    for (int i = 0; i < SEL4RPC_MAX_HANDLERS; i++) {
+        sel4rpc_server_stats_t *stats = &dispatch->stats[i];
+        uint64_t count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        printf("%-6d %12"PRIu64" %8"PRIu64" %14"PRIu64" %14"PRIu64"\n", i, count,
+               __atomic_load_n(&stats->errors, __ATOMIC_RELAXED),
+               __atomic_load_n(&stats->total_time, __ATOMIC_RELAXED) / count,
+               __atomic_load_n(&stats->max_time, __ATOMIC_RELAXED));
+    }
+}
+
 int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
                         sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple)
 {
@@ -179,16 +407,85 @@ int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
     env->handler = handler_func;
     env->data = data;
     env->simple = simple;
+    env->cap_recv.capPtr = seL4_CapNull;
+    env->recv_info = seL4_MessageInfo_new(0, 0, 0, 0);
+    env->fast_reply = false;
+    env->dispatch = NULL;
+    return 0;
+}
+
+void sel4rpc_server_set_dispatch(sel4rpc_server_env_t *env, sel4rpc_dispatch_t *dispatch)
+{
+    env->dispatch = dispatch;
+}
+
+int sel4rpc_server_worker_init(sel4rpc_server_env_t *worker, sel4rpc_server_env_t *parent,
+                               vka_object_t *reply)
+{
+    *worker = *parent;
+    worker->reply = reply;
+    worker->fast_reply = false;
+
+    /* each worker needs its own slot to receive caps into */
+    if (parent->cap_recv.capPtr != seL4_CapNull) {
+        int error = vka_cspace_alloc_path(parent->vka, &worker->cap_recv);
+        if (error) {
+            ZF_LOGE("Failed to alloc cap receive path: %d", error);
+            return error;
+        }
+    }
+    return 0;
+}
+
+void sel4rpc_server_run(sel4rpc_server_env_t *env, seL4_CPtr ep, seL4_Word magic)
+{
+    if (env->cap_recv.capPtr != seL4_CapNull) {
+        seL4_SetCapReceivePath(env->cap_recv.root, env->cap_recv.capPtr, env->cap_recv.capDepth);
+    }
+
+    while (1) {
+        seL4_Word badge;
+        seL4_MessageInfo_t info = api_recv(ep, &badge, env->reply->cptr);
+        if (seL4_GetMR(0) != magic) {
+            ZF_LOGE("Unexpected message on RPC endpoint");
+            sel4rpc_server_reply(env, 0, 1, 0);
+            continue;
+        }
+        sel4rpc_server_recv_info(env, info);
+    }
+}
+
+int sel4rpc_server_enable_cap_recv(sel4rpc_server_env_t *env)
+{
+    int error = vka_cspace_alloc_path(env->vka, &env->cap_recv);
+    if (error) {
+        ZF_LOGE("Failed to alloc cap receive path: %d", error);
+        env->cap_recv.capPtr = seL4_CapNull;
+        return error;
+    }
+
+    seL4_SetCapReceivePath(env->cap_recv.root, env->cap_recv.capPtr, env->cap_recv.capDepth);
     return 0;
 }
 
 int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie)
 {
-    pb_ostream_t ostream = pb_ostream_from_IPC(0);
     RpcMessage rpcMsg;
     rpcMsg.which_msg = RpcMessage_ret_tag;
     rpcMsg.msg.ret.errorCode = errorCode;
     rpcMsg.msg.ret.cookie = cookie;
+    rpcMsg.msg.ret.cookies_count = 0;
+
+    /* answer in the encoding the request arrived in */
+    if (env->fast_reply) {
+        seL4_Word length = sel4rpc_fast_encode(&rpcMsg, 0);
+        if (length) {
+            api_reply(env->reply->cptr, seL4_MessageInfo_new(0, 0, caps, length));
+            return 0;
+        }
+    }
+
+    pb_ostream_t ostream = pb_ostream_from_IPC(0);
 
     bool ret = pb_encode_delimited(&ostream, &RpcMessage_msg, &rpcMsg);
     if (!ret) {
@@ -211,19 +508,61 @@ int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int
     return 0;
 }
 
-int sel4rpc_server_recv(sel4rpc_server_env_t *env)
+static int sel4rpc_server_reply_batch(sel4rpc_server_env_t *env, int errorCode,
+                                      uint64_t *cookies, pb_size_t count)
 {
+    pb_ostream_t ostream = pb_ostream_from_IPC(0);
     RpcMessage rpcMsg;
-    pb_istream_t stream = pb_istream_from_IPC(1);
-    bool ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
+    rpcMsg.which_msg = RpcMessage_ret_tag;
+    rpcMsg.msg.ret.errorCode = errorCode;
+    rpcMsg.msg.ret.cookie = 0;
+    rpcMsg.msg.ret.cookies_count = count;
+    for (pb_size_t i = 0; i < count; i++) {
+        rpcMsg.msg.ret.cookies[i] = cookies[i];
+    }
+
+    bool ret = pb_encode_delimited(&ostream, &RpcMessage_msg, &rpcMsg);
     if (!ret) {
-        ZF_LOGE("Invalid protobuf stream (%s)", PB_GET_ERROR(&stream));
+        ZF_LOGE("Failed to encode reply (%s)", PB_GET_ERROR(&ostream));
         return -1;
     }
 
+    size_t size = ostream.bytes_written / sizeof(seL4_Word);
+    if (ostream.bytes_written % sizeof(seL4_Word)) {
+        size++;
+    }
+
+    api_reply(env->reply->cptr, seL4_MessageInfo_new(0, 0, 0, size));
+
+    return 0;
+}
+
+int sel4rpc_server_recv(sel4rpc_server_env_t *env)
+{
+    /* without the message info, assume no cap came with the request */
+    return sel4rpc_server_recv_info(env, seL4_MessageInfo_new(0, 0, 0, 0));
+}
+
+int sel4rpc_server_recv_info(sel4rpc_server_env_t *env, seL4_MessageInfo_t info)
+{
+    RpcMessage rpcMsg;
+    env->recv_info = info;
+    env->fast_reply = sel4rpc_fast_decode(&rpcMsg, 1);
+    if (!env->fast_reply) {
+        pb_istream_t stream = pb_istream_from_IPC(1);
+        bool ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
+        if (!ret) {
+            ZF_LOGE("Invalid protobuf stream (%s)", PB_GET_ERROR(&stream));
+            sel4rpc_server_reply(env, 0, 1, 0);
+            return -1;
+        }
+    }
+
     int err = 0;
     if (env->handler) {
         err = env->handler(env, env->data, &rpcMsg);
+    } else if (env->dispatch) {
+        err = sel4rpc_dispatch(env, &rpcMsg);
     } else {
         err = sel4rpc_default_handler(env, NULL, &rpcMsg);
     }
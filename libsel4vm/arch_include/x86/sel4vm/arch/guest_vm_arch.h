@@ -28,6 +28,14 @@
 
 typedef struct vm_lapic vm_lapic_t;
 typedef struct i8259 i8259_t;
+
+/* PCIe ECAM window advertised to the guest in the ACPI MCFG table. A zero
+ * num_buses means no window has been registered */
+typedef struct vm_pci_ecam {
+    uint64_t base;
+    uint8_t start_bus;
+    uint16_t num_buses;
+} vm_pci_ecam_t;
 typedef struct guest_state guest_state_t;
 
 /* Function prototype for vm exit handlers */
@@ -52,6 +60,7 @@ typedef struct vmcall_handler {
  * @param {void *} unhandled_ioport_callback_cookie                     A cookie to supply to the ioport callback
  * @param {vm_io_port_list_t} ioport_list                               List of registered ioport handlers
  * @param {i8259_t *} i8259_gs                                          PIC machine state
+ * @param {vm_pci_ecam_t} pci_ecam                                      ECAM window to advertise in the guest's MCFG
  */
 struct vm_arch {
     vmexit_handler_ptr vmexit_handlers[VM_EXIT_REASON_NUM];
@@ -62,6 +71,7 @@ struct vm_arch {
     void *unhandled_ioport_callback_cookie;
     vm_io_port_list_t ioport_list;
     i8259_t *i8259_gs;
+    vm_pci_ecam_t pci_ecam;
 };
 
 /***
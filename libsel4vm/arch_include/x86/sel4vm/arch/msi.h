@@ -0,0 +1,41 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the GNU General Public License version 2. Note that NO WARRANTY is provided.
+ * See "LICENSE_GPLv2.txt" for details.
+ *
+ * @TAG(DATA61_GPL)
+ */
+
+#pragma once
+
+/***
+ * @module msi.h
+ * The x86 MSI interface delivers message signalled interrupts to the guest local APIC, decoding the message address
+ * and data the guest programmed into a device as a real chipset would.
+ */
+
+#include <stdint.h>
+#include <utils/util.h>
+#include <sel4vm/guest_vm.h>
+
+/* Base of the message address window, the message address is in the local APIC's range */
+#define MSI_ADDRESS_BASE            APIC_DEFAULT_PHYS_BASE
+#define MSI_ADDRESS_BASE_MASK       0xfff00000
+#define MSI_ADDRESS_DEST_ID_SHIFT   12
+#define MSI_ADDRESS_DEST_MODE       BIT(2)
+
+/***
+ * @function vm_inject_msi(vcpu, address, data)
+ * Deliver a message signalled interrupt to the guest. The destination in the message address selects the
+ * receiving local APIC, the vector, delivery mode and trigger mode come from the message data
+ * @param {vm_vcpu_t *} vcpu        A handle to a VCPU of the VM
+ * @param {uint64_t} address        Message address, as programmed by the guest
+ * @param {uint32_t} data           Message data, as programmed by the guest
+ * @return                          0 if the interrupt was accepted, -1 if the message is invalid or no local APIC
+ *                                  accepted it
+ */
+int vm_inject_msi(vm_vcpu_t *vcpu, uint64_t address, uint32_t data);
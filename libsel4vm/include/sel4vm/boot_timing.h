@@ -0,0 +1,106 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sel4vm/gen_config.h>
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @module boot_timing.h
+ * The boot timing interface records how long each phase of bringing up a VM takes, from 'vm_init' to the first
+ * entry into the guest. Phases may nest (e.g. RAM registered by a device installer) so their durations are
+ * inclusive and need not add up to the total. Timing is only compiled in with LibSel4VMBootTiming, otherwise all
+ * of these functions are empty.
+ */
+
+/* Phases of VM bring up */
+typedef enum vm_boot_phase {
+    /* vm_init, including the guest vspace */
+    VM_BOOT_PHASE_VM_INIT,
+    /* Creating the guest vspace */
+    VM_BOOT_PHASE_VSPACE,
+    /* Registering and mapping guest RAM */
+    VM_BOOT_PHASE_RAM,
+    /* Loading guest kernel and module images */
+    VM_BOOT_PHASE_IMAGE_LOAD,
+    /* Applying guest kernel relocations */
+    VM_BOOT_PHASE_RELOCATION,
+    /* Building boot information for the guest, e.g. ACPI tables and the e820 map */
+    VM_BOOT_PHASE_BOOT_INFO,
+    /* Installing virtual and passthrough devices */
+    VM_BOOT_PHASE_DEVICES,
+    VM_BOOT_PHASE_NUM
+} vm_boot_phase_t;
+
+#ifdef CONFIG_LIB_SEL4VM_BOOT_TIMING
+
+/***
+ * @function vm_boot_timestamp()
+ * Read the counter used for boot timing. On x86 this is the TSC. On ARM it is the generic timer's virtual
+ * counter, which ticks at the frequency in CNTFRQ rather than the CPU clock
+ * @return      Current counter value
+ */
+uint64_t vm_boot_timestamp(void);
+
+/***
+ * @function vm_boot_phase_begin(vm, phase)
+ * Mark the start of a boot phase. Nested begins of the same phase are only counted once
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_boot_phase_t} phase       Phase being started
+ */
+void vm_boot_phase_begin(vm_t *vm, vm_boot_phase_t phase);
+
+/***
+ * @function vm_boot_phase_end(vm, phase)
+ * Mark the end of a boot phase started with 'vm_boot_phase_begin'
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_boot_phase_t} phase       Phase being ended
+ */
+void vm_boot_phase_end(vm_t *vm, vm_boot_phase_t phase);
+
+/***
+ * @function vm_boot_phase_cycles(vm, phase)
+ * Get the total number of cycles spent in a boot phase so far
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_boot_phase_t} phase       Phase to query
+ * @return                              Cycles spent in the phase
+ */
+uint64_t vm_boot_phase_cycles(vm_t *vm, vm_boot_phase_t phase);
+
+/***
+ * @function vm_boot_timing_print(vm)
+ * Print a summary of the time spent in each boot phase. Called automatically on the first 'vm_run'
+ * @param {vm_t *} vm                   A handle to the VM
+ */
+void vm_boot_timing_print(vm_t *vm);
+
+#else
+
+static inline uint64_t vm_boot_timestamp(void)
+{
+    return 0;
+}
+
+static inline void vm_boot_phase_begin(vm_t *vm, vm_boot_phase_t phase) {}
+
+static inline void vm_boot_phase_end(vm_t *vm, vm_boot_phase_t phase) {}
+
+static inline uint64_t vm_boot_phase_cycles(vm_t *vm, vm_boot_phase_t phase)
+{
+    return 0;
+}
+
+static inline void vm_boot_timing_print(vm_t *vm) {}
+
+#endif
@@ -120,7 +120,8 @@ int vm_memory_make_anon(vm_t *vm, uintptr_t addr, size_t size);
 
 /***
  * @function vm_free_reserved_memory(vm, reservation)
- * Free memory reservation from the VM
+ * Free memory reservation from the VM. Anonymous reservations can only be free'd in the reverse order they were
+ * made in
  * @param {vm_t *} vm                                   A handle to the VM
  * @param {vm_memory_reservation_t *} reservation       Pointer to the reservation being free'd
  * @return                                              -1 on failure otherwise 0 for success
@@ -71,6 +71,24 @@ int vm_guest_ram_write_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, siz
  */
 int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie);
 
+/* Number of guest pages mapped into the vmm at once by vm_ram_touch_batch */
+#define VM_RAM_TOUCH_BATCH_PAGES 256
+
+/***
+ * @function vm_ram_touch_batch(vm, addr, size, touch_callback, cookie)
+ * Touch a series of pages in the guest vm, mapping up to VM_RAM_TOUCH_BATCH_PAGES of them into the vmm at a time
+ * as one contiguous window and invoking the callback once per window. Prefer this over 'vm_ram_touch' for bulk
+ * accesses, such as loading images into guest RAM. Unlike 'vm_ram_touch', the callback's 'guest_addr' is the exact
+ * guest address that 'vmm_vaddr' maps, so it is unaligned in the first window if 'addr' is.
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {uintptr_t} addr                  Address to access in the guest vm
+ * @param {size_t} size                     Size of memory region to access
+ * @param {ram_touch_callback_fn} callback  Callback to invoke on each window
+ * @param {void *} cookie                   User data to pass onto callback
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_touch_batch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie);
+
 /***
  * @function vm_ram_find_largest_free_region(vm, addr, size)
  * Find the largest free ram region
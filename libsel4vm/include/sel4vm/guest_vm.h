@@ -186,6 +186,7 @@ struct vm_cspace {
  * @param {char *} vm_name              String used to describe VM. Useful for debugging
  * @param {unsigned int} vm_id          Identifier for VM. Useful for debugging
  * @param {bool} vm_initialised         Boolean flagging whether VM is intialised or not
+ * @param {struct vm_boot_timing *} boot_timing     Boot phase timing, NULL unless LibSel4VMBootTiming is enabled
  */
 struct vm {
     /* Architecture specfic vm structure */
@@ -209,6 +210,8 @@ struct vm {
     char *vm_name;
     unsigned int vm_id;
     bool vm_initialised;
+    /* Boot phase timing */
+    struct vm_boot_timing *boot_timing;
 };
 
 /***
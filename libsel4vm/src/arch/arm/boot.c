@@ -63,8 +63,10 @@ int vm_init_arch(vm_t *vm)
     assert(!err);
     err = simple_ASIDPool_assign(vm->simple, vm->mem.vm_vspace_root.cptr);
     assert(err == seL4_NoError);
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_VSPACE);
     err = vm_init_guest_vspace(&vm->mem.vmm_vspace, &vm->mem.vmm_vspace, &vm->mem.vm_vspace, vm->vka,
                                vm->mem.vm_vspace_root.cptr);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_VSPACE);
     assert(!err);
     return err;
 }
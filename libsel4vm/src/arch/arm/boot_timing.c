@@ -0,0 +1,35 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <autoconf.h>
+#include <stdint.h>
+#include <sel4vm/boot_timing.h>
+
+#ifdef CONFIG_LIB_SEL4VM_BOOT_TIMING
+
+uint64_t vm_boot_timestamp(void)
+{
+    uint64_t value;
+    /* The generic timer's virtual counter is always running, unlike the PMU
+     * cycle counter which nothing here enables */
+#if defined(CONFIG_EXPORT_VCNT_USER) && defined(CONFIG_ARCH_AARCH64)
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+#elif defined(CONFIG_EXPORT_VCNT_USER)
+    asm volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r"(value));
+#else
+/* The counter traps at user level unless the kernel exports it */
+#error "LibSel4VMBootTiming needs KernelArmExportVCNTUser"
+#endif
+    return value;
+}
+
+#endif /* CONFIG_LIB_SEL4VM_BOOT_TIMING */
@@ -132,8 +132,10 @@ int vm_init_arch(vm_t *vm)
     err = seL4_TCB_SetEPTRoot(simple_get_tcb(vm->simple), vm->mem.vm_vspace_root.cptr);
     assert(err == seL4_NoError);
     /* Initialize a vspace for the guest */
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_VSPACE);
     err = vm_init_guest_vspace(&vm->mem.vmm_vspace, &vm->mem.vmm_vspace,
                                &vm->mem.vm_vspace, vm->vka, vm->mem.vm_vspace_root.cptr);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_VSPACE);
     if (err) {
         return err;
     }
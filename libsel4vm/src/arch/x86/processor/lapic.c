@@ -22,11 +22,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <utils/util.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/arch/msi.h>
 
 #include "processor/lapic.h"
 #include "processor/apicdef.h"
@@ -512,24 +514,62 @@ int vm_irq_delivery_to_apic(vm_vcpu_t *src_vcpu, struct vm_lapic_irq *irq, unsig
         return vm_apic_set_irq(src_vcpu, irq, dest_map);
     }
 
-    vm_vcpu_t *dest_vcpu = vm->vcpus[BOOT_VCPU];
+    for (i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *dest_vcpu = vm->vcpus[i];
+        vm_lapic_t *dest_apic = dest_vcpu->vcpu_arch.lapic;
 
-    if (!vm_apic_hw_enabled(dest_vcpu->vcpu_arch.lapic)) {
-        return r;
-    }
+        if (!dest_apic || !vm_apic_hw_enabled(dest_apic)) {
+            continue;
+        }
 
-    if (!vm_apic_match_dest(dest_vcpu, src, irq->shorthand,
-                            irq->dest_id, irq->dest_mode)) {
-        return r;
+        if (!vm_apic_match_dest(dest_vcpu, src, irq->shorthand,
+                                irq->dest_id, irq->dest_mode)) {
+            continue;
+        }
+
+        if (!vm_is_dm_lowest_prio(irq)) {
+            if (r < 0) {
+                r = 0;
+            }
+            r += vm_apic_set_irq(dest_vcpu, irq, dest_map);
+        } else if (vm_apic_enabled(dest_apic)) {
+            /* Lowest priority: arbitrate among the matching vcpus, deliver once */
+            if (!lowest || vm_apic_compare_prio(dest_vcpu, lowest) < 0) {
+                lowest = dest_vcpu;
+            }
+        }
     }
 
-    if (!vm_is_dm_lowest_prio(irq) || (vm_apic_enabled(dest_vcpu->vcpu_arch.lapic))) {
-        r = vm_apic_set_irq(dest_vcpu, irq, dest_map);
+    if (lowest) {
+        r = vm_apic_set_irq(lowest, irq, dest_map);
     }
 
     return r;
 }
 
+int vm_inject_msi(vm_vcpu_t *vcpu, uint64_t address, uint32_t data)
+{
+    if ((address & MSI_ADDRESS_BASE_MASK) != MSI_ADDRESS_BASE) {
+        ZF_LOGE("Invalid MSI address 0x%"PRIx64, address);
+        return -1;
+    }
+
+    /* The message data has the same layout as the low word of the ICR, and MSIs are always asserted */
+    struct vm_lapic_irq irq;
+    irq.vector = data & APIC_VECTOR_MASK;
+    irq.delivery_mode = data & APIC_MODE_MASK;
+    irq.dest_mode = (address & MSI_ADDRESS_DEST_MODE) ? APIC_DEST_LOGICAL : APIC_DEST_PHYSICAL;
+    irq.level = APIC_INT_ASSERT;
+    irq.trig_mode = data & APIC_INT_LEVELTRIG;
+    irq.shorthand = 0;
+    irq.dest_id = (address >> MSI_ADDRESS_DEST_ID_SHIFT) & MASK(8);
+
+    if (vm_irq_delivery_to_apic(vcpu, &irq, NULL) <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Add a pending IRQ into lapic.
  * Return 1 if successfully added and 0 if discarded.
@@ -21,6 +21,7 @@
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vm_exits.h>
 #include <sel4vm/guest_vm_util.h>
+#include <sel4vm/boot_timing.h>
 
 #include "vm_boot.h"
 
@@ -30,6 +31,7 @@ int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
             ps_io_ops_t *io_ops, seL4_CPtr host_endpoint, const char *name)
 {
     int err;
+    uint64_t boot_origin = vm_boot_timestamp();
     bzero(vm, sizeof(vm_t));
     /* Initialise vm fields */
     vm->vka = vka;
@@ -39,6 +41,11 @@ int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
     vm->host_endpoint = host_endpoint;
     vm->vm_name = strndup(name, strlen(name));
     vm->run.exit_reason = VM_GUEST_UNKNOWN_EXIT;
+    err = vm_boot_timing_init(vm, boot_origin);
+    if (err) {
+        return err;
+    }
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_VM_INIT);
     /* Initialise ram region */
     vm->mem.num_ram_regions = 0;
     vm->mem.ram_regions = malloc(0);
@@ -59,6 +66,7 @@ int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
 
     /* Flag that the vm has been initialised */
     vm->vm_initialised = true;
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_VM_INIT);
     return 0;
 }
 
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/boot_timing.h>
+
+#include "vm_boot.h"
+
+#ifdef CONFIG_LIB_SEL4VM_BOOT_TIMING
+
+struct vm_boot_timing {
+    /* Timestamp at the start of vm_init */
+    uint64_t origin;
+    /* Timestamp of the first vm_run, zero until then */
+    uint64_t first_entry;
+    uint64_t cycles[VM_BOOT_PHASE_NUM];
+    uint64_t begin[VM_BOOT_PHASE_NUM];
+    unsigned int count[VM_BOOT_PHASE_NUM];
+    unsigned int depth[VM_BOOT_PHASE_NUM];
+};
+
+static const char *phase_names[VM_BOOT_PHASE_NUM] = {
+    [VM_BOOT_PHASE_VM_INIT] = "vm init",
+    [VM_BOOT_PHASE_VSPACE] = "guest vspace",
+    [VM_BOOT_PHASE_RAM] = "ram register/map",
+    [VM_BOOT_PHASE_IMAGE_LOAD] = "image load",
+    [VM_BOOT_PHASE_RELOCATION] = "relocation",
+    [VM_BOOT_PHASE_BOOT_INFO] = "boot info",
+    [VM_BOOT_PHASE_DEVICES] = "device install",
+};
+
+int vm_boot_timing_init(vm_t *vm, uint64_t origin)
+{
+    vm->boot_timing = calloc(1, sizeof(struct vm_boot_timing));
+    if (!vm->boot_timing) {
+        ZF_LOGE("Failed to allocate boot timing");
+        return -1;
+    }
+    vm->boot_timing->origin = origin;
+    return 0;
+}
+
+void vm_boot_timing_first_entry(vm_t *vm)
+{
+    if (!vm->boot_timing || vm->boot_timing->first_entry) {
+        return;
+    }
+    vm->boot_timing->first_entry = vm_boot_timestamp();
+    vm_boot_timing_print(vm);
+}
+
+void vm_boot_phase_begin(vm_t *vm, vm_boot_phase_t phase)
+{
+    if (!vm || !vm->boot_timing || phase >= VM_BOOT_PHASE_NUM) {
+        return;
+    }
+    struct vm_boot_timing *timing = vm->boot_timing;
+    if (timing->depth[phase]++ == 0) {
+        timing->begin[phase] = vm_boot_timestamp();
+    }
+}
+
+void vm_boot_phase_end(vm_t *vm, vm_boot_phase_t phase)
+{
+    if (!vm || !vm->boot_timing || phase >= VM_BOOT_PHASE_NUM) {
+        return;
+    }
+    struct vm_boot_timing *timing = vm->boot_timing;
+    if (!timing->depth[phase]) {
+        ZF_LOGW("Boot phase \"%s\" ended without beginning", phase_names[phase]);
+        return;
+    }
+    if (--timing->depth[phase] == 0) {
+        timing->cycles[phase] += vm_boot_timestamp() - timing->begin[phase];
+        timing->count[phase]++;
+    }
+}
+
+uint64_t vm_boot_phase_cycles(vm_t *vm, vm_boot_phase_t phase)
+{
+    if (!vm || !vm->boot_timing || phase >= VM_BOOT_PHASE_NUM) {
+        return 0;
+    }
+    return vm->boot_timing->cycles[phase];
+}
+
+void vm_boot_timing_print(vm_t *vm)
+{
+    if (!vm || !vm->boot_timing) {
+        return;
+    }
+    struct vm_boot_timing *timing = vm->boot_timing;
+    uint64_t end = timing->first_entry ? timing->first_entry : vm_boot_timestamp();
+    uint64_t total = end - timing->origin;
+
+    printf("Boot timing for VM %s (counter ticks):\n", vm->vm_name);
+    for (int i = 0; i < VM_BOOT_PHASE_NUM; i++) {
+        if (!timing->count[i]) {
+            continue;
+        }
+        printf("  %-18s %16"PRIu64" %3u%% (%u)\n", phase_names[i], timing->cycles[i],
+               total ? (unsigned int)(timing->cycles[i] * 100 / total) : 0, timing->count[i]);
+    }
+    printf("  %-18s %16"PRIu64"\n", timing->first_entry ? "to first entry" : "so far", total);
+}
+
+#endif /* CONFIG_LIB_SEL4VM_BOOT_TIMING */
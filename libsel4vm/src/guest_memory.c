@@ -435,6 +435,38 @@ vm_memory_reservation_t *vm_reserve_anon_memory(vm_t *vm, size_t size,
     return new_reservation;
 }
 
+static void unmap_vm_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    if (reservation->is_mapped) {
+        int page_size = seL4_PageBits;
+        int num_pages = ROUND_UP(reservation->size, BIT(page_size)) >> page_size;
+        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)reservation->addr, num_pages, page_size, vm->vka);
+    }
+}
+
+/* Anonymous memory is handed out in order, so only the most recent reservation
+ * of a region can be returned to it */
+static int free_anon_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    res_tree *region_node = find_memory_reservation_by_addr(vm, reservation->addr);
+    if (!region_node || region_node->res_type != MEM_ANON_RES) {
+        ZF_LOGE("Failed to free reserved memory: Unable to find anonymous region");
+        return -1;
+    }
+    anon_region_t *region = (anon_region_t *)region_node->data;
+    if (region->num_reservations == 0 || region->reservations[region->num_reservations - 1] != reservation) {
+        ZF_LOGE("Failed to free reserved memory: Only the latest anonymous reservation can be free'd");
+        return -1;
+    }
+
+    unmap_vm_reservation(vm, reservation);
+    region->num_reservations--;
+    region->alloc_addr -= ROUND_UP(reservation->size, BIT(seL4_PageBits));
+    /* The vspace reservation belongs to the region */
+    free_vm_reservation(vm, reservation);
+    return 0;
+}
+
 int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
 {
     ps_io_ops_t *ops = vm->io_ops;
@@ -444,18 +476,11 @@ int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
     }
 
     if (reservation->res_type == MEM_ANON_RES) {
-        /* We current don't support free'ing anonymous reservations */
-        /* TODO: Support freeing anonymous memory reservations */
-        ZF_LOGE("Failed to free reserved memory: Cannot free anonymous memory reservations");
-        return -1;
+        return free_anon_reservation(vm, reservation);
     }
 
     remove_memory_reservation_node(vm, reservation->addr, reservation->size, reservation->res_type);
-    if (reservation->is_mapped) {
-        int page_size = seL4_PageBits;
-        int num_pages = ROUND_UP(reservation->size, BIT(page_size)) >> page_size;
-        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)reservation->addr, num_pages, page_size, vm->vka);
-    }
+    unmap_vm_reservation(vm, reservation);
     vspace_free_reservation(&vm->mem.vm_vspace, reservation->vspace_reservation);
     free_vm_reservation(vm, reservation);
     return 0;
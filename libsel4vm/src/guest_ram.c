@@ -15,10 +15,12 @@
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <vka/capops.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_ram.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/boot_timing.h>
 
 #include "guest_memory.h"
 
@@ -182,6 +184,104 @@ int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn to
     return 0;
 }
 
+static int ram_touch_map_window(vm_t *vm, cspacepath_t *slots, seL4_CPtr *caps, uintptr_t page_addr,
+                                size_t num_pages, void **vaddr)
+{
+    for (size_t i = 0; i < num_pages; i++) {
+        seL4_CPtr cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)(page_addr + i * PAGE_SIZE_4K));
+        if (!cap) {
+            ZF_LOGE("Failed to find frame cap for guest address %p", (void *)(page_addr + i * PAGE_SIZE_4K));
+            return -1;
+        }
+        cspacepath_t cap_path;
+        vka_cspace_make_path(vm->vka, cap, &cap_path);
+        int err = vka_cnode_copy(&slots[i], &cap_path, seL4_AllRights);
+        if (err) {
+            ZF_LOGE("Failed to copy frame cap for guest address %p", (void *)(page_addr + i * PAGE_SIZE_4K));
+            while (i-- > 0) {
+                vka_cnode_delete(&slots[i]);
+            }
+            return -1;
+        }
+        caps[i] = slots[i].capPtr;
+    }
+
+    *vaddr = vspace_map_pages(&vm->mem.vmm_vspace, caps, NULL, seL4_AllRights, num_pages, seL4_PageBits, 1);
+    if (!*vaddr) {
+        ZF_LOGE("Failed to map %zu guest pages into the vmm", num_pages);
+        for (size_t i = 0; i < num_pages; i++) {
+            vka_cnode_delete(&slots[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void ram_touch_unmap_window(vm_t *vm, cspacepath_t *slots, void *vaddr, size_t num_pages)
+{
+    vspace_unmap_pages(&vm->mem.vmm_vspace, vaddr, num_pages, seL4_PageBits, NULL);
+    for (size_t i = 0; i < num_pages; i++) {
+        vka_cnode_delete(&slots[i]);
+    }
+}
+
+int vm_ram_touch_batch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie)
+{
+    uintptr_t end_addr = addr + size;
+    if (size == 0) {
+        return 0;
+    }
+    if (!is_ram_region(vm, addr, size)) {
+        ZF_LOGE("Failed to touch ram region: Not registered RAM region");
+        return -1;
+    }
+
+    size_t total_pages = (ROUND_UP(end_addr, PAGE_SIZE_4K) - PAGE_ALIGN_4K(addr)) / PAGE_SIZE_4K;
+    size_t window_pages = MIN(total_pages, VM_RAM_TOUCH_BATCH_PAGES);
+    cspacepath_t *slots = calloc(window_pages, sizeof(cspacepath_t));
+    seL4_CPtr *caps = calloc(window_pages, sizeof(seL4_CPtr));
+    if (!slots || !caps) {
+        ZF_LOGE("Failed to allocate touch window");
+        free(slots);
+        free(caps);
+        return -1;
+    }
+
+    int err = 0;
+    size_t allocated;
+    for (allocated = 0; allocated < window_pages; allocated++) {
+        err = vka_cspace_alloc_path(vm->vka, &slots[allocated]);
+        if (err) {
+            ZF_LOGE("Failed to allocate slot for touch window");
+            break;
+        }
+    }
+
+    uintptr_t current_addr = addr;
+    while (!err && current_addr < end_addr) {
+        uintptr_t page_addr = PAGE_ALIGN_4K(current_addr);
+        uintptr_t next_addr = MIN(end_addr, page_addr + window_pages * PAGE_SIZE_4K);
+        size_t num_pages = (ROUND_UP(next_addr, PAGE_SIZE_4K) - page_addr) / PAGE_SIZE_4K;
+        void *vaddr;
+
+        err = ram_touch_map_window(vm, slots, caps, page_addr, num_pages, &vaddr);
+        if (err) {
+            break;
+        }
+        err = touch_callback(vm, current_addr, vaddr + (current_addr - page_addr), next_addr - current_addr,
+                             current_addr - addr, cookie);
+        ram_touch_unmap_window(vm, slots, vaddr, num_pages);
+        current_addr = next_addr;
+    }
+
+    for (size_t i = 0; i < allocated; i++) {
+        vka_cspace_free_path(vm->vka, slots[i]);
+    }
+    free(slots);
+    free(caps);
+    return err;
+}
+
 int vm_ram_find_largest_free_region(vm_t *vm, uintptr_t *addr, size_t *size)
 {
     vm_mem_t *guest_memory = &vm->mem;
@@ -324,7 +424,7 @@ static int map_ram_reservation(vm_t *vm, vm_memory_reservation_t *ram_reservatio
     return 0;
 }
 
-uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
+static uintptr_t ram_register(vm_t *vm, size_t bytes)
 {
     vm_memory_reservation_t *ram_reservation;
     int err;
@@ -350,7 +450,7 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
     return base_addr;
 }
 
-int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
+static int ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
 {
     vm_memory_reservation_t *ram_reservation;
     int err;
@@ -375,6 +475,22 @@ int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
     return 0;
 }
 
+uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_RAM);
+    uintptr_t base_addr = ram_register(vm, bytes);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_RAM);
+    return base_addr;
+}
+
+int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_RAM);
+    int err = ram_register_at(vm, start, bytes, untyped);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_RAM);
+    return err;
+}
+
 void vm_ram_free(vm_t *vm, uintptr_t start, size_t bytes)
 {
     return;
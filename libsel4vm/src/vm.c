@@ -16,11 +16,14 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/boot.h>
+#include <sel4vm/boot_timing.h>
 
 #include "vm.h"
+#include "vm_boot.h"
 
 int vm_run(vm_t *vm)
 {
+    vm_boot_timing_first_entry(vm);
     return vm_run_arch(vm);
 }
 
@@ -12,7 +12,19 @@
 
 #pragma once
 
+#include <sel4vm/gen_config.h>
 #include <sel4vm/guest_vm.h>
 
 int vm_init_arch(vm_t *vm);
 int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu);
+
+#ifdef CONFIG_LIB_SEL4VM_BOOT_TIMING
+int vm_boot_timing_init(vm_t *vm, uint64_t origin);
+void vm_boot_timing_first_entry(vm_t *vm);
+#else
+static inline int vm_boot_timing_init(vm_t *vm, uint64_t origin)
+{
+    return 0;
+}
+static inline void vm_boot_timing_first_entry(vm_t *vm) {}
+#endif
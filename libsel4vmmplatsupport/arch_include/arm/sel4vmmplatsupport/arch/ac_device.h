@@ -56,3 +56,18 @@ enum vacdev_action {
  */
 int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
                                  size_t size, enum vacdev_action action);
+
+/***
+ * @function vm_install_generic_ac_device_ro(vm, d, mask, size, action)
+ * Installs a generic access controlled device with its frame mapped read only into the guest. Guest reads go
+ * straight to the device without a fault and only writes are trapped and checked against the mask. Suited to
+ * devices the guest polls, such as clock and power controllers. The device must occupy a single page
+ * @param {vm_t *} vm                       The VM to install the device into
+ * @param {const struct device *} d         A description of the device to install
+ * @param {void *} mask                     An access mask, as for 'vm_install_generic_ac_device'
+ * @param {size_t} size                     The size of the mask
+ * @param {enum vacdev_action} action       Action to take when access is violated.
+ * @return                                  0 on success, -1 on error
+ */
+int vm_install_generic_ac_device_ro(vm_t *vm, const struct device *d, void *mask,
+                                    size_t size, enum vacdev_action action);
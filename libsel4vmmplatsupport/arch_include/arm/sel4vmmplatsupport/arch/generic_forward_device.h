@@ -27,15 +27,46 @@
 typedef void (*forward_write_fn)(uint32_t addr, uint32_t value);
 typedef uint32_t (*forward_read_fn)(uint32_t addr);
 
+/* Number of posted writes that can be queued before the faulting vcpu has to wait */
+#define GENERIC_FORWARD_POSTED_WRITES 64
+
+/* Events passed to the signal and wait operations of a generic_forward_post_ops_t */
+enum generic_forward_event {
+    /* A write was added to the queue */
+    GENERIC_FORWARD_POSTED,
+    /* A write was removed from the queue and forwarded */
+    GENERIC_FORWARD_DRAINED,
+};
+
+/***
+ * @struct generic_forward_post_ops
+ * Threading operations for posting writes. Writes are queued and the guest resumed immediately, while a drainer
+ * thread forwards them in order. A read first waits for every queued write to be forwarded. A signal must not be lost
+ * if it is sent before the matching wait, as is the case for an seL4 notification.
+ * @param {int (*)(void *, void (*)(void *), void *)} start_drainer     Start a thread running 'drainer(arg)'
+ * @param {void (*)(void *, int)} signal                                Signal an enum generic_forward_event
+ * @param {void (*)(void *, int)} wait                                  Block until an enum generic_forward_event is signalled
+ * @param {void *} cookie                                               Cookie passed to each operation
+ */
+typedef struct generic_forward_post_ops {
+    int (*start_drainer)(void *cookie, void (*drainer)(void *arg), void *arg);
+    void (*signal)(void *cookie, int event);
+    void (*wait)(void *cookie, int event);
+    void *cookie;
+} generic_forward_post_ops_t;
+
 /***
  * @struct generic_forward_cfg
  * Interface for forwarding read and write faults
- * @param {forward_write_fn} write_fn   A callback for forwarding write faults
- * @param {forward_read_fn} read_fn     A callback for forwarding read faults
+ * @param {forward_write_fn} write_fn                   A callback for forwarding write faults
+ * @param {forward_read_fn} read_fn                     A callback for forwarding read faults
+ * @param {generic_forward_post_ops_t *} post_ops       Operations for posting writes. If NULL, each write is
+ *                                                      forwarded before the guest is resumed
  */
 struct generic_forward_cfg {
     forward_write_fn write_fn;
     forward_read_fn read_fn;
+    generic_forward_post_ops_t *post_ops;
 };
 
 /***
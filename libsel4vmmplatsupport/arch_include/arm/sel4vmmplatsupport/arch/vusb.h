@@ -27,6 +27,23 @@
 
 typedef struct vusb_device vusb_device_t;
 
+/***
+ * @struct vusb_coalesce_cfg
+ * Completion interrupt coalescing for a virtual usb device. Completions are reported to the guest with a single
+ * IRQ once 'max_completions' have built up, once the oldest has waited 'max_latency', or once no URBs are left in
+ * flight. The latency is only checked when a URB completes or 'vm_vusb_flush_completions' is called
+ * @param {int} max_completions                 Completions to collect before raising an IRQ. 1 raises one per completion
+ * @param {uint64_t} max_latency                Longest a completion may wait, in units of the clock
+ * @param {uint64_t (*)(void *)} clock          Read a timestamp. If NULL, completions are only reported on count
+ * @param {void *} cookie                       Cookie passed to the clock
+ */
+typedef struct vusb_coalesce_cfg {
+    int max_completions;
+    uint64_t max_latency;
+    uint64_t (*clock)(void *cookie);
+    void *cookie;
+} vusb_coalesce_cfg_t;
+
 /***
  * @function vm_install_vusb(vm, hcd, pbase, virq, vmm_ncap, vm_ncap, badge)
  * Install a virtual usb device
@@ -50,9 +67,26 @@ vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase,
  * This function should be called when a notification is received from the
  * VM. The notification is identifyable by a message on the fault endpoint
  * of the VM which has a badge that matches that which was passed into the
- * vm_install_vusb function.
+ * vm_install_vusb function. Every URB slot is scanned for pending URBs; guests
+ * can avoid the scan by writing the slots they filled to the doorbell registers.
  * @param {vusb_device_t *} vusb        A handle to a virtual usb device
  */
 void vm_vusb_notify(vusb_device_t *vusb);
 
+/***
+ * @function vm_vusb_set_coalescing(vusb, cfg)
+ * Configure completion interrupt coalescing. By default an IRQ is raised for every completion
+ * @param {vusb_device_t *} vusb            A handle to a virtual usb device
+ * @param {vusb_coalesce_cfg_t} cfg         Coalescing configuration
+ */
+void vm_vusb_set_coalescing(vusb_device_t *vusb, vusb_coalesce_cfg_t cfg);
+
+/***
+ * @function vm_vusb_flush_completions(vusb)
+ * Report any completions that have waited longer than the coalescing latency. Should be called periodically, e.g.
+ * from a timer, when a latency is configured
+ * @param {vusb_device_t *} vusb        A handle to a virtual usb device
+ */
+void vm_vusb_flush_completions(vusb_device_t *vusb);
+
 #endif /* CONFIG_LIB_USB */
@@ -24,7 +24,7 @@
 #define ACPI_START (LOWER_BIOS_START) // Start of ACPI tables; RSD PTR is right here
 #define XSDT_START (ACPI_START + 0x1000)
 
-#define MAX_ACPI_TABLES (2)
+#define MAX_ACPI_TABLES (3)
 
 #include <sel4vm/guest_vm.h>
 
@@ -35,3 +35,15 @@
  * @return                  0 for success, -1 for error
  */
 int make_guest_acpi_tables(vm_t *vm);
+
+/***
+ * @function acpi_add_pci_ecam(vm, base, start_bus, end_bus)
+ * Register a PCIe ECAM (memory mapped configuration space) window to advertise to the guest in an MCFG table.
+ * Has to be called before 'make_guest_acpi_tables'. Each VM has at most one ECAM window, registering another replaces it
+ * @param {vm_t *} vm               A handle to the guest VM instance
+ * @param {uintptr_t} base          Guest physical address of the window, which decodes from bus 0
+ * @param {uint8_t} start_bus       First bus decoded by the window
+ * @param {uint8_t} end_bus         Last bus decoded by the window
+ * @return                          0 for success, -1 for error
+ */
+int acpi_add_pci_ecam(vm_t *vm, uintptr_t base, uint8_t start_bus, uint8_t end_bus);
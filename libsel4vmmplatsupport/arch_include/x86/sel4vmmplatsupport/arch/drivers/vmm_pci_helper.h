@@ -17,6 +17,7 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/ioports.h>
+#include <sel4vmmplatsupport/drivers/pci.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
 #include <pci/virtual_pci.h>
@@ -33,6 +34,25 @@
  */
 int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars);
 
+/* Each bus takes 1MiB of a PCIe ECAM window: 32 devices of 8 functions with 4KiB of config space each */
+#define VMM_PCI_ECAM_BUS_BITS 20
+#define VMM_PCI_ECAM_SIZE (VMM_PCI_MAX_BUSES << VMM_PCI_ECAM_BUS_BITS)
+
+/***
+ * @function vmm_pci_ecam_init(vm, space, base)
+ * Emulate a PCIe ECAM (memory mapped configuration) window over the VMM PCI space and advertise it to the guest
+ * through the ACPI MCFG table, which means this has to be called before 'make_guest_acpi_tables'. A guest config
+ * access through the window is a single MMIO fault rather than the address and data port accesses of
+ * 'vmm_pci_io_port_in' and 'vmm_pci_io_port_out', and it reaches the 4KiB extended configuration space. The IO
+ * port interface stays available. The window covers every bus the PCI space can grow to
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {uintptr_t} base                  Guest physical address of the window, must be aligned to 1MiB and not
+ *                                          overlap guest RAM or devices
+ * @return                                  0 for success, -1 for error
+ */
+int vmm_pci_ecam_init(vm_t *vm, vmm_pci_space_t *space, uintptr_t base);
+
 /* Functions for emulating PCI config spaces over IO ports */
 /***
  * @function vmm_pci_io_port_in(vcpu, cookie, port_no, size, result)
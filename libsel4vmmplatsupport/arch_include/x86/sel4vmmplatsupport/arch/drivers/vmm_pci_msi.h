@@ -0,0 +1,96 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+/***
+ * @module vmm_pci_msi.h
+ * The interface presents MSI and MSI-X emulation for passthrough PCI devices on x86 platforms. The guest's view of the
+ * MSI capability and the MSI-X table is emulated and the device is programmed with host messages instead. Each host
+ * vector is remapped to the message the guest programmed for it, so a host interrupt is delivered straight to the
+ * guest local APIC with 'vmm_pci_msi_inject' rather than through a shared legacy INTx line.
+ *
+ * A passthrough device is set up with 'vmm_pci_msi_init' on its config space, 'vmm_pci_helper_map_bars_msi' in place of
+ * 'vmm_pci_helper_map_bars' and 'vmm_pci_create_msi_emulation' in place of 'vmm_pci_no_msi_cap_emulation'.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#include <pci/helper.h>
+
+/* Most MSI-X vectors that are emulated for a device, later table entries stay masked */
+#define VMM_PCI_MSIX_MAX_VECTORS 64
+
+typedef struct vmm_pci_msi vmm_pci_msi_t;
+
+/***
+ * @struct vmm_pci_msi_ops
+ * Callbacks for connecting device vectors to host interrupts
+ * @param {void *} cookie                                                   User supplied cookie to pass onto callback functions
+ * @param {int *(void *cookie, int vector, uint64_t *address, uint32_t *data)} map_vector
+ *                                                                          Allocate a host MSI for a vector of the device
+ *                                                                          and return the message the device has to send
+ *                                                                          for it, e.g. with an MSI IRQ handler from the
+ *                                                                          RPC irq allocator. Only called the first time
+ *                                                                          the guest enables the vector, the host
+ *                                                                          interrupt is expected to be forwarded with
+ *                                                                          'vmm_pci_msi_inject'
+ */
+typedef struct vmm_pci_msi_ops {
+    void *cookie;
+    int (*map_vector)(void *cookie, int vector, uint64_t *address, uint32_t *data);
+} vmm_pci_msi_ops_t;
+
+/***
+ * @function vmm_pci_msi_init(vcpu, config, ops)
+ * Find the MSI and MSI-X capabilities of a passthrough device and create the state for emulating them
+ * @param {vm_vcpu_t *} vcpu                VCPU used to deliver interrupts to the guest local APIC
+ * @param {vmm_pci_entry_t} config          Config space of the device, e.g. from 'vmm_pci_create_passthrough'
+ * @param {vmm_pci_msi_ops_t} ops           Callbacks for mapping device vectors to host interrupts
+ * @return                                  NULL on error, otherwise a handle to the MSI state of the device
+ */
+vmm_pci_msi_t *vmm_pci_msi_init(vm_vcpu_t *vcpu, vmm_pci_entry_t config, vmm_pci_msi_ops_t ops);
+
+/***
+ * @function vmm_pci_helper_map_bars_msi(vm, cfg, bars, msi)
+ * Map the PCI device bars into the VM as 'vmm_pci_helper_map_bars' does, except for the pages of the MSI-X table.
+ * Those are trapped so that guest accesses to the table are emulated
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {libpci_device_iocfg_t *} cfg     PCI device config
+ * @param {vmm_pci_bar_t *} bars            Resulting PCI bars mapped into the VM
+ * @param {vmm_pci_msi_t *} msi             MSI state of the device
+ * @return                                  -1 for error, otherwise the number of bars mapped into the VM (>=0)
+ */
+int vmm_pci_helper_map_bars_msi(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars, vmm_pci_msi_t *msi);
+
+/***
+ * @function vmm_pci_create_msi_emulation(existing, msi)
+ * Construct a pci entry that emulates the MSI and MSI-X capabilities of the device. Guest MSI programming only
+ * updates the remapping of host vectors, the device itself is programmed with the host messages
+ * @param {vmm_pci_entry_t} existing        Existing PCI entry to wrap over and emulate its MSI capabilities
+ * @param {vmm_pci_msi_t *} msi             MSI state of the device
+ * @return                                  `vmm_pci_entry_t` with emulated MSI capabilities
+ */
+vmm_pci_entry_t vmm_pci_create_msi_emulation(vmm_pci_entry_t existing, vmm_pci_msi_t *msi);
+
+/***
+ * @function vmm_pci_msi_inject(msi, vector)
+ * Forward a host interrupt for a device vector to the guest, using the message the guest programmed for the vector.
+ * If the guest has the vector masked it is left pending until the guest unmasks it
+ * @param {vmm_pci_msi_t *} msi             MSI state of the device
+ * @param {int} vector                      Vector of the device that was raised
+ * @return                                  0 on success, -1 on error
+ */
+int vmm_pci_msi_inject(vmm_pci_msi_t *msi, int vector);
@@ -40,7 +40,7 @@ struct device {
 
 /***
  * @struct device_list
- * Management for a list of devices
+ * Management for a list of devices. Devices are kept sorted by address so they can be found with a binary search
  * @param {struct device *} devices     List of registered devices
  * @param {int} num_devices             Total number of registered devices
  */
@@ -59,7 +59,8 @@ int device_list_init(device_list_t *list);
 
 /***
  * @function add_device(dev_list, d)
- * Add a generic device to a given device list without performing any initialisation of the device
+ * Add a generic device to a given device list without performing any initialisation of the device. Fails if the
+ * device overlaps one already in the list
  * @param {device_list_t *} dev_list        A handle to the device list that the device should be installed into
  * @param {const struct device *} device    A description of the device
  * @return                                  0 on success, otherwise -1 for error
@@ -68,7 +69,8 @@ int add_device(device_list_t *dev_list, const struct device *d);
 
 /***
  * @function find_device_by_pa(dev_list, addr)
- * Find a device by a given addr within a device list
+ * Find a device by a given addr within a device list. The device is stored in the list itself, so the returned
+ * pointer is only valid until the next 'add_device' on the list
  * @param {device_list_t *} dev_list    Device list to search within
  * @param {uintptr_t} addr              Add to search with
  * @return                              Pointer to device if found, otherwise NULL if not found
@@ -19,6 +19,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /***
  * @struct vmm_pci_address
@@ -33,9 +34,16 @@ typedef struct vmm_pci_address {
     uint8_t fun;
 } vmm_pci_address_t;
 
-/* Functions for accessing the pci config space */
+/* Size of the conventional PCI configuration space of a function */
+#define VMM_PCI_CONFIG_SIZE 0x100
+/* Size of the PCIe extended configuration space of a function */
+#define VMM_PCI_EXT_CONFIG_SIZE 0x1000
+
+/* Functions for accessing the pci config space. Unless 'extended' is set the functions can only reach the first
+ * VMM_PCI_CONFIG_SIZE bytes, e.g. when the host config space is accessed through IO ports */
 typedef struct vmm_pci_config {
     void *cookie;
+    bool extended;
     uint8_t (*ioread8)(void *cookie, vmm_pci_address_t addr, unsigned int offset);
     uint16_t (*ioread16)(void *cookie, vmm_pci_address_t addr, unsigned int offset);
     uint32_t (*ioread32)(void *cookie, vmm_pci_address_t addr, unsigned int offset);
@@ -57,15 +65,25 @@ typedef struct vmm_pci_entry {
     int (*iowrite)(void *cookie, int offset, int size, uint32_t value);
 } vmm_pci_entry_t;
 
+/* Number of buses the virtual PCI topology can grow to. Bus 0 is the root bus, every other bus sits behind an
+ * emulated PCI-to-PCI bridge in the last device slot of the bus before it */
+#define VMM_PCI_MAX_BUSES 8
+#define VMM_PCI_NUM_DEVICES 32
+#define VMM_PCI_NUM_FUNCTIONS 8
+
+/* Index of a Bus/Device/Function in 'vmm_pci_space_t.entries' */
+#define VMM_PCI_BDF_INDEX(bus, dev, fun) (((bus) * VMM_PCI_NUM_DEVICES + (dev)) * VMM_PCI_NUM_FUNCTIONS + (fun))
+
 /***
  * @struct vmm_pci_sapce
  * Represents a single host virtual PCI space
- * @param {vmm_pci_entry_t *} bus       The PCI bus, representing 32 devices, each of which has 8 functions
-                                        This only supports one bus at the moment.
+ * @param {vmm_pci_entry_t *} entries   Every function of every device of every bus, indexed by 'VMM_PCI_BDF_INDEX'
+ * @param {int} num_buses               Number of buses currently in the topology
  * @param {uint32_t} conf_port_addr     The current config address for IO port emulation
  */
 typedef struct vmm_pci_space {
-    vmm_pci_entry_t *bus0[32][8];
+    vmm_pci_entry_t *entries[VMM_PCI_MAX_BUSES * VMM_PCI_NUM_DEVICES * VMM_PCI_NUM_FUNCTIONS];
+    int num_buses;
     uint32_t conf_port_addr;
 } vmm_pci_space_t;
 
@@ -79,7 +97,8 @@ int vmm_pci_init(vmm_pci_space_t **space);
 
 /***
  * @function vmm_pci_add_entry(space, entry, addr)
- * Add a PCI entry. Optionally reports where it is located
+ * Add a PCI entry as function 0 of the first free device slot. Once a bus is full a PCI-to-PCI bridge is added to it
+ * and the entry is placed on the new bus behind the bridge. Optionally reports where it is located
  * @param {vmm_pci_space_t *} space         PCI space handle
  * @param {vmm_pci_entry_t} entry           PCI entry being addr
  * @param {vmm_pci_addr_t *} addr           Resulting PCI address where entry gets located
@@ -87,6 +106,64 @@ int vmm_pci_init(vmm_pci_space_t **space);
  */
 int vmm_pci_add_entry(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t *addr);
 
+/***
+ * @function vmm_pci_add_entry_at(space, entry, addr)
+ * Add a PCI entry at a fixed address. The bus must already exist and, for functions other than 0, function 0 of the
+ * device must already be present
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {vmm_pci_entry_t} entry           PCI entry being added
+ * @param {vmm_pci_address_t} addr          PCI address to place the entry at
+ * @return                                  0 on success, -1 on error
+ */
+int vmm_pci_add_entry_at(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t addr);
+
+/***
+ * @function vmm_pci_add_function(space, entry, dev_addr, addr)
+ * Add a PCI entry as the next free function of an existing device, making it a multi-function device
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {vmm_pci_entry_t} entry           PCI entry being added
+ * @param {vmm_pci_address_t} dev_addr      PCI address of the device, the function is ignored
+ * @param {vmm_pci_addr_t *} addr           Resulting PCI address where entry gets located
+ * @return                                  0 on success, -1 on error
+ */
+int vmm_pci_add_function(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t dev_addr,
+                         vmm_pci_address_t *addr);
+
+/***
+ * @function vmm_pci_is_bridge(space, addr)
+ * Test whether an address holds one of the bridges managed by the PCI space, either the host bridge or a
+ * PCI-to-PCI bridge
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {vmm_pci_address_t} addr          PCI address to test
+ * @return                                  true if the address holds a bridge
+ */
+bool vmm_pci_is_bridge(vmm_pci_space_t *space, vmm_pci_address_t addr);
+
+/***
+ * @function vmm_pci_config_read(space, addr, offset, size, result)
+ * Perform a guest read of PCI configuration space. The multi-function bit of the header type is reported from the
+ * topology rather than the entry. Reads of addresses without a device return all ones, as on real hardware
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {vmm_pci_address_t} addr          PCI address being read
+ * @param {int} offset                      Offset into the configuration space
+ * @param {int} size                        Size of the read
+ * @param {uint32_t *} result               Resulting value
+ * @return                                  0 on success, -1 on error
+ */
+int vmm_pci_config_read(vmm_pci_space_t *space, vmm_pci_address_t addr, int offset, int size, uint32_t *result);
+
+/***
+ * @function vmm_pci_config_write(space, addr, offset, size, value)
+ * Perform a guest write of PCI configuration space. Writes to addresses without a device are ignored
+ * @param {vmm_pci_space_t *} space         PCI space handle
+ * @param {vmm_pci_address_t} addr          PCI address being written
+ * @param {int} offset                      Offset into the configuration space
+ * @param {int} size                        Size of the write
+ * @param {uint32_t} value                  Value being written
+ * @return                                  0 on success, -1 on error
+ */
+int vmm_pci_config_write(vmm_pci_space_t *space, vmm_pci_address_t addr, int offset, int size, uint32_t value);
+
 /***
  * @function make_addr_reg_from_config(conf, addr, reg)
  * Convert config to pci address
@@ -96,9 +173,18 @@ int vmm_pci_add_entry(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_add
  */
 void make_addr_reg_from_config(uint32_t conf, vmm_pci_address_t *addr, uint8_t *reg);
 
+/***
+ * @function make_addr_reg_from_ecam(offset, addr, reg)
+ * Convert an offset into a PCIe ECAM (memory mapped configuration) window to pci address
+ * @param {uint32_t} offset                 Offset into the ECAM window
+ * @param {vmm_pci_address_t *} addr        Resulting PCI address
+ * @param {uint16_t *} reg                  Resulting register value, within the extended configuration space
+ */
+void make_addr_reg_from_ecam(uint32_t offset, vmm_pci_address_t *addr, uint16_t *reg);
+
 /***
  * @function find_device(self, addr)
- * Find PCI device given a PCI address (Bus/Dev/Func)
+ * Find PCI device given a PCI address (Bus/Dev/Func). This is a constant time lookup
  * @param {vmm_pci_space_t *} self      PCI space handle
  * @param {vmm_pci_address_t} addr      PCI address of device
  * @return                              NULL on error, otherwise pointer to registered pci entry
@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include <pci/pci.h>
 
+#include <sel4vm/guest_memory.h>
 #include <sel4vmmplatsupport/drivers/pci.h>
 
 #define PCI_BAR_OFFSET(b)   (offsetof(vmm_pci_device_def_t, bar##b))
@@ -119,21 +120,46 @@ typedef struct vmm_pci_bar {
     size_t size_bits;
 } vmm_pci_bar_t;
 
+/***
+ * @struct vmm_pci_bar_backing
+ * Guest memory behind an emulated memory bar. The callbacks are always given addresses at the location the bar was
+ * created at, wherever the guest has since moved the bar to
+ * @param {memory_fault_callback_fn} fault_callback     Callback for guest faults on the bar
+ * @param {void *} fault_cookie                         User supplied cookie to pass onto the fault callback
+ * @param {memory_map_iterator_fn} map_iterator         Iterator returning the frames behind the bar, NULL if the bar
+ *                                                      is purely emulated. The frame caps are deleted when the bar is
+ *                                                      moved so each call has to return a new cap, e.g. a copy
+ * @param {void *} map_cookie                           User supplied cookie to pass onto the map iterator
+ */
+typedef struct vmm_pci_bar_backing {
+    memory_fault_callback_fn fault_callback;
+    void *fault_cookie;
+    memory_map_iterator_fn map_iterator;
+    void *map_cookie;
+} vmm_pci_bar_backing_t;
+
+struct pci_bar_backing;
+
 /***
  * @struct pci_bar_emulation
  * Wrapper datastructure over a pci entry and its configuration space. This is leveraged to emulate
  * BAR accesses in an entries configuration space
  * @param {vmm_pci_entry_t} passthrough     PCI entry being emulated
  * @param {int} num_bars                    Number of PCI bars
- * @param {vmm_pci_bar_t} bars              Set of PCI bars being emulated in the PCI entry
+ * @param {vmm_pci_bar_t} bars              Set of PCI bars being emulated in the PCI entry, at their current address
  * @param {uint32_t} bar_writes             Most recent write to each PCI bar in the configuration space. This avoids
  *                                          the guest OS over-writing elements in the configuration space
+ * @param {bool} sizing                     Whether the guest has written all ones to a bar to read back its size
+ * @param {struct pci_bar_backing *} backings   Guest memory of bars that can be moved by the guest, see
+ *                                              'vmm_pci_bar_emulation_add_backing'
  */
 typedef struct pci_bar_emulation {
     vmm_pci_entry_t passthrough;
     int num_bars;
     vmm_pci_bar_t bars[6];
     uint32_t bar_writes[6];
+    bool sizing[6];
+    struct pci_bar_backing *backings[6];
 } pci_bar_emulation_t;
 
 /***
@@ -150,14 +176,24 @@ typedef struct pci_irq_emulation {
 
 /***
  * @struct pci_passthrough_device
- * Datastructure providing direct passthrough access to a pci entry configuration space
+ * Datastructure providing direct passthrough access to a pci entry configuration space. Registers that never change,
+ * such as the IDs, class code and capability list links, are read once when the device is created and guest reads of
+ * them are served from a shadow copy rather than the host PCI bus
  * @param {vmm_pci_address_t} addr          Address of PCI device
  * @param {vmm_pci_config_t} config         Ops for accessing config space
+ * @param {uint8_t *} shadow                Copy of the read only registers of the config space
+ * @param {uint64_t *} shadowed             Bitmap of the bytes of the config space held in 'shadow'
+ * @param {uint64_t} shadow_hits            Number of guest reads served from the shadow
+ * @param {uint64_t} shadow_misses          Number of guest reads forwarded to the host
  */
 typedef struct pci_passthrough_device {
     /* The address on the host system of this device */
     vmm_pci_address_t addr;
     vmm_pci_config_t config;
+    uint8_t shadow[VMM_PCI_CONFIG_SIZE];
+    uint64_t shadowed[VMM_PCI_CONFIG_SIZE / 64];
+    uint64_t shadow_hits;
+    uint64_t shadow_misses;
 } pci_passthrough_device_t;
 
 /***
@@ -230,9 +266,19 @@ void define_pci_host_bridge(vmm_pci_device_def_t *bridge);
  */
 vmm_pci_entry_t vmm_pci_create_passthrough(vmm_pci_address_t addr, vmm_pci_config_t config);
 
+/***
+ * @function vmm_pci_passthrough_print_stats(passthrough)
+ * Print how many guest config space reads of a passthrough device were served from its shadow of the read only
+ * registers and how many were forwarded to the host
+ * @param {vmm_pci_entry_t} passthrough     Entry created with 'vmm_pci_create_passthrough'
+ */
+void vmm_pci_passthrough_print_stats(vmm_pci_entry_t passthrough);
+
 /***
  * @function vmm_pci_create_bar_emulation(existing, num_bars, bars)
- * Construct a pci entry that emulates configuration space bar read/write's. The rest of the configuration space is passed on
+ * Construct a pci entry that emulates configuration space bar read/write's. The rest of the configuration space is passed on.
+ * Bars can be sized by the guest by writing all ones to them. The guest can only move bars given a backing with
+ * 'vmm_pci_bar_emulation_add_backing', other bars stay at their address
  * @param {vmm_pci_entry_t} existing    Existing PCI entry to wrap over and emulate its bar accesses
  * @param {int} num_bars                Number of emulated bars in PCI entry
  * @param {vmm_pci_bar_t *} bars        Set of bars to emulate access to
@@ -240,6 +286,19 @@ vmm_pci_entry_t vmm_pci_create_passthrough(vmm_pci_address_t addr, vmm_pci_confi
  */
 vmm_pci_entry_t vmm_pci_create_bar_emulation(vmm_pci_entry_t existing, int num_bars, vmm_pci_bar_t *bars);
 
+/***
+ * @function vmm_pci_bar_emulation_add_backing(vm, entry, bar, backing)
+ * Reserve, and map if the backing has a map iterator, the guest memory of a memory bar at its current address. The
+ * bar emulation then owns the reservation and moves it when the guest programs a new address into the bar, so the bar
+ * can have its natural size rather than being padded to stop the guest from relocating it
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vmm_pci_entry_t} entry               Entry created with 'vmm_pci_create_bar_emulation'
+ * @param {int} bar                             Index of the memory bar to back
+ * @param {vmm_pci_bar_backing_t} backing       Guest memory behind the bar
+ * @return                                      0 on success, -1 on error
+ */
+int vmm_pci_bar_emulation_add_backing(vm_t *vm, vmm_pci_entry_t entry, int bar, vmm_pci_bar_backing_t backing);
+
 /***
  * @function vmm_pci_create_passthrough_bar_emulation(existing, num_bars, bars)
  * Construct a pci entry that passes through all bar read/writes through to emulated io(read/write) handlers. This is the
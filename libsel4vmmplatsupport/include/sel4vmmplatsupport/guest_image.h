@@ -49,7 +49,8 @@ typedef struct guest_kernel_image {
 
 /***
  * @function vm_load_guest_kernel(vm, kernel_name, load_address, alignment, guest_kernel_image)
- * Load guest kernel image
+ * Load guest kernel image. On ARM, images compressed with gzip, LZ4 or zstd (see magic bytes) are decompressed
+ * straight into guest RAM
  * @param {vm_t *} vm                                           Handle to the VM
  * @param {const char *} kernel_name                            Name of the kernel image
  * @param {uintptr_t} load_address                              Address to load guest kernel image at
@@ -62,7 +63,7 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
 
 /***
  * @function vm_load_guest_module(vm, module_name, load_address, alignment, guest_image)
- * Load guest kernel module e.g. initrd
+ * Load guest kernel module e.g. initrd. On ARM, compressed modules are decompressed straight into guest RAM
  * @param {vm_t *} vm                           Handle to the VM
  * @param {const char *} module_name            Name of the module image
  * @param {uintptr_t} load_address              Address to load guest kernel image at
@@ -72,3 +73,69 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
  */
 int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
                          guest_image_t *guest_image);
+
+/* Number of chunk buffers shared between the image reader and the thread copying into guest RAM */
+#define GUEST_IMAGE_LOAD_BUFFERS 4
+
+/* Events passed to the signal and wait operations of a guest_image_load_ops_t */
+enum guest_image_load_event {
+    /* A buffer was filled by the reader */
+    GUEST_IMAGE_LOAD_FILLED,
+    /* A buffer was copied into guest RAM and can be reused */
+    GUEST_IMAGE_LOAD_DRAINED,
+};
+
+/***
+ * @struct guest_image_load_ops
+ * Threading and timing operations used by 'vm_load_guest_images'. A signal must not be lost if it is sent before
+ * the matching wait, as is the case for an seL4 notification.
+ * @param {int (*)(void *, void (*)(void *), void *)} start_reader  Start a thread running 'reader(arg)'. If NULL, images are read on the calling thread
+ * @param {void (*)(void *, int)} signal                            Signal an enum guest_image_load_event
+ * @param {void (*)(void *, int)} wait                              Block until an enum guest_image_load_event is signalled
+ * @param {uint64_t (*)(void *)} clock                              Read a timestamp for the per image timing. May be NULL
+ * @param {void *} cookie                                           Cookie passed to each operation
+ */
+typedef struct guest_image_load_ops {
+    int (*start_reader)(void *cookie, void (*reader)(void *arg), void *arg);
+    void (*signal)(void *cookie, int event);
+    void (*wait)(void *cookie, int event);
+    uint64_t (*clock)(void *cookie);
+    void *cookie;
+} guest_image_load_ops_t;
+
+/***
+ * @struct guest_image_load_request
+ * An image to be loaded by 'vm_load_guest_images'
+ * @param {const char *} name                       Name of the image
+ * @param {bool} is_kernel                          Whether the image is the guest kernel or a module
+ * @param {uintptr_t} load_address                  Address to load the image at
+ * @param {size_t} alignment                        Alignment for loading the image
+ * @param {guest_kernel_image_t *} kernel_image     Result of loading a kernel image
+ * @param {guest_image_t *} image                   Result of loading a module image
+ * @param {uint64_t} load_time                      Set to the time taken to load the image, in units of the clock operation
+ */
+typedef struct guest_image_load_request {
+    const char *name;
+    bool is_kernel;
+    uintptr_t load_address;
+    size_t alignment;
+    guest_kernel_image_t *kernel_image;
+    guest_image_t *image;
+    uint64_t load_time;
+} guest_image_load_request_t;
+
+/***
+ * @function vm_load_guest_images(vm, requests, num_requests, ops)
+ * Load a set of independent guest images (e.g. kernel, initrd and dtb) concurrently. A reader fetches chunks of
+ * every image in turn into a small ring of buffers, while the calling thread copies completed chunks into guest
+ * RAM, so file reads overlap with mapping and copying. Images that cannot be streamed (e.g. compressed images)
+ * are loaded with 'vm_load_guest_kernel' or 'vm_load_guest_module' instead. The calling thread must own the VM's
+ * vka and vspace, as only it maps guest RAM.
+ * @param {vm_t *} vm                                   Handle to the VM
+ * @param {guest_image_load_request_t *} requests       Images to load
+ * @param {int} num_requests                            Number of images to load
+ * @param {guest_image_load_ops_t *} ops                Threading and timing operations
+ * @return                                              0 on success, otherwise -1 on error
+ */
+int vm_load_guest_images(vm_t *vm, guest_image_load_request_t *requests, int num_requests,
+                         guest_image_load_ops_t *ops);
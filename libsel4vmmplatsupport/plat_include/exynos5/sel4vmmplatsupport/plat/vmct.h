@@ -16,3 +16,15 @@
 
 extern const struct device dev_vmct_timer;
 int vm_install_vmct(vm_t *vm);
+
+/**
+ * Installs the MCT with its registers mapped read only into the guest,
+ * so reading the free running counter doesn't fault. Writes are still
+ * trapped and not passed on. Writes to the comparators, control and
+ * local timer buffers are reported as complete in the real write status
+ * registers. Writes to the global counter are not, so this suits guests
+ * that leave the counter running rather than resetting it
+ * @param[in] vm  The vm in which to install the device
+ * @return        0 on success
+ */
+int vm_install_vmct_ro(vm_t *vm);
@@ -18,3 +18,15 @@ const struct device dev_msh0;
 const struct device dev_msh2;
 int vm_install_nodma_sdhc0(vm_t *vm);
 int vm_install_nodma_sdhc2(vm_t *vm);
+
+/**
+ * Installs an SDHC that lets the guest use the internal DMA controller.
+ * The guest's descriptor list is copied and its buffer addresses are
+ * translated to physical addresses whenever a transfer may start, so
+ * data moves without a fault per word of the FIFO. Buffers outside of
+ * guest RAM are never handed to the controller
+ * @param[in] vm  The vm in which to install the device
+ * @return        0 on success
+ */
+int vm_install_idmac_sdhc0(vm_t *vm);
+int vm_install_idmac_sdhc2(vm_t *vm);
@@ -15,6 +15,9 @@
 #include <sel4vm/guest_vm.h>
 
 #define dev_vconsole dev_uart2
+
+/* Receives the console output of a VM, one flushed buffer at a time */
+typedef void (*vuart_sink_fn)(void *cookie, const char *buf, size_t len);
 extern const struct device dev_uart0;
 extern const struct device dev_uart1;
 extern const struct device dev_uart2;
@@ -37,3 +40,17 @@ int vm_install_ac_uart(vm_t *vm, const struct device *d);
  * @return       0 on success
  */
 int vm_install_vconsole(vm_t *vm);
+
+/**
+ * Installs the default console device with its output sent to a
+ * sink rather than stdout. Characters written to the console are
+ * buffered until end of line or until the buffer is full, and then
+ * passed to the sink in a single call. The TX FIFO always appears
+ * empty to the guest
+ * @param[in] vm           The VM in which to install the vconsole device
+ * @param[in] sink         Function to receive the console output, must not
+ *                         be NULL
+ * @param[in] sink_cookie  Cookie passed to the sink
+ * @return                 0 on success, -1 on error or if sink is NULL
+ */
+int vm_install_vconsole_with_sink(vm_t *vm, vuart_sink_fn sink, void *sink_cookie);
@@ -14,7 +14,9 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/boot_timing.h>
 #include <sel4vmmplatsupport/device.h>
+#include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/arch/ac_device.h>
 
 struct gac_device_priv {
@@ -77,8 +79,8 @@ handle_gac_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_l
 }
 
 
-int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
-                                 size_t mask_size, enum vacdev_action action)
+static int install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
+                                     size_t mask_size, enum vacdev_action action, bool map_reads)
 {
     struct gac_device_priv* gac_device_priv;
     struct device *dev;
@@ -102,6 +104,27 @@ int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
     gac_device_priv->mask_size = mask_size;
     gac_device_priv->action = action;
 
+    /* Add the device */
+    dev->priv = gac_device_priv;
+
+    if (map_reads) {
+        if (dev->size != PAGE_SIZE_4K) {
+            ZF_LOGE("Read mapped access controlled devices must be a single page");
+            free(dev);
+            free(gac_device_priv);
+            return -1;
+        }
+        /* The guest reads the device directly, only writes fault */
+        gac_device_priv->regs = create_device_reservation_frame(vm, dev->pstart, seL4_CanRead,
+                                                                handle_gac_fault, (void *)dev);
+        if (gac_device_priv->regs == NULL) {
+            free(dev);
+            free(gac_device_priv);
+            return -1;
+        }
+        return 0;
+    }
+
     /* Map the device */
     gac_device_priv->regs = ps_io_map(&vm->io_ops->io_mapper, d->pstart, PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
 
@@ -111,9 +134,6 @@ int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
         return -1;
     }
 
-    /* Add the device */
-    dev->priv = gac_device_priv;
-
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, dev->pstart, dev->size,
             handle_gac_fault, (void *)dev);
     if (!reservation) {
@@ -125,3 +145,21 @@ int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
     return 0;
 }
 
+int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
+                                 size_t mask_size, enum vacdev_action action)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_DEVICES);
+    int err = install_generic_ac_device(vm, d, mask, mask_size, action, false);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_DEVICES);
+    return err;
+}
+
+int vm_install_generic_ac_device_ro(vm_t *vm, const struct device *d, void *mask,
+                                    size_t mask_size, enum vacdev_action action)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_DEVICES);
+    int err = install_generic_ac_device(vm, d, mask, mask_size, action, true);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_DEVICES);
+    return err;
+}
+
@@ -12,16 +12,71 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <utils/fence.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
 
 #include <sel4vmmplatsupport/arch/generic_forward_device.h>
 #include <sel4vmmplatsupport/device.h>
 
+struct gf_posted_write {
+    uint32_t offset;
+    uint32_t value;
+};
+
 struct gf_device_priv {
     struct generic_forward_cfg cfg;
+    /* Writes are posted at head by the faulting vcpu and forwarded from tail by the drainer */
+    struct gf_posted_write posted[GENERIC_FORWARD_POSTED_WRITES];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    bool posting;
 };
 
+static void gf_drainer(void *arg)
+{
+    struct gf_device_priv *gf_device_priv = arg;
+    generic_forward_post_ops_t *ops = gf_device_priv->cfg.post_ops;
+
+    while (1) {
+        if (gf_device_priv->tail == gf_device_priv->head) {
+            ops->wait(ops->cookie, GENERIC_FORWARD_POSTED);
+            continue;
+        }
+        THREAD_MEMORY_ACQUIRE();
+        struct gf_posted_write *write = &gf_device_priv->posted[gf_device_priv->tail % GENERIC_FORWARD_POSTED_WRITES];
+        gf_device_priv->cfg.write_fn(write->offset, write->value);
+        THREAD_MEMORY_RELEASE();
+        gf_device_priv->tail++;
+        ops->signal(ops->cookie, GENERIC_FORWARD_DRAINED);
+    }
+}
+
+/* Wait until no more than 'max_queued' writes are waiting to be forwarded */
+static void gf_wait_for_drain(struct gf_device_priv *gf_device_priv, uint32_t max_queued)
+{
+    generic_forward_post_ops_t *ops = gf_device_priv->cfg.post_ops;
+    while (gf_device_priv->head - gf_device_priv->tail > max_queued) {
+        ops->wait(ops->cookie, GENERIC_FORWARD_DRAINED);
+    }
+    /* The drainer's forwarded writes happen before anything we do next */
+    THREAD_MEMORY_ACQUIRE();
+}
+
+static void gf_post_write(struct gf_device_priv *gf_device_priv, uint32_t offset, uint32_t value)
+{
+    generic_forward_post_ops_t *ops = gf_device_priv->cfg.post_ops;
+    gf_wait_for_drain(gf_device_priv, GENERIC_FORWARD_POSTED_WRITES - 1);
+    struct gf_posted_write *write = &gf_device_priv->posted[gf_device_priv->head % GENERIC_FORWARD_POSTED_WRITES];
+    write->offset = offset;
+    write->value = value;
+    /* The write must be complete before it is published */
+    THREAD_MEMORY_RELEASE();
+    gf_device_priv->head++;
+    ops->signal(ops->cookie, GENERIC_FORWARD_POSTED);
+}
+
 static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                                              void *cookie)
 {
@@ -36,6 +91,10 @@ static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
 
     /* Dispatch to external fault handler */
     if (is_vcpu_read_fault(vcpu)) {
+        if (gf_device_priv->posting) {
+            /* Reads must observe every earlier write */
+            gf_wait_for_drain(gf_device_priv, 0);
+        }
         if (gf_device_priv->cfg.read_fn == NULL) {
             ZF_LOGD("No read function provided");
             set_vcpu_fault_data(vcpu, 0);
@@ -45,6 +104,8 @@ static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
     } else  {
         if (gf_device_priv->cfg.write_fn == NULL) {
             ZF_LOGD("No write function provided");
+        } else if (gf_device_priv->posting) {
+            gf_post_write(gf_device_priv, offset, get_vcpu_fault_data(vcpu));
         } else {
             gf_device_priv->cfg.write_fn(offset, get_vcpu_fault_data(vcpu));
         }
@@ -88,5 +149,16 @@ int vm_install_generic_forward_device(vm_t *vm, const struct device *d,
         return -1;
     }
 
+    generic_forward_post_ops_t *ops = cfg.post_ops;
+    if (ops && cfg.write_fn) {
+        if (!ops->start_drainer || !ops->signal || !ops->wait) {
+            ZF_LOGW("Incomplete post ops for %s, forwarding writes synchronously", dev->name);
+        } else if (ops->start_drainer(ops->cookie, gf_drainer, gf_device_priv)) {
+            ZF_LOGW("Failed to start drainer for %s, forwarding writes synchronously", dev->name);
+        } else {
+            gf_device_priv->posting = true;
+        }
+    }
+
     return 0;
 }
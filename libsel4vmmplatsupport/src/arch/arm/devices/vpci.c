@@ -77,23 +77,23 @@ struct pci_cfg_data {
     vmm_pci_space_t *pci;
 };
 
-static void pci_cfg_read_fault(struct device *d, vm_t *vm, vm_vcpu_t *vcpu, vmm_pci_address_t pci_addr,
-                               uint8_t offset, vmm_pci_entry_t *dev)
+static void pci_cfg_read_fault(struct device *d, vm_t *vm, vm_vcpu_t *vcpu, vmm_pci_space_t *pci,
+                               vmm_pci_address_t pci_addr, uint8_t offset)
 {
-    seL4_Word data = 0;
+    uint32_t data = 0;
     int err = 0;
 
-    err = dev->ioread((void *)dev->cookie, offset, get_vcpu_fault_size(vcpu), &data);
+    err = vmm_pci_config_read(pci, pci_addr, offset, get_vcpu_fault_size(vcpu), &data);
     if (err) {
         ZF_LOGE("Failure performing read from PCI CFG device");
     }
 
     seL4_Word s = (get_vcpu_fault_address(vcpu) & 0x3) * 8;
-    set_vcpu_fault_data(vcpu, data << s);
+    set_vcpu_fault_data(vcpu, (seL4_Word)data << s);
 }
 
-static void pci_cfg_write_fault(struct device *d, vm_t *vm, vm_vcpu_t *vcpu, vmm_pci_address_t pci_addr,
-                                uint8_t offset, vmm_pci_entry_t *dev)
+static void pci_cfg_write_fault(struct device *d, vm_t *vm, vm_vcpu_t *vcpu, vmm_pci_space_t *pci,
+                                vmm_pci_address_t pci_addr, uint8_t offset)
 {
     uint32_t mask;
     uint32_t value;
@@ -103,15 +103,17 @@ static void pci_cfg_write_fault(struct device *d, vm_t *vm, vm_vcpu_t *vcpu, vmm
     bar = (offset - PCI_BAR_OFFSET(0)) / sizeof(uint32_t);
     mask = get_vcpu_fault_data_mask(vcpu);
     value = get_vcpu_fault_data(vcpu) & mask;
-    pci_bar_emulation_t *bar_emul = dev->cookie;
+    vmm_pci_entry_t *dev = find_device(pci, pci_addr);
     /* Linux will mask the PCI bar expecting its next read to be the size of the bar.
     * To handle this we write the bars size to pci header such that the kernels next read will
-    * be the size. */
-    if (bar < 6 && value == PCI_CFG_BAR_MASK) {
+    * be the size. Bridges are not bar emulations, and their type 1 header reuses the registers
+    * after the first two bars. */
+    if (dev && bar < 6 && value == PCI_CFG_BAR_MASK && !vmm_pci_is_bridge(pci, pci_addr)) {
+        pci_bar_emulation_t *bar_emul = dev->cookie;
         uint32_t bar_size =  BIT((bar_emul->bars[bar].size_bits));
         err = dev->iowrite((void *)dev->cookie, offset, sizeof(bar_size), bar_size);
     } else {
-        err = dev->iowrite((void *)dev->cookie, offset, sizeof(value), value);
+        err = vmm_pci_config_write(pci, pci_addr, offset, sizeof(value), value);
     }
     if (err) {
         ZF_LOGE("Failure writing to PCI CFG device");
@@ -130,20 +132,11 @@ static memory_fault_result_t pci_cfg_fault_handler(vm_t *vm, vm_vcpu_t *vcpu, ui
     fault_addr -= PCI_CFG_REGION_ADDR;
 
     make_addr_reg_from_config(fault_addr, &pci_addr, &offset);
-    pci_addr.fun = 0;
-
-    vmm_pci_entry_t *pci_dev = find_device(pci, pci_addr);
-    if (!pci_dev) {
-        ZF_LOGW("Failed to find pci device B:%d D:%d F:%d", pci_addr.bus, pci_addr.dev, pci_addr.fun);
-        /* No device found */
-        advance_vcpu_fault(vcpu);
-        return FAULT_HANDLED;
-    }
 
     if (is_vcpu_read_fault(vcpu)) {
-        pci_cfg_read_fault(dev, vm, vcpu, pci_addr, offset, pci_dev);
+        pci_cfg_read_fault(dev, vm, vcpu, pci, pci_addr, offset);
     } else {
-        pci_cfg_write_fault(dev, vm, vcpu, pci_addr, offset, pci_dev);
+        pci_cfg_write_fault(dev, vm, vcpu, pci, pci_addr, offset);
     }
 
     advance_vcpu_fault(vcpu);
@@ -241,6 +234,75 @@ static int append_prop_with_cells(void *fdt, int offset,  uint64_t val, int num_
     return err;
 }
 
+static void fdt_generate_vpci_irq_map(vmm_pci_space_t *pci, void *fdt, int node, int bus, int gic_phandle)
+{
+    bool is_irq_map = false;
+    for (int dev = 0; dev < VMM_PCI_NUM_DEVICES; dev++) {
+        for (int fun = 0; fun < VMM_PCI_NUM_FUNCTIONS; fun++) {
+            vmm_pci_address_t addr = {
+                .bus = bus, .dev = dev, .fun = fun
+            };
+            vmm_pci_entry_t *pci_entry = find_device(pci, addr);
+            /* Bridges don't need to be recorded in the irq map */
+            if (!pci_entry || vmm_pci_is_bridge(pci, addr)) {
+                continue;
+            }
+            pci_bar_emulation_t *bar_emul = (pci_bar_emulation_t *)pci_entry->cookie;
+            vmm_pci_entry_t entry = bar_emul->passthrough;
+            vmm_pci_device_def_t *pci_config = (vmm_pci_device_def_t *)entry.cookie;
+            struct pci_interrupt_map irq_map;
+            irq_map.pci_mask.pci_addr.hi  = cpu_to_fdt32(bus << PCI_ADDR_BUS_SHIFT | dev << PCI_ADDR_DEV_SHIFT |
+                                                         fun << PCI_ADDR_FUNC_SHIFT);
+            irq_map.pci_mask.pci_addr.mid  = 0;
+            irq_map.pci_mask.pci_addr.low  = 0;
+            irq_map.pci_mask.irq_pin = cpu_to_fdt32(pci_config->interrupt_pin);
+            irq_map.gic_phandle = cpu_to_fdt32(gic_phandle);
+            irq_map.irq_type = 0;
+#if GIC_ADDRESS_CELLS == 0x1
+            irq_map.irq_num = cpu_to_fdt32(pci_config->interrupt_line - 32);
+#else
+            irq_map.irq_num = cpu_to_fdt64(pci_config->interrupt_line - 32);
+#endif
+            irq_map.irq_flags = cpu_to_fdt32(0x4);
+            FDT_OP(fdt_appendprop(fdt, node, "interrupt-map", &irq_map, sizeof(irq_map)));
+            is_irq_map = true;
+        }
+    }
+    if (is_irq_map) {
+        struct pci_interrupt_map_mask irq_mask;
+        irq_mask.pci_addr.hi = cpu_to_fdt32(0xffff00);
+        irq_mask.pci_addr.mid = 0;
+        irq_mask.pci_addr.low = 0;
+        irq_mask.irq_pin = cpu_to_fdt32(0x7);
+        FDT_OP(fdt_appendprop(fdt, node, "interrupt-map-mask", &irq_mask, sizeof(irq_mask)));
+    }
+}
+
+/* Linux resolves the interrupts of a device behind a bridge with the bridge's node if it has one, rather than
+ * swizzling through the bridge to the host's map, so each bridge gets a node with its own map */
+static int fdt_generate_vpci_bridge_node(vmm_pci_space_t *pci, void *fdt, int parent_node, int bus)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "pci@%x,0", VMM_PCI_NUM_DEVICES - 1);
+    int bridge_node = fdt_add_subnode(fdt, parent_node, name);
+    if (bridge_node < 0) {
+        return bridge_node;
+    }
+
+    struct pci_fdt_address bridge_addr;
+    bridge_addr.hi = cpu_to_fdt32(bus << PCI_ADDR_BUS_SHIFT | (VMM_PCI_NUM_DEVICES - 1) << PCI_ADDR_DEV_SHIFT);
+    bridge_addr.mid = 0;
+    bridge_addr.low = 0;
+    FDT_OP(fdt_appendprop(fdt, bridge_node, "reg", &bridge_addr, sizeof(bridge_addr)));
+    FDT_OP(fdt_appendprop_u64(fdt, bridge_node, "reg", 0));
+    FDT_OP(append_prop_with_cells(fdt, bridge_node, 0x3, 1, "#address-cells"));
+    FDT_OP(append_prop_with_cells(fdt, bridge_node, 0x2, 1, "#size-cells"));
+    FDT_OP(append_prop_with_cells(fdt, bridge_node, 0x1, 1, "#interrupt-cells"));
+    FDT_OP(fdt_appendprop_string(fdt, bridge_node, "device_type", "pci"));
+    FDT_OP(fdt_appendprop(fdt, bridge_node, "ranges", NULL, 0));
+    return bridge_node;
+}
+
 int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_phandle)
 {
     int err;
@@ -261,7 +323,7 @@ int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_ph
     FDT_OP(fdt_appendprop_string(fdt, pci_node, "device_type", "pci"));
     FDT_OP(fdt_appendprop(fdt, pci_node, "dma-coherent", NULL, 0));
     FDT_OP(append_prop_with_cells(fdt, pci_node, 0x0, 1, "bus-range"));
-    FDT_OP(append_prop_with_cells(fdt, pci_node, 0x1, 1, "bus-range"));
+    FDT_OP(append_prop_with_cells(fdt, pci_node, pci->num_buses - 1, 1, "bus-range"));
 
     /* PCI Host CFG Region */
     FDT_OP(append_prop_with_cells(fdt, pci_node, PCI_CFG_REGION_ADDR, address_cells, "reg"));
@@ -285,42 +347,17 @@ int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_ph
     FDT_OP(append_prop_with_cells(fdt, pci_node, PCI_MEM_REGION_ADDR, address_cells, "ranges"));
     FDT_OP(fdt_appendprop_u64(fdt, pci_node, "ranges", PCI_MEM_REGION_SIZE));
 
-    /* PCI IRQ map */
-    bool is_irq_map = false;
-    /* The first device is always the bridge (which doesn't need to be recorded in the ranges) */
-    for (int i = 1; i < 32; i++) {
-        if (pci->bus0[i][0]) {
-            pci_bar_emulation_t *bar_emul = (pci_bar_emulation_t *)(pci->bus0[i][0])->cookie;
-            vmm_pci_entry_t entry = bar_emul->passthrough;
-            vmm_pci_device_def_t *pci_config = (vmm_pci_device_def_t *)entry.cookie;
-            struct pci_interrupt_map irq_map;
-            irq_map.pci_mask.pci_addr.hi  = cpu_to_fdt32(i << PCI_ADDR_DEV_SHIFT);
-            irq_map.pci_mask.pci_addr.mid  = 0;
-            irq_map.pci_mask.pci_addr.low  = 0;
-            irq_map.pci_mask.irq_pin = cpu_to_fdt32(pci_config->interrupt_pin);
-            irq_map.gic_phandle = cpu_to_fdt32(gic_phandle);
-            irq_map.irq_type = 0;
-#if GIC_ADDRESS_CELLS == 0x1
-            irq_map.irq_num = cpu_to_fdt32(pci_config->interrupt_line - 32);
-#else
-            irq_map.irq_num = cpu_to_fdt64(pci_config->interrupt_line - 32);
-#endif
-            irq_map.irq_flags = cpu_to_fdt32(0x4);
-            FDT_OP(fdt_appendprop(fdt, pci_node, "interrupt-map", &irq_map, sizeof(irq_map)));
-            is_irq_map = true;
-        } else {
-            /* We assume no empty gaps */
-            break;
+    /* PCI IRQ map, with a node for each bridge holding the map for the bus behind it */
+    int bus_node = pci_node;
+    for (int bus = 0; bus < pci->num_buses; bus++) {
+        fdt_generate_vpci_irq_map(pci, fdt, bus_node, bus, gic_phandle);
+        if (bus + 1 < pci->num_buses) {
+            bus_node = fdt_generate_vpci_bridge_node(pci, fdt, bus_node, bus);
+            if (bus_node < 0) {
+                return bus_node;
+            }
         }
     }
-    if (is_irq_map) {
-        struct pci_interrupt_map_mask irq_mask;
-        irq_mask.pci_addr.hi = cpu_to_fdt32(0xf800);
-        irq_mask.pci_addr.mid = 0;
-        irq_mask.pci_addr.low = 0;
-        irq_mask.irq_pin = cpu_to_fdt32(0x7);
-        FDT_OP(fdt_appendprop(fdt, pci_node, "interrupt-map-mask", &irq_mask, sizeof(irq_mask)));
-    }
 
     return 0;
 }
@@ -33,6 +33,8 @@
 #include <string.h>
 
 #define MAX_ACTIVE_URB   (0x1000 / sizeof(struct sel4urb))
+/* Number of doorbell words needed to cover every URB slot */
+#define NOTIFY_URB_WORDS DIV_ROUND_UP(MAX_ACTIVE_URB, 32)
 
 #define SURBT_PARAM_GET_TYPE(param) (((param) >> 30) & 0x3)
 #define SURBT_PARAM_GET_SIZE(param) (((param) >>  0) & 0x0fffffff)
@@ -87,6 +89,8 @@ typedef struct usb_ctrl_regs {
     uint32_t cancel_transaction;
     uint32_t nPorts;
     struct usbreq req;
+    /* Doorbells: writing a mask to word n submits URB slots n * 32 + bit */
+    uint32_t notify_urbs[NOTIFY_URB_WORDS];
 } usb_ctrl_regs_t;
 
 struct vframe {
@@ -108,6 +112,14 @@ struct vusb_device {
         int idx;
     } token[MAX_ACTIVE_URB];
     int int_pending;
+    /* URB slots waiting to be scheduled */
+    uint32_t pending[NOTIFY_URB_WORDS];
+    /* URBs scheduled with the HCD that have not completed */
+    int active;
+    /* Completions not yet reported to the guest, and when the first of them happened */
+    int completions;
+    uint64_t first_completion;
+    vusb_coalesce_cfg_t coalesce;
 };
 
 
@@ -134,6 +146,32 @@ static void vusb_inject_irq(vusb_device_t *vusb)
     }
 }
 
+static uint64_t vusb_clock(vusb_device_t *vusb)
+{
+    return vusb->coalesce.clock ? vusb->coalesce.clock(vusb->coalesce.cookie) : 0;
+}
+
+static void vusb_record_completion(vusb_device_t *vusb)
+{
+    if (vusb->completions++ == 0) {
+        vusb->first_completion = vusb_clock(vusb);
+    }
+}
+
+/* Report completions once enough have built up, once the oldest has waited long
+ * enough, or once nothing is left in flight that could add to them */
+static void vusb_check_completions(vusb_device_t *vusb)
+{
+    if (vusb->completions == 0) {
+        return;
+    }
+    if (vusb->completions >= vusb->coalesce.max_completions || vusb->active == 0
+        || (vusb->coalesce.clock && vusb_clock(vusb) - vusb->first_completion >= vusb->coalesce.max_latency)) {
+        vusb->completions = 0;
+        vusb_inject_irq(vusb);
+    }
+}
+
 static int desc_to_xact(vm_t *vm, struct sel4urbt *desc, struct xact *xact)
 {
     switch (SURBT_PARAM_GET_TYPE(desc->param)) {
@@ -245,6 +283,8 @@ static void vm_vusb_cancel(vusb_device_t *vusb, uint32_t surb_idx)
     }
 }
 
+static void vusb_schedule_pending(vusb_device_t *vusb);
+
 static memory_fault_result_t
 handle_vusb_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                   void *cookie)
@@ -278,9 +318,13 @@ handle_vusb_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_
         } else if (reg == &ctrl_regs->cancel_transaction) {
             /* Manual notification */
             vm_vusb_cancel(vusb, get_vcpu_fault_data(vcpu));
-        } else if ((void*)reg >= (void*)&ctrl_regs->req) {
+        } else if ((void*)reg >= (void*)&ctrl_regs->req && (void*)reg < (void*)(&ctrl_regs->req + 1)) {
             /* Fill out the root hub USB request */
             *reg = emulate_vcpu_fault(vcpu, *reg);
+        } else if (reg >= ctrl_regs->notify_urbs && reg < ctrl_regs->notify_urbs + NOTIFY_URB_WORDS) {
+            /* Submit a batch of URBs */
+            vusb->pending[reg - ctrl_regs->notify_urbs] |= emulate_vcpu_fault(vcpu, 0);
+            vusb_schedule_pending(vusb);
         }
     }
     advance_vcpu_fault(vcpu);
@@ -340,63 +384,106 @@ static int vusb_complete_cb(void *token, enum usb_xact_status stat, int rbytes)
         status = SURB_EPADDR_STATE_ERROR;
     }
     surb_epaddr_change_state(surb, status);
-    vusb_inject_irq(vusb);
+    vusb->active--;
+    vusb_record_completion(vusb);
+    vusb_check_completions(vusb);
 
     return 0;
 }
 
-void vm_vusb_notify(vusb_device_t *vusb)
+static void vusb_schedule_urb(vusb_device_t *vusb, int i)
 {
     struct sel4urb *u;
     struct xact xact[3];
     enum usb_speed speed;
     struct endpoint ep;
+    struct xact_token *t;
     int len;
     int nxact;
-    int i;
-    for (i = 0; i < MAX_ACTIVE_URB; i++) {
-        struct xact_token *t;
-        u = &vusb->data_regs->sel4urb[i];
-        if (SURB_EPADDR_GET_STATE(u->epaddr) != SURB_EPADDR_STATE_PENDING) {
-            continue;
-        }
-        ZF_LOGD("descriptor %d ACTIVE\n", i);
-
-        switch (SURB_EPADDR_GET_SPEED(u->epaddr)) {
-        case 3:
-            speed = USBSPEED_HIGH;
-            break;
-        default:
-            printf("Unknown USB speed %d\n", SURB_EPADDR_GET_SPEED(u->epaddr));
-            speed = USBSPEED_HIGH;
-            assert(0);
-        }
 
-        nxact = sel4urb_to_xact(vusb->vm, u, xact);
-        if (nxact < 0) {
-            ZF_LOGD("descriptor error\n");
-            surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
-            vusb_inject_irq(vusb);
-            return;
+    u = &vusb->data_regs->sel4urb[i];
+    if (SURB_EPADDR_GET_STATE(u->epaddr) != SURB_EPADDR_STATE_PENDING) {
+        return;
+    }
+    ZF_LOGD("descriptor %d ACTIVE\n", i);
+
+    switch (SURB_EPADDR_GET_SPEED(u->epaddr)) {
+    case 3:
+        speed = USBSPEED_HIGH;
+        break;
+    default:
+        printf("Unknown USB speed %d\n", SURB_EPADDR_GET_SPEED(u->epaddr));
+        speed = USBSPEED_HIGH;
+        assert(0);
+    }
+
+    nxact = sel4urb_to_xact(vusb->vm, u, xact);
+    if (nxact < 0) {
+        ZF_LOGD("descriptor error\n");
+        surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
+        vusb_record_completion(vusb);
+        return;
+    }
+    t = &vusb->token[i];
+    t->vusb = vusb;
+    t->idx = i;
+    ep.num = SURB_EPADDR_EP(u->epaddr);
+    ep.max_pkt = u->max_pkt;
+    ep.interval = u->rate_ms;
+    /* Count the URB before scheduling in case it completes straight away */
+    vusb->active++;
+    len = usb_hcd_schedule(vusb->hcd, SURB_EPADDR_GET_ADDR(u->epaddr),
+                           SURB_EPADDR_GET_HUB_ADDR(u->epaddr),
+                           SURB_EPADDR_GET_HUB_PORT(u->epaddr),
+                           speed, &ep,
+                           xact, nxact, &vusb_complete_cb, t);
+    if (len < 0) {
+        vusb->active--;
+        surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
+        vusb_record_completion(vusb);
+    } else {
+        surb_epaddr_change_state(u, SURB_EPADDR_STATE_ACTIVE);
+    }
+}
+
+/* Schedule every slot in the pending bitmap, reporting any failures with a single IRQ */
+static void vusb_schedule_pending(vusb_device_t *vusb)
+{
+    for (int w = 0; w < NOTIFY_URB_WORDS; w++) {
+        while (vusb->pending[w]) {
+            int i = CTZ(vusb->pending[w]);
+            vusb->pending[w] &= ~BIT(i);
+            if (w * 32 + i < MAX_ACTIVE_URB) {
+                vusb_schedule_urb(vusb, w * 32 + i);
+            }
         }
-        t = &vusb->token[i];
-        t->vusb = vusb;
-        t->idx = i;
-        ep.num = SURB_EPADDR_EP(u->epaddr);
-        ep.max_pkt = u->max_pkt;
-        ep.interval = u->rate_ms;
-        len = usb_hcd_schedule(vusb->hcd, SURB_EPADDR_GET_ADDR(u->epaddr),
-                               SURB_EPADDR_GET_HUB_ADDR(u->epaddr),
-                               SURB_EPADDR_GET_HUB_PORT(u->epaddr),
-                               speed, &ep,
-                               xact, nxact, &vusb_complete_cb, t);
-        if (len < 0) {
-            surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
-            vusb_inject_irq(vusb);
-        } else {
-            surb_epaddr_change_state(u, SURB_EPADDR_STATE_ACTIVE);
+    }
+    vusb_check_completions(vusb);
+}
+
+void vm_vusb_notify(vusb_device_t *vusb)
+{
+    /* The guest didn't say which slots it filled, so find them */
+    for (int i = 0; i < MAX_ACTIVE_URB; i++) {
+        if (SURB_EPADDR_GET_STATE(vusb->data_regs->sel4urb[i].epaddr) == SURB_EPADDR_STATE_PENDING) {
+            vusb->pending[i / 32] |= BIT(i % 32);
         }
     }
+    vusb_schedule_pending(vusb);
+}
+
+void vm_vusb_set_coalescing(vusb_device_t *vusb, vusb_coalesce_cfg_t cfg)
+{
+    vusb->coalesce = cfg;
+    if (vusb->coalesce.max_completions < 1) {
+        vusb->coalesce.max_completions = 1;
+    }
+    vusb_check_completions(vusb);
+}
+
+void vm_vusb_flush_completions(vusb_device_t *vusb)
+{
+    vusb_check_completions(vusb);
 }
 
 vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase, int virq,
@@ -419,6 +506,8 @@ vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase, int v
     }
     vusb->vm = vm;
     vusb->hcd = hcd;
+    /* Report every completion as it happens until told otherwise */
+    vusb->coalesce.max_completions = 1;
 
     /* Setup the device */
     d->pstart = pbase;
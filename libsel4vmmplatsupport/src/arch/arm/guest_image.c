@@ -12,6 +12,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -24,9 +25,13 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_ram.h>
+#include <sel4vm/boot_timing.h>
 
 #include <sel4vmmplatsupport/guest_image.h>
 
+#include "guest_image_decompress.h"
+#include "guest_image_loader.h"
+
 #define UIMAGE_MAGIC 0x56190527
 #define ZIMAGE_MAGIC 0x016F2818
 #define DTB_MAGIC    0xedfe0dd0
@@ -140,20 +145,99 @@ static int get_guest_image_type(const char *image_name, enum img_type *image_typ
 
 static int guest_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
 {
-    memcpy(vaddr, cookie + offset, size);
+    if (cookie) {
+        memcpy(vaddr, cookie + offset, size);
+    } else {
+        memset(vaddr, 0, size);
+    }
     if (config_set(CONFIG_PLAT_TX1) || config_set(CONFIG_PLAT_TX2)) {
-        seL4_CPtr cap = vspace_get_cap(&vm->mem.vmm_vspace, vaddr);
-        if (cap == seL4_CapNull) {
-            /* Not sure how we would get here, something has gone pretty wrong */
-            ZF_LOGE("Failed to get vmm cap for vaddr: %p", vaddr);
-            return -1;
+        /* The window may span several pages, each of which needs cleaning */
+        uintptr_t page = ROUND_DOWN((uintptr_t)vaddr, PAGE_SIZE_4K);
+        uintptr_t end = (uintptr_t)vaddr + size;
+        for (; page < end; page += PAGE_SIZE_4K) {
+            seL4_CPtr cap = vspace_get_cap(&vm->mem.vmm_vspace, (void *)page);
+            if (cap == seL4_CapNull) {
+                /* Not sure how we would get here, something has gone pretty wrong */
+                ZF_LOGE("Failed to get vmm cap for vaddr: %p", (void *)page);
+                return -1;
+            }
+            int error = seL4_ARM_Page_CleanInvalidate_Data(cap, 0, PAGE_SIZE_4K);
+            ZF_LOGF_IFERR(error, "seL4_ARM_Page_CleanInvalidate_Data failed");
         }
-        int error = seL4_ARM_Page_CleanInvalidate_Data(cap, 0, PAGE_SIZE_4K);
-        ZF_LOGF_IFERR(error, "seL4_ARM_Page_CleanInvalidate_Data failed");
     }
     return 0;
 }
 
+typedef struct decompress_cookie {
+    vm_t *vm;
+    const char *image_name;
+    bool kernel;
+    uintptr_t load_base_addr;
+    uintptr_t load_addr;
+} decompress_cookie_t;
+
+static uintptr_t kernel_get_load_address(const char *image_name, enum img_type type, void *header,
+                                         uintptr_t load_base_addr)
+{
+    switch (type) {
+    case IMG_BIN:
+        if (config_set(CONFIG_PLAT_TX1) || config_set(CONFIG_PLAT_TX2) || config_set(CONFIG_PLAT_QEMU_ARM_VIRT)) {
+            /* This is likely an aarch64/aarch32 linux difference */
+            return load_base_addr + 0x80000;
+        }
+        return load_base_addr + 0x8000;
+    case IMG_ZIMAGE:
+        return zImage_get_load_address(header, load_base_addr);
+    default:
+        ZF_LOGE("Error: Unknown Linux image format for \'%s\'", image_name);
+        return 0;
+    }
+}
+
+static int decompressed_write(void *cookie, size_t offset, const void *data, size_t len)
+{
+    decompress_cookie_t *image = cookie;
+    if (offset == 0) {
+        /* The load address of a kernel depends on its (decompressed) header */
+        image->load_addr = image->load_base_addr;
+        if (image->kernel) {
+            Elf64_Ehdr header = {0};
+            memcpy(&header, data, MIN(len, sizeof(header)));
+            image->load_addr = kernel_get_load_address(image->image_name, image_get_type(&header), &header,
+                                                       image->load_base_addr);
+            if (!image->load_addr) {
+                return -1;
+            }
+        }
+    }
+    vm_ram_mark_allocated(image->vm, image->load_addr + offset, len);
+    return vm_ram_touch_batch(image->vm, image->load_addr + offset, len, guest_write_address, (void *)data);
+}
+
+/* Decompress an image straight into guest RAM, without staging the whole image in vmm memory */
+static uintptr_t load_compressed_image(vm_t *vm, const char *image_name, enum image_compression compression,
+                                       bool kernel, uintptr_t load_base_addr, size_t *resulting_image_size)
+{
+    decompress_cookie_t cookie = {
+        .vm = vm,
+        .image_name = image_name,
+        .kernel = kernel,
+        .load_base_addr = load_base_addr,
+    };
+    int fd = open(image_name, 0);
+    if (fd == -1) {
+        ZF_LOGE("Error: Unable to find image \'%s\'", image_name);
+        return 0;
+    }
+    int error = image_decompress(fd, compression, decompressed_write, &cookie, resulting_image_size);
+    close(fd);
+    if (error || !*resulting_image_size) {
+        ZF_LOGE("Error: Failed to decompress \'%s\'", image_name);
+        return 0;
+    }
+    return cookie.load_addr;
+}
+
 static int load_image(vm_t *vm, const char *image_name, uintptr_t load_addr,  size_t *resulting_image_size)
 {
     int fd;
@@ -186,9 +270,10 @@ static int load_image(vm_t *vm, const char *image_name, uintptr_t load_addr,  si
             break;
         }
         vm_ram_mark_allocated(vm, load_addr + offset, len);
-        error = vm_ram_touch(vm, load_addr + offset, len, guest_write_address, (void *)buf);
+        error = vm_ram_touch_batch(vm, load_addr + offset, len, guest_write_address, (void *)buf);
         if (error) {
             ZF_LOGE("Error: Failed to load \'%s\'", image_name);
+            free(buf);
             close(fd);
             return -1;
         }
@@ -211,21 +296,13 @@ static void *load_guest_kernel_image(vm_t *vm, const char *kernel_image_name, ui
     if (err) {
         return NULL;
     }
+    enum image_compression compression = image_get_compression(&header, sizeof(header));
+    if (compression != IMAGE_COMPRESSION_NONE) {
+        return (void *)load_compressed_image(vm, kernel_image_name, compression, true, load_base_addr, image_size);
+    }
     /* Determine the load address */
-    switch (ret_file_type) {
-    case IMG_BIN:
-        if (config_set(CONFIG_PLAT_TX1) || config_set(CONFIG_PLAT_TX2) || config_set(CONFIG_PLAT_QEMU_ARM_VIRT)) {
-            /* This is likely an aarch64/aarch32 linux difference */
-            load_addr = load_base_addr + 0x80000;
-        } else {
-            load_addr = load_base_addr + 0x8000;
-        }
-        break;
-    case IMG_ZIMAGE:
-        load_addr = zImage_get_load_address(&header, load_base_addr);
-        break;
-    default:
-        ZF_LOGE("Error: Unknown Linux image format for \'%s\'", kernel_image_name);
+    load_addr = kernel_get_load_address(kernel_image_name, ret_file_type, &header, load_base_addr);
+    if (!load_addr) {
         return NULL;
     }
     err = load_image(vm, kernel_image_name, load_addr, image_size);
@@ -245,10 +322,14 @@ static void *load_guest_module_image(vm_t *vm, const char *image_name, uintptr_t
     if (err) {
         return NULL;
     }
-    /* Determine the load address */
+    /* Compressed modules (e.g. a gzip initrd) are handed to the guest decompressed */
+    enum image_compression compression = image_get_compression(&header, sizeof(header));
+    if (compression != IMAGE_COMPRESSION_NONE) {
+        return (void *)load_compressed_image(vm, image_name, compression, false, load_base_addr, image_size);
+    }
+    /* Determine the load address. A gzip initrd was handled above */
     switch (ret_file_type) {
     case IMG_DTB:
-    case IMG_INITRD_GZ:
         load_addr = load_base_addr;
         break;
     default:
@@ -271,7 +352,9 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
         ZF_LOGE("Invalid guest_image_t object");
         return -1;
     }
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     load_addr = load_guest_kernel_image(vm, kernel_name, load_address, &kernel_len);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     if (!load_addr) {
         return -1;
     }
@@ -291,7 +374,9 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
         return -1;
     }
 
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     load_addr = load_guest_module_image(vm, module_name, load_address, &module_len);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     if (!load_addr) {
         return -1;
     }
@@ -300,3 +385,63 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
     guest_image->size = module_len;
     return 0;
 }
+
+int guest_image_arch_write(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    return guest_write_address(vm, paddr, vaddr, size, offset, cookie);
+}
+
+int guest_image_arch_plan(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                          int max_extents)
+{
+    enum img_type type;
+    Elf64_Ehdr header = {0};
+    uintptr_t load_addr;
+    if (get_guest_image_type(request->name, &type, &header)) {
+        return -1;
+    }
+    /* Compressed images are decompressed by the ordinary loaders */
+    if (image_get_compression(&header, sizeof(header)) != IMAGE_COMPRESSION_NONE) {
+        return 0;
+    }
+    if (request->is_kernel) {
+        load_addr = kernel_get_load_address(request->name, type, &header, request->load_address);
+        if (!load_addr) {
+            return -1;
+        }
+    } else if (type == IMG_DTB) {
+        load_addr = request->load_address;
+    } else {
+        /* Let the ordinary loader report the error */
+        return 0;
+    }
+
+    int fd = open(request->name, 0);
+    if (fd == -1) {
+        ZF_LOGE("Error: Unable to open image \'%s\'", request->name);
+        return -1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    if (size <= 0) {
+        ZF_LOGE("Error: Unable to size image \'%s\'", request->name);
+        return -1;
+    }
+
+    extents[0] = (guest_image_extent_t) {
+        .file_offset = 0,
+        .paddr = load_addr,
+        .file_size = size,
+        .mem_size = size,
+    };
+    return 1;
+}
+
+int guest_image_arch_finish(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                            int num_extents)
+{
+    guest_image_t *image = request->is_kernel ? &request->kernel_image->kernel_image : request->image;
+    image->load_paddr = extents[0].paddr;
+    image->size = extents[0].mem_size;
+    return 0;
+}
@@ -30,6 +30,35 @@ Author: W.A. */
 
 #define APIC_FLAGS_ENABLED (1)
 
+/* MCFG table, describing PCIe memory mapped configuration space */
+typedef struct mcfg_allocation {
+    uint64_t address;
+    uint16_t pci_segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} PACKED mcfg_allocation_t;
+
+typedef struct mcfg_table {
+    acpi_header_t header;
+    uint64_t reserved;
+    mcfg_allocation_t allocations[1];
+} PACKED mcfg_table_t;
+
+int acpi_add_pci_ecam(vm_t *vm, uintptr_t base, uint8_t start_bus, uint8_t end_bus)
+{
+    if (end_bus < start_bus) {
+        ZF_LOGE("Invalid ECAM bus range %d-%d", start_bus, end_bus);
+        return -1;
+    }
+    vm->arch.pci_ecam = (vm_pci_ecam_t) {
+        .base = base,
+        .start_bus = start_bus,
+        .num_buses = end_bus - start_bus + 1,
+    };
+    return 0;
+}
+
 uint8_t acpi_calc_checksum(const char *table, int length)
 {
     uint32_t sum = 0;
@@ -201,6 +230,29 @@ int make_guest_acpi_tables(vm_t *vm)
     table_sizes[num_tables] = madt_size;
     num_tables++;
 
+    // MCFG
+    vm_pci_ecam_t *ecam = &vm->arch.pci_ecam;
+    if (ecam->num_buses) {
+        mcfg_table_t *mcfg = calloc(1, sizeof(mcfg_table_t));
+        if (!mcfg) {
+            ZF_LOGE("Failed to allocate MCFG table");
+            return -1;
+        }
+        acpi_fill_table_head(&mcfg->header, "MCFG", 1);
+        mcfg->allocations[0] = (mcfg_allocation_t) {
+            .address = ecam->base,
+            .pci_segment = 0,
+            .start_bus = ecam->start_bus,
+            .end_bus = ecam->start_bus + ecam->num_buses - 1
+        };
+        mcfg->header.length = sizeof(mcfg_table_t);
+        mcfg->header.checksum = acpi_calc_checksum((char *)mcfg, sizeof(mcfg_table_t));
+
+        tables[num_tables] = mcfg;
+        table_sizes[num_tables] = sizeof(mcfg_table_t);
+        num_tables++;
+    }
+
     // Could set up other tables here...
 
     // XSDT
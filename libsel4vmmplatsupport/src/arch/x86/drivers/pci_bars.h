@@ -0,0 +1,33 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#include <pci/helper.h>
+
+/* A page aligned range of one memory bar that is trapped rather than mapped into the guest */
+typedef struct pci_bar_hole {
+    int bar;
+    size_t offset;
+    size_t size;
+    memory_fault_callback_fn fault_callback;
+    void *cookie;
+    /* Guest address of the start of the hole, set when the bar is mapped */
+    uintptr_t guest_addr;
+} pci_bar_hole_t;
+
+/* Map the bars of a device into the guest as 'vmm_pci_helper_map_bars' does, leaving out 'hole' if it is not NULL */
+int pci_map_bars_with_hole(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars, pci_bar_hole_t *hole);
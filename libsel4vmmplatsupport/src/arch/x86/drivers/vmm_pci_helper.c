@@ -10,17 +10,90 @@
  * @TAG(DATA61_BSD)
  */
 
+#include <stdlib.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory_helpers.h>
 #include <sel4vm/arch/ioports.h>
 #include <sel4vm/boot.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
+#include <sel4vmmplatsupport/arch/acpi.h>
 #include <sel4vmmplatsupport/arch/drivers/vmm_pci_helper.h>
 #include <sel4vmmplatsupport/drivers/pci.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
-int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars)
+#include "drivers/pci_bars.h"
+
+/* Reserve the next part of a memory bar, which has to follow the part before it */
+static vm_memory_reservation_t *reserve_bar_part(vm_t *vm, size_t size, memory_fault_callback_fn fault_callback,
+                                                 void *cookie, uintptr_t *addr, uintptr_t expected_addr)
+{
+    vm_memory_reservation_t *reservation = vm_reserve_anon_memory(vm, size, fault_callback, cookie, addr);
+    if (!reservation) {
+        return NULL;
+    }
+    if (expected_addr && *addr != expected_addr) {
+        ZF_LOGE("Parts of a PCI bar were not reserved contiguously");
+        vm_free_reserved_memory(vm, reservation);
+        return NULL;
+    }
+    return reservation;
+}
+
+static int map_mem_bar(vm_t *vm, uintptr_t paddr, size_t size, pci_bar_hole_t *hole, uintptr_t *addr)
+{
+    /* Split the bar around the hole, the parts before and after the hole are mapped and the hole is trapped */
+    size_t hole_offset = hole ? hole->offset : size;
+    size_t hole_size = hole ? hole->size : 0;
+    size_t part_offsets[] = {0, hole_offset, hole_offset + hole_size};
+    size_t part_sizes[] = {hole_offset, hole_size, size - hole_offset - hole_size};
+    vm_memory_reservation_t *reservations[ARRAY_SIZE(part_sizes)];
+    size_t num_reservations = 0;
+    uintptr_t base = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(part_sizes); i++) {
+        if (part_sizes[i] == 0) {
+            continue;
+        }
+        bool trapped = i == 1;
+        uintptr_t part_addr;
+        vm_memory_reservation_t *reservation = reserve_bar_part(vm, part_sizes[i],
+                                                                trapped ? hole->fault_callback : default_error_fault_callback,
+                                                                trapped ? hole->cookie : NULL, &part_addr,
+                                                                base ? base + part_offsets[i] : 0);
+        if (!reservation) {
+            ZF_LOGE("Failed to reserve PCI bar %p size %zu", (void *)paddr, size);
+            goto error;
+        }
+        reservations[num_reservations++] = reservation;
+        if (!base) {
+            base = part_addr - part_offsets[i];
+        }
+        if (trapped) {
+            hole->guest_addr = part_addr;
+            continue;
+        }
+        int err = map_ut_alloc_reservation_with_base_paddr(vm, paddr + part_offsets[i], reservation);
+        if (err) {
+            ZF_LOGE("Failed to map PCI bar %p size %zu", (void *)paddr, size);
+            goto error;
+        }
+    }
+    *addr = base;
+    return 0;
+
+error:
+    /* Anonymous reservations have to be released newest first */
+    while (num_reservations > 0) {
+        vm_free_reserved_memory(vm, reservations[--num_reservations]);
+    }
+    return -1;
+}
+
+int pci_map_bars_with_hole(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars, pci_bar_hole_t *hole)
 {
     int i;
     int bar = 0;
@@ -39,15 +112,8 @@ int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t
         if (cfg->base_addr_space[i] == PCI_BASE_ADDRESS_SPACE_MEMORY) {
             /* Need to map into the VMM. Make sure it is aligned */
             uintptr_t addr;
-            vm_memory_reservation_t *reservation = vm_reserve_anon_memory(vm, size, default_error_fault_callback, NULL,
-                    &addr);
-            if (!reservation) {
-                ZF_LOGE("Failed to reserve PCI bar %p size %zu", (void*)(uintptr_t)cfg->base_addr[i], size);
-                return -1;
-            }
-            int err = map_ut_alloc_reservation_with_base_paddr(vm, (uintptr_t)cfg->base_addr[i], reservation);
+            int err = map_mem_bar(vm, (uintptr_t)cfg->base_addr[i], size, hole && hole->bar == i ? hole : NULL, &addr);
             if (err) {
-                ZF_LOGE("Failed to map PCI bar %p size %zu", (void*)(uintptr_t)cfg->base_addr[i], size);
                 return -1;
             }
             bars[bar].address = addr;
@@ -70,6 +136,11 @@ int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t
     return bar;
 }
 
+int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars)
+{
+    return pci_map_bars_with_hole(vm, cfg, bars, NULL);
+}
+
 ioport_fault_result_t vmm_pci_io_port_in(vm_vcpu_t *vcpu, void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
 {
     vmm_pci_space_t *self = (vmm_pci_space_t *)cookie;
@@ -92,31 +163,10 @@ ioport_fault_result_t vmm_pci_io_port_in(vm_vcpu_t *vcpu, void *cookie, unsigned
     make_addr_reg_from_config(self->conf_port_addr, &addr, &reg);
     reg += offset;
 
-    /* Check if this device exists */
-    vmm_pci_entry_t *dev = find_device(self, addr);
-    if (!dev) {
-        /* if the guest strayed from bus 0 then somethign went wrong. otherwise random reads
-         * could just be it probing for devices */
-        if (addr.bus != 0) {
-            ZF_LOGI("Guest attempted access to non existent device %02x:%02x.%d register 0x%x", addr.bus, addr.dev, addr.fun, reg);
-        } else {
-            ZF_LOGI("Ignoring guest probe for device %02x:%02x.%d register 0x%x", addr.bus, addr.dev, addr.fun, reg);
-        }
-        *result = -1;
-        return IO_FAULT_HANDLED;
-    }
-    int error = dev->ioread(dev->cookie, reg, size, result);
+    int error = vmm_pci_config_read(self, addr, reg, size, result);
     if (error) {
         return IO_FAULT_ERROR;
     }
-    /* Strip out any multi function reporting */
-    if (reg + size > PCI_HEADER_TYPE && reg <= PCI_HEADER_TYPE) {
-        /* This read overlapped with the header type, work out where it is and mask
-         * the MF bit out */
-        int header_offset = PCI_HEADER_TYPE - reg;
-        unsigned int mf_mask = ~(BIT(7) << (header_offset * 8));
-        (*result) &= mf_mask;
-    }
     return IO_FAULT_HANDLED;
 }
 
@@ -143,15 +193,65 @@ ioport_fault_result_t vmm_pci_io_port_out(vm_vcpu_t *vcpu, void *cookie, unsigne
     make_addr_reg_from_config(self->conf_port_addr, &addr, &reg);
     reg += offset;
 
-    /* Check if this device exists */
-    vmm_pci_entry_t *dev = find_device(self, addr);
-    if (!dev) {
-        ZF_LOGI("Guest attempted access to non existent device %02x:%02x.%d register 0x%x", addr.bus, addr.dev, addr.fun, reg);
-        return IO_FAULT_HANDLED;
-    }
-    int err = dev->iowrite(dev->cookie, reg + offset, size, value);
+    int err = vmm_pci_config_write(self, addr, reg, size, value);
     if (err) {
         return IO_FAULT_ERROR;
     }
     return IO_FAULT_HANDLED;
 }
+
+typedef struct pci_ecam {
+    vmm_pci_space_t *space;
+    uintptr_t base;
+} pci_ecam_t;
+
+static memory_fault_result_t pci_ecam_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
+                                            void *cookie)
+{
+    pci_ecam_t *ecam = (pci_ecam_t *)cookie;
+    vmm_pci_address_t addr;
+    uint16_t reg;
+    make_addr_reg_from_ecam(fault_addr - ecam->base, &addr, &reg);
+
+    /* Config accesses must be naturally aligned and at most a dword, anything else
+     * is unsupported: reads return all ones and writes are dropped */
+    bool valid = fault_length <= sizeof(uint32_t) && reg % fault_length == 0;
+    if (is_vcpu_read_fault(vcpu)) {
+        uint32_t result = -1;
+        if (valid && vmm_pci_config_read(ecam->space, addr, reg, fault_length, &result)) {
+            ZF_LOGE("Failure performing read from PCI ECAM window");
+        }
+        set_vcpu_fault_data(vcpu, result & MASK(MIN(fault_length, sizeof(uint32_t)) * 8));
+    } else if (valid) {
+        uint32_t value = get_vcpu_fault_data(vcpu) & MASK(fault_length * 8);
+        if (vmm_pci_config_write(ecam->space, addr, reg, fault_length, value)) {
+            ZF_LOGE("Failure performing write to PCI ECAM window");
+        }
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int vmm_pci_ecam_init(vm_t *vm, vmm_pci_space_t *space, uintptr_t base)
+{
+    if (base & MASK(VMM_PCI_ECAM_BUS_BITS)) {
+        ZF_LOGE("PCI ECAM window %p is not aligned to a bus", (void *)base);
+        return -1;
+    }
+    pci_ecam_t *ecam = calloc(1, sizeof(*ecam));
+    if (!ecam) {
+        ZF_LOGE("Failed to allocate PCI ECAM window");
+        return -1;
+    }
+    ecam->space = space;
+    ecam->base = base;
+
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, base, VMM_PCI_ECAM_SIZE, pci_ecam_fault,
+                                                                (void *)ecam);
+    if (!reservation) {
+        ZF_LOGE("Failed to reserve PCI ECAM window at %p", (void *)base);
+        free(ecam);
+        return -1;
+    }
+    return acpi_add_pci_ecam(vm, base, 0, VMM_PCI_MAX_BUSES - 1);
+}
@@ -0,0 +1,646 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* MSI and MSI-X emulation for passthrough devices. The guest programs messages into an emulated copy of the
+ * MSI capability and MSI-X table, which only changes where a host vector is delivered. The device is programmed
+ * once per vector with the host message from 'map_vector' and is never masked by the guest, masking is done here
+ * by holding the interrupt pending. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <platsupport/io.h>
+#include <pci/pci.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/arch/msi.h>
+
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+#include <sel4vmmplatsupport/arch/drivers/vmm_pci_helper.h>
+#include <sel4vmmplatsupport/arch/drivers/vmm_pci_msi.h>
+
+#include "drivers/pci_bars.h"
+
+/* MSI capability registers */
+#define MSI_CONTROL                 2
+#define MSI_ADDRESS_LO              4
+#define MSI_CONTROL_ENABLE          BIT(0)
+#define MSI_CONTROL_MULTI_CAPABLE   (MASK(3) << 1)
+#define MSI_CONTROL_MULTI_ENABLE    (MASK(3) << 4)
+#define MSI_CONTROL_64BIT           BIT(7)
+#define MSI_CONTROL_MASKABLE        BIT(8)
+#define MSI_MAX_LEN                 24
+
+/* MSI-X capability registers */
+#define MSIX_CONTROL                2
+#define MSIX_TABLE                  4
+#define MSIX_PBA                    8
+#define MSIX_CONTROL_SIZE_MASK      MASK(11)
+#define MSIX_CONTROL_MASK_ALL       BIT(14)
+#define MSIX_CONTROL_ENABLE         BIT(15)
+#define MSIX_BIR_MASK               MASK(3)
+
+/* MSI-X table entries */
+#define MSIX_ENTRY_SIZE             16
+#define MSIX_ENTRY_ADDRESS_LO       0
+#define MSIX_ENTRY_ADDRESS_HI       4
+#define MSIX_ENTRY_DATA             8
+#define MSIX_ENTRY_CONTROL          12
+#define MSIX_ENTRY_MASKED           BIT(0)
+
+typedef struct msix_entry {
+    uint32_t address_lo;
+    uint32_t address_hi;
+    uint32_t data;
+    uint32_t control;
+    bool pending;
+} msix_entry_t;
+
+typedef struct host_vector {
+    bool mapped;
+    uint64_t address;
+    uint32_t data;
+} host_vector_t;
+
+struct vmm_pci_msi {
+    vm_vcpu_t *vcpu;
+    vmm_pci_entry_t config;
+    vmm_pci_msi_ops_t ops;
+
+    /* MSI capability, with the guest's view of the registers after the header */
+    uint8_t msi_cap;
+    int msi_len;
+    int msi_data_offset;
+    int msi_mask_offset;
+    uint16_t msi_host_control;
+    uint8_t msi_regs[MSI_MAX_LEN];
+    uint8_t msi_write_mask[MSI_MAX_LEN];
+    bool msi_pending;
+
+    /* MSI-X capability and the guest's view of the table */
+    uint8_t msix_cap;
+    uint16_t msix_host_control;
+    uint16_t msix_control;
+    int msix_size;
+    /* Size of the device's table, which can be larger than the emulated part */
+    size_t table_len;
+    int table_bar;
+    uint32_t table_offset;
+    int pba_bar;
+    uint32_t pba_offset;
+    msix_entry_t table[VMM_PCI_MSIX_MAX_VECTORS];
+    /* The pages holding the table, trapped in the guest and mapped in the VMM */
+    pci_bar_hole_t hole;
+    volatile uint32_t *host_pages;
+
+    host_vector_t host[VMM_PCI_MSIX_MAX_VECTORS];
+};
+
+/* Wrapper over a pci entry, emulating its MSI capabilities */
+typedef struct pci_msi_emulation {
+    vmm_pci_entry_t passthrough;
+    vmm_pci_msi_t *msi;
+} pci_msi_emulation_t;
+
+static int config_read(vmm_pci_msi_t *msi, int offset, int size, uint32_t *value)
+{
+    *value = 0;
+    int err = msi->config.ioread(msi->config.cookie, offset, size, value);
+    if (err) {
+        ZF_LOGE("Failed to read host config space at 0x%x", offset);
+        return -1;
+    }
+    return 0;
+}
+
+static int config_write(vmm_pci_msi_t *msi, int offset, int size, uint32_t value)
+{
+    int err = msi->config.iowrite(msi->config.cookie, offset, size, value);
+    if (err) {
+        ZF_LOGE("Failed to write host config space at 0x%x", offset);
+        return -1;
+    }
+    return 0;
+}
+
+static int map_host_vector(vmm_pci_msi_t *msi, int vector)
+{
+    host_vector_t *host = &msi->host[vector];
+    if (host->mapped) {
+        return 0;
+    }
+    int err = msi->ops.map_vector(msi->ops.cookie, vector, &host->address, &host->data);
+    if (err) {
+        ZF_LOGE("Failed to map host MSI for vector %d", vector);
+        return -1;
+    }
+    host->mapped = true;
+    return 0;
+}
+
+static int msi_init_cap(vmm_pci_msi_t *msi, uint8_t cap)
+{
+    uint32_t control;
+    if (config_read(msi, cap + MSI_CONTROL, 2, &control)) {
+        return -1;
+    }
+    bool is_64bit = control & MSI_CONTROL_64BIT;
+
+    msi->msi_cap = cap;
+    msi->msi_host_control = control;
+    msi->msi_data_offset = is_64bit ? 12 : 8;
+    msi->msi_mask_offset = (control & MSI_CONTROL_MASKABLE) ? msi->msi_data_offset + 4 : 0;
+    /* The pending bits follow the mask bits */
+    msi->msi_len = msi->msi_mask_offset ? msi->msi_mask_offset + 8 : msi->msi_data_offset + 4;
+
+    /* Only a single message is offered to the guest, every vector of a multi message device is one host vector */
+    uint16_t guest_control = control & ~(MSI_CONTROL_ENABLE | MSI_CONTROL_MULTI_CAPABLE | MSI_CONTROL_MULTI_ENABLE);
+    memcpy(&msi->msi_regs[MSI_CONTROL], &guest_control, sizeof(guest_control));
+    msi->msi_write_mask[MSI_CONTROL] = MSI_CONTROL_ENABLE;
+    memset(&msi->msi_write_mask[MSI_ADDRESS_LO], 0xff, 4);
+    msi->msi_write_mask[MSI_ADDRESS_LO] = 0xfc;
+    if (is_64bit) {
+        memset(&msi->msi_write_mask[MSI_ADDRESS_LO + 4], 0xff, 4);
+    }
+    memset(&msi->msi_write_mask[msi->msi_data_offset], 0xff, 2);
+    if (msi->msi_mask_offset) {
+        msi->msi_write_mask[msi->msi_mask_offset] = BIT(0);
+    }
+    return 0;
+}
+
+static int msix_init_cap(vmm_pci_msi_t *msi, uint8_t cap)
+{
+    uint32_t control, table, pba;
+    if (config_read(msi, cap + MSIX_CONTROL, 2, &control) || config_read(msi, cap + MSIX_TABLE, 4, &table) ||
+        config_read(msi, cap + MSIX_PBA, 4, &pba)) {
+        return -1;
+    }
+
+    msi->msix_cap = cap;
+    msi->msix_host_control = control & ~(MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK_ALL);
+    msi->msix_control = msi->msix_host_control;
+    msi->msix_size = (control & MSIX_CONTROL_SIZE_MASK) + 1;
+    msi->table_len = msi->msix_size * MSIX_ENTRY_SIZE;
+    if (msi->msix_size > VMM_PCI_MSIX_MAX_VECTORS) {
+        ZF_LOGW("Only emulating %d of %d MSI-X vectors", VMM_PCI_MSIX_MAX_VECTORS, msi->msix_size);
+        msi->msix_size = VMM_PCI_MSIX_MAX_VECTORS;
+    }
+    msi->table_bar = table & MSIX_BIR_MASK;
+    msi->table_offset = table & ~MSIX_BIR_MASK;
+    msi->pba_bar = pba & MSIX_BIR_MASK;
+    msi->pba_offset = pba & ~MSIX_BIR_MASK;
+    for (int i = 0; i < VMM_PCI_MSIX_MAX_VECTORS; i++) {
+        msi->table[i].control = MSIX_ENTRY_MASKED;
+    }
+    return 0;
+}
+
+vmm_pci_msi_t *vmm_pci_msi_init(vm_vcpu_t *vcpu, vmm_pci_entry_t config, vmm_pci_msi_ops_t ops)
+{
+    if (!vcpu || !ops.map_vector) {
+        ZF_LOGE("Invalid arguments");
+        return NULL;
+    }
+    vmm_pci_msi_t *msi = calloc(1, sizeof(*msi));
+    if (!msi) {
+        ZF_LOGE("Failed to allocate MSI state");
+        return NULL;
+    }
+    msi->vcpu = vcpu;
+    msi->config = config;
+    msi->ops = ops;
+
+    uint32_t value;
+    if (config_read(msi, PCI_STATUS, 2, &value)) {
+        goto error;
+    }
+    if (!(value & PCI_STATUS_CAP_LIST)) {
+        return msi;
+    }
+    if (config_read(msi, PCI_CAPABILITY_LIST, 1, &value)) {
+        goto error;
+    }
+    /* Mask off the bottom 2 bits, which are reserved */
+    uint8_t cap = value & ~MASK(2);
+    while (cap != 0) {
+        if (config_read(msi, cap, 1, &value)) {
+            goto error;
+        }
+        int err = 0;
+        if (value == PCI_CAP_ID_MSI) {
+            err = msi_init_cap(msi, cap);
+        } else if (value == PCI_CAP_ID_MSIX) {
+            err = msix_init_cap(msi, cap);
+        }
+        if (err || config_read(msi, cap + 1, 1, &value)) {
+            goto error;
+        }
+        cap = value & ~MASK(2);
+    }
+    return msi;
+
+error:
+    ZF_LOGE("Failed to parse MSI capabilities");
+    free(msi);
+    return NULL;
+}
+
+/* Deliver a vector to the guest, using the message the guest programmed for it */
+static int msi_deliver(vmm_pci_msi_t *msi, uint64_t address, uint32_t data)
+{
+    int err = vm_inject_msi(msi->vcpu, address, data);
+    if (err) {
+        ZF_LOGW("Guest did not accept MSI 0x%x", data);
+    }
+    return err;
+}
+
+static uint64_t msi_guest_address(vmm_pci_msi_t *msi)
+{
+    uint64_t address = 0;
+    memcpy(&address, &msi->msi_regs[MSI_ADDRESS_LO], msi->msi_data_offset - MSI_ADDRESS_LO);
+    return address;
+}
+
+static uint32_t msi_guest_data(vmm_pci_msi_t *msi)
+{
+    uint16_t data;
+    memcpy(&data, &msi->msi_regs[msi->msi_data_offset], sizeof(data));
+    return data;
+}
+
+static bool msi_guest_masked(vmm_pci_msi_t *msi)
+{
+    return msi->msi_mask_offset && (msi->msi_regs[msi->msi_mask_offset] & BIT(0));
+}
+
+static bool msi_guest_enabled(vmm_pci_msi_t *msi)
+{
+    return msi->msi_regs[MSI_CONTROL] & MSI_CONTROL_ENABLE;
+}
+
+static int msi_update(vmm_pci_msi_t *msi, bool was_enabled, bool was_masked)
+{
+    bool enabled = msi_guest_enabled(msi);
+    uint8_t cap = msi->msi_cap;
+    uint16_t host_control = msi->msi_host_control & ~(MSI_CONTROL_ENABLE | MSI_CONTROL_MULTI_ENABLE);
+
+    if (enabled && !was_enabled) {
+        if (map_host_vector(msi, 0)) {
+            msi->msi_regs[MSI_CONTROL] &= ~MSI_CONTROL_ENABLE;
+            return -1;
+        }
+        host_vector_t *host = &msi->host[0];
+        int err = config_write(msi, cap + MSI_ADDRESS_LO, 4, host->address);
+        if (!err && msi->msi_data_offset > 8) {
+            err = config_write(msi, cap + MSI_ADDRESS_LO + 4, 4, host->address >> 32);
+        }
+        if (!err) {
+            err = config_write(msi, cap + msi->msi_data_offset, 2, host->data);
+        }
+        if (!err && msi->msi_mask_offset) {
+            err = config_write(msi, cap + msi->msi_mask_offset, 4, 0);
+        }
+        if (!err) {
+            err = config_write(msi, cap + MSI_CONTROL, 2, host_control | MSI_CONTROL_ENABLE);
+        }
+        if (err) {
+            msi->msi_regs[MSI_CONTROL] &= ~MSI_CONTROL_ENABLE;
+            return -1;
+        }
+    } else if (!enabled && was_enabled) {
+        if (config_write(msi, cap + MSI_CONTROL, 2, host_control)) {
+            return -1;
+        }
+    }
+
+    if (enabled && was_masked && !msi_guest_masked(msi) && msi->msi_pending) {
+        msi->msi_pending = false;
+        return msi_deliver(msi, msi_guest_address(msi), msi_guest_data(msi));
+    }
+    return 0;
+}
+
+static bool msix_effectively_masked(vmm_pci_msi_t *msi, int vector)
+{
+    return !(msi->msix_control & MSIX_CONTROL_ENABLE) || (msi->msix_control & MSIX_CONTROL_MASK_ALL) ||
+           (msi->table[vector].control & MSIX_ENTRY_MASKED);
+}
+
+static int msix_deliver(vmm_pci_msi_t *msi, int vector)
+{
+    msix_entry_t *entry = &msi->table[vector];
+    return msi_deliver(msi, (uint64_t)entry->address_hi << 32 | entry->address_lo, entry->data);
+}
+
+/* Program and unmask the device's table entry for a vector the guest has unmasked */
+static int msix_program_vector(vmm_pci_msi_t *msi, int vector)
+{
+    bool was_mapped = msi->host[vector].mapped;
+    if (!msi->host_pages) {
+        return -1;
+    }
+    if (map_host_vector(msi, vector)) {
+        return -1;
+    }
+    if (!was_mapped) {
+        volatile uint32_t *entry = msi->host_pages + (msi->table_offset - msi->hole.offset + vector * MSIX_ENTRY_SIZE) /
+                                   sizeof(uint32_t);
+        entry[MSIX_ENTRY_ADDRESS_LO / sizeof(uint32_t)] = msi->host[vector].address;
+        entry[MSIX_ENTRY_ADDRESS_HI / sizeof(uint32_t)] = msi->host[vector].address >> 32;
+        entry[MSIX_ENTRY_DATA / sizeof(uint32_t)] = msi->host[vector].data;
+        entry[MSIX_ENTRY_CONTROL / sizeof(uint32_t)] = 0;
+    }
+    return 0;
+}
+
+/* Called after the guest changes the masking of a vector. Vectors are only connected to the host once the guest
+ * unmasks them, and interrupts raised while masked are delivered on unmask */
+static int msix_vector_update(vmm_pci_msi_t *msi, int vector, bool was_masked)
+{
+    if (msix_effectively_masked(msi, vector) || !was_masked) {
+        return 0;
+    }
+    if (msix_program_vector(msi, vector)) {
+        return -1;
+    }
+    if (msi->table[vector].pending) {
+        msi->table[vector].pending = false;
+        return msix_deliver(msi, vector);
+    }
+    return 0;
+}
+
+static int msix_control_update(vmm_pci_msi_t *msi, uint16_t old_control)
+{
+    uint8_t cap = msi->msix_cap;
+    bool enabled = msi->msix_control & MSIX_CONTROL_ENABLE;
+
+    int err = 0;
+    if (enabled != !!(old_control & MSIX_CONTROL_ENABLE)) {
+        err = config_write(msi, cap + MSIX_CONTROL, 2, msi->msix_host_control | (enabled ? MSIX_CONTROL_ENABLE : 0));
+    }
+    for (int i = 0; i < msi->msix_size; i++) {
+        bool was_masked = !(old_control & MSIX_CONTROL_ENABLE) || (old_control & MSIX_CONTROL_MASK_ALL) ||
+                          (msi->table[i].control & MSIX_ENTRY_MASKED);
+        err |= msix_vector_update(msi, i, was_masked);
+    }
+    return err ? -1 : 0;
+}
+
+/* Find the emulated register holding a config space byte, if any */
+static uint8_t *msi_config_byte(vmm_pci_msi_t *msi, int offset, uint8_t *write_mask)
+{
+    if (msi->msi_cap && offset >= msi->msi_cap + MSI_CONTROL && offset < msi->msi_cap + msi->msi_len) {
+        *write_mask = msi->msi_write_mask[offset - msi->msi_cap];
+        return &msi->msi_regs[offset - msi->msi_cap];
+    }
+    if (msi->msix_cap && offset >= msi->msix_cap + MSIX_CONTROL && offset < msi->msix_cap + MSIX_TABLE) {
+        int byte = offset - msi->msix_cap - MSIX_CONTROL;
+        *write_mask = byte ? (MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK_ALL) >> 8 : 0;
+        return (uint8_t *)&msi->msix_control + byte;
+    }
+    return NULL;
+}
+
+static int pci_msi_emul_read(void *cookie, int offset, int size, uint32_t *result)
+{
+    pci_msi_emulation_t *emul = (pci_msi_emulation_t *)cookie;
+    vmm_pci_msi_t *msi = emul->msi;
+    int err = emul->passthrough.ioread(emul->passthrough.cookie, offset, size, result);
+    if (err) {
+        return err;
+    }
+    for (int i = 0; i < size; i++) {
+        uint8_t write_mask;
+        uint8_t *byte = msi_config_byte(msi, offset + i, &write_mask);
+        if (byte) {
+            *result &= ~(MASK(8) << (i * 8));
+            *result |= *byte << (i * 8);
+        }
+    }
+    /* The pending bit of a single message MSI */
+    if (msi->msi_mask_offset) {
+        int pending = msi->msi_cap + msi->msi_mask_offset + 4;
+        if (offset <= pending && offset + size > pending && msi->msi_pending) {
+            *result |= BIT((pending - offset) * 8);
+        }
+    }
+    return 0;
+}
+
+static int pci_msi_emul_write(void *cookie, int offset, int size, uint32_t value)
+{
+    pci_msi_emulation_t *emul = (pci_msi_emulation_t *)cookie;
+    vmm_pci_msi_t *msi = emul->msi;
+    bool msi_was_enabled = msi->msi_cap && msi_guest_enabled(msi);
+    bool msi_was_masked = msi->msi_cap && msi_guest_masked(msi);
+    uint16_t old_msix_control = msi->msix_control;
+    bool emulated = false;
+
+    for (int i = 0; i < size; i++) {
+        uint8_t write_mask;
+        uint8_t *byte = msi_config_byte(msi, offset + i, &write_mask);
+        if (byte) {
+            uint8_t new_byte = value >> (i * 8);
+            *byte = (*byte & ~write_mask) | (new_byte & write_mask);
+            emulated = true;
+        }
+    }
+    if (!emulated) {
+        return emul->passthrough.iowrite(emul->passthrough.cookie, offset, size, value);
+    }
+
+    int err = 0;
+    if (msi->msi_cap) {
+        err |= msi_update(msi, msi_was_enabled, msi_was_masked);
+    }
+    if (msi->msix_cap && msi->msix_control != old_msix_control) {
+        err |= msix_control_update(msi, old_msix_control);
+    }
+    /* Failing to reach the host only loses interrupts, the guest's write itself succeeded */
+    if (err) {
+        ZF_LOGE("Failed to update host MSI configuration");
+    }
+    return 0;
+}
+
+vmm_pci_entry_t vmm_pci_create_msi_emulation(vmm_pci_entry_t existing, vmm_pci_msi_t *msi)
+{
+    if (msi->msix_cap && !msi->host_pages) {
+        ZF_LOGW("MSI-X table is not trapped, use vmm_pci_helper_map_bars_msi for the bars of this device");
+    }
+    pci_msi_emulation_t *emul = calloc(1, sizeof(*emul));
+    assert(emul);
+    emul->passthrough = existing;
+    emul->msi = msi;
+    return (vmm_pci_entry_t) {
+        .cookie = emul, .ioread = pci_msi_emul_read, .iowrite = pci_msi_emul_write
+    };
+}
+
+static bool msix_pba_trapped(vmm_pci_msi_t *msi, size_t offset)
+{
+    size_t pba_len = ROUND_UP(msi->table_len / MSIX_ENTRY_SIZE, 64) / 8;
+    return msi->pba_bar == msi->table_bar && offset >= msi->pba_offset && offset < msi->pba_offset + pba_len;
+}
+
+/* Read a dword of the trapped pages of the table bar */
+static uint32_t msix_read(vmm_pci_msi_t *msi, size_t offset)
+{
+    if (offset >= msi->table_offset && offset < msi->table_offset + msi->table_len) {
+        int vector = (offset - msi->table_offset) / MSIX_ENTRY_SIZE;
+        int reg = (offset - msi->table_offset) % MSIX_ENTRY_SIZE;
+        if (vector >= msi->msix_size) {
+            return reg == MSIX_ENTRY_CONTROL ? MSIX_ENTRY_MASKED : 0;
+        }
+        msix_entry_t *entry = &msi->table[vector];
+        switch (reg) {
+        case MSIX_ENTRY_ADDRESS_LO:
+            return entry->address_lo;
+        case MSIX_ENTRY_ADDRESS_HI:
+            return entry->address_hi;
+        case MSIX_ENTRY_DATA:
+            return entry->data;
+        default:
+            return entry->control;
+        }
+    }
+    if (msix_pba_trapped(msi, offset)) {
+        /* Interrupts held back by the guest's masking are only pending here, not in the device */
+        int first = (offset - msi->pba_offset) * 8;
+        uint32_t pending = 0;
+        for (int i = 0; i < 32 && first + i < msi->msix_size; i++) {
+            pending |= (uint32_t)msi->table[first + i].pending << i;
+        }
+        return pending;
+    }
+    return msi->host_pages[(offset - msi->hole.offset) / sizeof(uint32_t)];
+}
+
+static void msix_write(vmm_pci_msi_t *msi, size_t offset, uint32_t value)
+{
+    if (offset >= msi->table_offset && offset < msi->table_offset + msi->table_len) {
+        int vector = (offset - msi->table_offset) / MSIX_ENTRY_SIZE;
+        int reg = (offset - msi->table_offset) % MSIX_ENTRY_SIZE;
+        if (vector >= msi->msix_size) {
+            return;
+        }
+        /* A new message only changes where the host vector is delivered, the device is left alone */
+        msix_entry_t *entry = &msi->table[vector];
+        switch (reg) {
+        case MSIX_ENTRY_ADDRESS_LO:
+            entry->address_lo = value & ~MASK(2);
+            break;
+        case MSIX_ENTRY_ADDRESS_HI:
+            entry->address_hi = value;
+            break;
+        case MSIX_ENTRY_DATA:
+            entry->data = value;
+            break;
+        default: {
+            bool was_masked = msix_effectively_masked(msi, vector);
+            entry->control = value & MSIX_ENTRY_MASKED;
+            if (msix_vector_update(msi, vector, was_masked)) {
+                ZF_LOGE("Failed to update host MSI-X vector %d", vector);
+            }
+            break;
+        }
+        }
+        return;
+    }
+    if (msix_pba_trapped(msi, offset)) {
+        return;
+    }
+    msi->host_pages[(offset - msi->hole.offset) / sizeof(uint32_t)] = value;
+}
+
+static memory_fault_result_t msix_table_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
+                                              void *cookie)
+{
+    vmm_pci_msi_t *msi = (vmm_pci_msi_t *)cookie;
+    size_t offset = ROUND_DOWN(fault_addr - msi->hole.guest_addr + msi->hole.offset, sizeof(uint32_t));
+    /* Quadword accesses are split into their two dwords */
+    int dwords = fault_length > sizeof(uint32_t) ? 2 : 1;
+
+    if (is_vcpu_read_fault(vcpu)) {
+        uint64_t data = 0;
+        for (int i = 0; i < dwords; i++) {
+            data |= (uint64_t)msix_read(msi, offset + i * sizeof(uint32_t)) << (i * 32);
+        }
+        set_vcpu_fault_data(vcpu, data);
+    } else {
+        uint64_t data = get_vcpu_fault_data(vcpu);
+        for (int i = 0; i < dwords; i++) {
+            msix_write(msi, offset + i * sizeof(uint32_t), data >> (i * 32));
+        }
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int vmm_pci_helper_map_bars_msi(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars, vmm_pci_msi_t *msi)
+{
+    if (!msi->msix_cap) {
+        return vmm_pci_helper_map_bars(vm, cfg, bars);
+    }
+
+    int bar = msi->table_bar;
+    if (bar >= 6 || cfg->base_addr[bar] == 0 || cfg->base_addr_space[bar] != PCI_BASE_ADDRESS_SPACE_MEMORY ||
+        msi->table_offset + msi->table_len > cfg->base_addr_size[bar]) {
+        ZF_LOGE("MSI-X table is not within a memory bar");
+        return -1;
+    }
+
+    /* Trap the whole pages holding the table, anything else in them is forwarded to the device */
+    msi->hole.bar = bar;
+    msi->hole.offset = ROUND_DOWN(msi->table_offset, PAGE_SIZE_4K);
+    msi->hole.size = MIN(ROUND_UP(msi->table_offset + msi->table_len, PAGE_SIZE_4K), cfg->base_addr_size[bar]) -
+                     msi->hole.offset;
+    msi->hole.fault_callback = msix_table_fault;
+    msi->hole.cookie = msi;
+    msi->host_pages = ps_io_map(&vm->io_ops->io_mapper, cfg->base_addr[bar] + msi->hole.offset, msi->hole.size, false,
+                                PS_MEM_NORMAL);
+    if (!msi->host_pages) {
+        ZF_LOGE("Failed to map MSI-X table into the VMM");
+        return -1;
+    }
+    return pci_map_bars_with_hole(vm, cfg, bars, &msi->hole);
+}
+
+int vmm_pci_msi_inject(vmm_pci_msi_t *msi, int vector)
+{
+    if (msi->msix_cap && (msi->msix_control & MSIX_CONTROL_ENABLE)) {
+        if (vector < 0 || vector >= msi->msix_size) {
+            ZF_LOGE("Invalid MSI-X vector %d", vector);
+            return -1;
+        }
+        if (msix_effectively_masked(msi, vector)) {
+            msi->table[vector].pending = true;
+            return 0;
+        }
+        return msix_deliver(msi, vector);
+    }
+    if (msi->msi_cap && msi_guest_enabled(msi) && vector == 0) {
+        if (msi_guest_masked(msi)) {
+            msi->msi_pending = true;
+            return 0;
+        }
+        return msi_deliver(msi, msi_guest_address(msi), msi_guest_data(msi));
+    }
+    ZF_LOGW("Dropping MSI for vector %d that the guest has not enabled", vector);
+    return -1;
+}
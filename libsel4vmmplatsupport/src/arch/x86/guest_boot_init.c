@@ -29,6 +29,7 @@
 #include <sel4vm/guest_memory_helpers.h>
 #include <sel4vm/arch/vmcs_fields.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/boot_timing.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/arch/guest_boot_init.h>
@@ -243,10 +244,9 @@ static int make_guest_boot_info(vm_t *vm, uintptr_t guest_cmd_addr, size_t guest
     return 0;
 }
 
-/* Init the guest page directory, cmd line args and boot info structures. */
-int vmm_plat_init_guest_boot_structure(vm_t *vm, const char *cmdline,
-                                       guest_kernel_image_t guest_kernel_image, guest_image_t guest_ramdisk_image,
-                                       uintptr_t *guest_boot_info_addr)
+static int init_guest_boot_structure(vm_t *vm, const char *cmdline,
+                                     guest_kernel_image_t guest_kernel_image, guest_image_t guest_ramdisk_image,
+                                     uintptr_t *guest_boot_info_addr)
 {
     int UNUSED err;
     uintptr_t guest_cmd_addr;
@@ -267,6 +267,17 @@ int vmm_plat_init_guest_boot_structure(vm_t *vm, const char *cmdline,
     return err;
 }
 
+/* Init the guest page directory, cmd line args and boot info structures. */
+int vmm_plat_init_guest_boot_structure(vm_t *vm, const char *cmdline,
+                                       guest_kernel_image_t guest_kernel_image, guest_image_t guest_ramdisk_image,
+                                       uintptr_t *guest_boot_info_addr)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_BOOT_INFO);
+    int err = init_guest_boot_structure(vm, cmdline, guest_kernel_image, guest_ramdisk_image, guest_boot_info_addr);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_BOOT_INFO);
+    return err;
+}
+
 int vmm_plat_init_guest_thread_state(vm_vcpu_t *vcpu, uintptr_t guest_entry_addr,
                                      uintptr_t guest_boot_info_addr)
 {
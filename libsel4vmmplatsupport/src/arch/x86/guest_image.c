@@ -24,6 +24,9 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_ram.h>
+#include <sel4vm/boot_timing.h>
+
+#include "guest_image_loader.h"
 
 typedef struct boot_guest_cookie {
     vm_t *vm;
@@ -60,6 +63,53 @@ static int guest_elf_read_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t
     return 0;
 }
 
+typedef struct guest_relocs_cookie {
+    /* guest physical addresses to relocate, sorted */
+    uintptr_t *relocs;
+    size_t num_relocs;
+    size_t next;
+    int delta;
+    /* relocations that straddle two touch windows, applied afterwards */
+    uintptr_t *deferred;
+    size_t num_deferred;
+    size_t max_deferred;
+} guest_relocs_cookie_t;
+
+static int uintptr_cmp(const void *a, const void *b)
+{
+    uintptr_t aa = *(const uintptr_t *)a;
+    uintptr_t bb = *(const uintptr_t *)b;
+    return (aa > bb) - (aa < bb);
+}
+
+static int guest_elf_relocate_continued(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset,
+                                        void *cookie)
+{
+    guest_relocs_cookie_t *pass = cookie;
+
+    /* Apply every relocation that lies within this window */
+    for (; pass->next < pass->num_relocs; pass->next++) {
+        uintptr_t reloc = pass->relocs[pass->next];
+        if (reloc >= paddr + size) {
+            break;
+        }
+        if (reloc < paddr || reloc + sizeof(uint32_t) > paddr + size) {
+            if (pass->num_deferred == pass->max_deferred) {
+                ZF_LOGE("Too many relocations straddle touch windows");
+                return -1;
+            }
+            pass->deferred[pass->num_deferred++] = reloc;
+            continue;
+        }
+        uint32_t addr;
+        void *target = vaddr + (reloc - paddr);
+        memcpy(&addr, target, sizeof(addr));
+        addr += pass->delta;
+        memcpy(target, &addr, sizeof(addr));
+    }
+    return 0;
+}
+
 int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image_t *image)
 {
     int delta = image->kernel_image_arch.relocation_offset;
@@ -87,6 +137,19 @@ int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image
     relocs_size = ftell(file);
     fseek(file, 0, SEEK_SET);
 
+    /* Read the whole table in one go */
+    size_t num_entries = relocs_size / sizeof(uint32_t);
+    uint32_t *entries = malloc(num_entries * sizeof(uint32_t));
+    uintptr_t *relocs = malloc(num_entries * sizeof(uintptr_t));
+    if (!entries || !relocs || fread(entries, sizeof(uint32_t), num_entries, file) != num_entries) {
+        ZF_LOGE("Failed to read relocs file %s", relocs_filename);
+        free(entries);
+        free(relocs);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
     /* The relocs file is the same relocs file format used by the Linux kernel decompressor to
      * relocate the Linux kernel:
      *
@@ -96,134 +159,116 @@ int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image
      *     32 bit relocation repeated
      *     <EOF>
      *
-     * So we work backwards from the end of the file, and modify the guest kernel OS binary.
-     * We only support 32-bit relocations, and ignore the 64-bit data.
+     * So we work backwards from the end of the file, collecting the guest-physical addresses
+     * to modify. We only support 32-bit relocations, and ignore the 64-bit data.
      *
      * src: Linux kernel 3.5.3 arch/x86/boot/compressed/misc.c
      */
-    uint32_t last_relocated_vaddr = 0xFFFFFFFF;
-    uint32_t num_relocations = relocs_size / sizeof(uint32_t) - 1;
-    for (int i = 0; ; i++) {
-        uint32_t vaddr;
-        /* Get the next relocation from the relocs file. */
-        uint32_t offset = relocs_size - (sizeof(uint32_t) * (i + 1));
-        fseek(file, offset, SEEK_SET);
-        size_t result = fread(&vaddr, sizeof(uint32_t), 1, file);
-        ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-        if (!vaddr) {
-            break;
-        }
-        assert(i * sizeof(uint32_t) < relocs_size);
-        last_relocated_vaddr = vaddr;
-
+    size_t num_relocations = 0;
+    for (size_t i = num_entries; i > 0 && entries[i - 1]; i--) {
+        uint32_t vaddr = entries[i - 1];
         /* Calculate the corresponding guest-physical address at which we have already
            allocated and mapped the ELF contents into. */
-        assert(vaddr >= (uint32_t)image->kernel_image_arch.link_vaddr);
-        uintptr_t guest_paddr = (uintptr_t)vaddr - (uintptr_t)image->kernel_image_arch.link_vaddr +
-                                (uintptr_t)(load_addr + delta);
-
-        /* Perform the relocation. */
-        ZF_LOGI("   reloc vaddr 0x%x guest_addr 0x%x", (unsigned int)vaddr, (unsigned int)guest_paddr);
-        uint32_t addr;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_read_address, &addr);
-        addr += delta;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_write_address, &addr);
-
-        if (i && i % 50000 == 0) {
-            ZF_LOGE("    %u relocs done.", i);
+        if (vaddr < (uint32_t)image->kernel_image_arch.link_vaddr) {
+            ZF_LOGE("Relocation 0x%x is below the kernel's link address", (unsigned int)vaddr);
+            free(entries);
+            free(relocs);
+            return -1;
         }
+        relocs[num_relocations++] = (uintptr_t)vaddr - (uintptr_t)image->kernel_image_arch.link_vaddr +
+                                    (uintptr_t)(load_addr + delta);
     }
-    ZF_LOGI("plat: last relocated addr was %d", last_relocated_vaddr);
-    ZF_LOGI("plat: %d kernel relocations completed.", num_relocations);
-    (void) last_relocated_vaddr;
+    free(entries);
 
     if (num_relocations == 0) {
         ZF_LOGE("Relocation required, but Kernel has not been build with CONFIG_RELOCATABLE.");
+        free(relocs);
         return -1;
     }
 
-    fclose(file);
-    return 0;
-}
-
-/* TODO: Refactor and stop rewriting fucking elf loading code */
-static int load_guest_segment(vm_t *vm, seL4_Word source_offset,
-                              seL4_Word dest_addr, unsigned int segment_size, unsigned int file_size, FILE *file)
-{
-
-    int ret;
-    unsigned int page_size = seL4_PageBits;
-    assert(file_size <= segment_size);
-
-    /* Allocate a cslot for duplicating frame caps */
-    cspacepath_t dup_slot;
-    ret = vka_cspace_alloc_path(vm->vka, &dup_slot);
-    if (ret) {
-        ZF_LOGE("Failed to allocate slot");
-        return ret;
-    }
-
-    size_t current = 0;
-    size_t remain = file_size;
-    while (current < segment_size) {
-        /* Retrieve the mapping */
-        seL4_CPtr cap;
-        cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)dest_addr);
-        if (!cap) {
-            ZF_LOGE("Failed to find frame cap while loading elf segment at %p", (void *)dest_addr);
-            return -1;
-        }
-        cspacepath_t cap_path;
-        vka_cspace_make_path(vm->vka, cap, &cap_path);
-
-        /* Copy cap and map into our vspace */
-        vka_cnode_copy(&dup_slot, &cap_path, seL4_AllRights);
-        void *map_vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &dup_slot.capPtr, NULL, seL4_AllRights, 1, page_size, 1);
-        if (!map_vaddr) {
-            ZF_LOGE("Failed to map page into host vspace");
-            return -1;
-        }
+    /* Sort by target so that each guest page is mapped once and all of its relocations
+     * are applied together */
+    qsort(relocs, num_relocations, sizeof(uintptr_t), uintptr_cmp);
+
+    uintptr_t first = relocs[0];
+    uintptr_t last = relocs[num_relocations - 1] + sizeof(uint32_t);
+    size_t span_pages = (ROUND_UP(last, BIT(seL4_PageBits)) - ROUND_DOWN(first, BIT(seL4_PageBits))) >> seL4_PageBits;
+    guest_relocs_cookie_t pass = {
+        .relocs = relocs,
+        .num_relocs = num_relocations,
+        .delta = delta,
+        .max_deferred = span_pages / VM_RAM_TOUCH_BATCH_PAGES + 1,
+    };
+    pass.deferred = malloc(pass.max_deferred * sizeof(uintptr_t));
+    if (!pass.deferred) {
+        ZF_LOGE("Failed to allocate relocation state");
+        free(relocs);
+        return -1;
+    }
 
-        /* Copy the contents of page from ELF into the mapped frame. */
-        size_t offset = dest_addr & ((BIT(page_size)) - 1);
+    int err = vm_ram_touch_batch(vm, first, last - first, guest_elf_relocate_continued, &pass);
+    for (size_t i = 0; !err && i < pass.num_deferred; i++) {
+        uint32_t addr;
+        err = vm_ram_touch(vm, pass.deferred[i], sizeof(uint32_t), guest_elf_read_address, &addr);
+        addr += delta;
+        err = err ? err : vm_ram_touch(vm, pass.deferred[i], sizeof(uint32_t), guest_elf_write_address, &addr);
+    }
+    free(pass.deferred);
+    free(relocs);
+    if (err) {
+        ZF_LOGE("Failed to apply relocations");
+        return -1;
+    }
 
-        void *copy_vaddr = map_vaddr + offset;
-        size_t copy_len = (BIT(page_size)) - offset;
+    ZF_LOGI("plat: %zu kernel relocations completed over %zu pages.", num_relocations, span_pages);
 
-        if (remain > 0) {
-            if (copy_len > remain) {
-                /* Don't copy past end of data. */
-                copy_len = remain;
-            }
+    return 0;
+}
 
-            ZF_LOGI("load page src %zu dest %p remain %zu offset %zu copy vaddr %p "
-                    "copy len %zu\n", source_offset, (void *)dest_addr, remain, offset, copy_vaddr, copy_len);
+typedef struct load_segment_cookie {
+    FILE *file;
+    size_t file_size;
+} load_segment_cookie_t;
 
-            fseek(file, source_offset, SEEK_SET);
-            size_t result = fread(copy_vaddr, copy_len, 1, file);
-            ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-            source_offset += copy_len;
-            remain -= copy_len;
-        } else {
-            memset(copy_vaddr, 0, copy_len);
+static int load_segment_continued(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    load_segment_cookie_t *pass = cookie;
+    size_t copy_len = 0;
+
+    /* The file is read sequentially, so every window continues where the last one stopped */
+    if (offset < pass->file_size) {
+        copy_len = MIN(size, pass->file_size - offset);
+        size_t result = fread(vaddr, copy_len, 1, pass->file);
+        if (result != 1) {
+            ZF_LOGE("Read failed unexpectedly");
+            return -1;
         }
+    }
+    /* Zero the remainder of the window (the segment's bss) */
+    memset(vaddr + copy_len, 0, size - copy_len);
+    return 0;
+}
 
-        dest_addr += copy_len;
+static int load_guest_segment(vm_t *vm, seL4_Word source_offset,
+                              seL4_Word dest_addr, unsigned int segment_size, unsigned int file_size, FILE *file)
+{
+    assert(file_size <= segment_size);
 
-        current += copy_len;
+    ZF_LOGI("load segment src %zu dest %p file size %u segment size %u", (size_t)source_offset,
+            (void *)dest_addr, file_size, segment_size);
 
-        /* Unamp the page and delete the temporary cap */
-        vspace_unmap_pages(&vm->mem.vmm_vspace, map_vaddr, 1, page_size, NULL);
-        vka_cnode_delete(&dup_slot);
+    if (fseek(file, source_offset, SEEK_SET)) {
+        ZF_LOGE("Failed to seek to segment at %zu", (size_t)source_offset);
+        return -1;
     }
 
-    return 0;
+    load_segment_cookie_t pass = { .file = file, .file_size = file_size };
+    return vm_ram_touch_batch(vm, dest_addr, segment_size, load_segment_continued, &pass);
 }
 
-static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_address, size_t alignment,
-                          guest_kernel_image_t *guest_image)
+/* Work out where the loadable segments of a guest elf go in guest RAM */
+static int plan_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_address, size_t alignment,
+                          guest_kernel_image_t *guest_image, guest_image_extent_t *extents, int max_extents)
 {
     elf_t kernel_elf;
     char elf_file[256];
@@ -235,6 +280,7 @@ static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_addre
     }
 
     ret = read_elf_headers(elf_file, vm, file, sizeof(elf_file), &kernel_elf);
+    fclose(file);
     if (ret < 0) {
         ZF_LOGE("Guest elf \"%s\" invalid.", image_name);
         return -1;
@@ -272,36 +318,30 @@ static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_addre
             guest_relocation_offset < 0 ? "-" : "",
             abs(guest_relocation_offset));
 
+    int num_extents = 0;
     for (int i = 0; i < n_headers; i++) {
-        seL4_Word source_offset, dest_addr;
-        unsigned int file_size, segment_size;
-
         /* Skip unloadable program headers. */
         if (elf_getProgramHeaderType(&kernel_elf, i) != PT_LOAD) {
             continue;
         }
 
         /* Fetch information about this segment. */
-        source_offset = elf_getProgramHeaderOffset(&kernel_elf, i);
-        file_size = elf_getProgramHeaderFileSize(&kernel_elf, i);
-        segment_size = elf_getProgramHeaderMemorySize(&kernel_elf, i);
-
-        dest_addr = elf_getProgramHeaderPaddr(&kernel_elf, i);
-        dest_addr += guest_relocation_offset;
-
-        if (!segment_size) {
+        guest_image_extent_t segment = {
+            .file_offset = elf_getProgramHeaderOffset(&kernel_elf, i),
+            .paddr = elf_getProgramHeaderPaddr(&kernel_elf, i) + guest_relocation_offset,
+            .file_size = elf_getProgramHeaderFileSize(&kernel_elf, i),
+            .mem_size = elf_getProgramHeaderMemorySize(&kernel_elf, i),
+        };
+
+        if (!segment.mem_size) {
             /* Zero sized segment, ignore. */
             continue;
         }
-
-        /* Load this ELf segment. */
-        ret = load_guest_segment(vm, source_offset, dest_addr, segment_size, file_size, file);
-        if (ret) {
-            return ret;
+        if (num_extents == max_extents) {
+            ZF_LOGE("Guest elf \"%s\" has too many loadable segments", image_name);
+            return -1;
         }
-
-        /* Record it as allocated */
-        vm_ram_mark_allocated(vm, dest_addr, segment_size);
+        extents[num_extents++] = segment;
     }
 
     /* Record the entry point. */
@@ -315,6 +355,39 @@ static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_addre
     guest_image->kernel_image_arch.relocation_offset = guest_relocation_offset;
     guest_image->kernel_image.alignment = alignment;
 
+    return num_extents;
+}
+
+static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_address, size_t alignment,
+                          guest_kernel_image_t *guest_image)
+{
+    guest_image_extent_t segments[GUEST_IMAGE_MAX_EXTENTS];
+    int ret;
+    int num_segments = plan_guest_elf(vm, image_name, load_address, alignment, guest_image, segments,
+                                      GUEST_IMAGE_MAX_EXTENTS);
+    if (num_segments < 0) {
+        return -1;
+    }
+
+    FILE *file = fopen(image_name, "r");
+    if (!file) {
+        ZF_LOGE("Guest kernel elf \"%s\" not found.", image_name);
+        return -1;
+    }
+
+    for (int i = 0; i < num_segments; i++) {
+        /* Load this ELf segment. */
+        ret = load_guest_segment(vm, segments[i].file_offset, segments[i].paddr, segments[i].mem_size,
+                                 segments[i].file_size, file);
+        if (ret) {
+            fclose(file);
+            return ret;
+        }
+
+        /* Record it as allocated */
+        vm_ram_mark_allocated(vm, segments[i].paddr, segments[i].mem_size);
+    }
+
     fclose(file);
 
     return 0;
@@ -324,13 +397,17 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
                          guest_kernel_image_t *guest_kernel_image)
 {
     int err;
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     err = load_guest_elf(vm, kernel_name, load_address, alignment, guest_kernel_image);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_IMAGE_LOAD);
     if (err) {
         ZF_LOGE("Failed to load guest elf");
         return err;
     }
     if (guest_kernel_image->kernel_image_arch.is_reloc_enabled) {
+        vm_boot_phase_begin(vm, VM_BOOT_PHASE_RELOCATION);
         err = guest_elf_relocate(vm, guest_kernel_image->kernel_image_arch.relocs_file, guest_kernel_image);
+        vm_boot_phase_end(vm, VM_BOOT_PHASE_RELOCATION);
         if (err) {
             ZF_LOGE("Failed to relocation guest kernel elf");
         }
@@ -341,15 +418,15 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
 static int load_module_continued(vm_t *vm, uintptr_t paddr, void *addr, size_t size, size_t offset, void *cookie)
 {
     boot_guest_cookie_t *pass = (boot_guest_cookie_t *) cookie;
-    fseek(pass->file, offset, SEEK_SET);
-    size_t result = fread(addr, size, 1, pass->file);
-    ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
+    if (fseek(pass->file, offset, SEEK_SET) || fread(addr, size, 1, pass->file) != 1) {
+        ZF_LOGE("Failed to read module at offset 0x%zx", offset);
+        return -1;
+    }
 
     return 0;
 }
 
-int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
-                         guest_image_t *guest_image)
+static int load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, guest_image_t *guest_image)
 {
     ZF_LOGI("Loading module \"%s\" at 0x%x\n", module_name, (unsigned int)load_address);
 
@@ -364,17 +441,94 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
     fseek(file, 0, SEEK_SET);
     if (!module_size) {
         ZF_LOGE("Module has zero size. This is probably not what you want.");
+        fclose(file);
         return -1;
     }
 
     vm_ram_mark_allocated(vm, load_address, module_size);
     boot_guest_cookie_t pass = { .vm = vm, .file = file};
-    vm_ram_touch(vm, load_address, module_size, load_module_continued, &pass);
+    int err = vm_ram_touch_batch(vm, load_address, module_size, load_module_continued, &pass);
 
     fclose(file);
+    if (err) {
+        ZF_LOGE("Failed to load module \"%s\" into guest RAM", module_name);
+        return -1;
+    }
 
     guest_image->load_paddr = load_address;
     guest_image->size = module_size;
 
     return 0;
 }
+
+int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
+                         guest_image_t *guest_image)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_IMAGE_LOAD);
+    int err = load_guest_module(vm, module_name, load_address, guest_image);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_IMAGE_LOAD);
+    return err;
+}
+
+int guest_image_arch_write(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    if (cookie) {
+        memcpy(vaddr, cookie + offset, size);
+    } else {
+        memset(vaddr, 0, size);
+    }
+    return 0;
+}
+
+int guest_image_arch_plan(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                          int max_extents)
+{
+    if (request->is_kernel) {
+        return plan_guest_elf(vm, request->name, request->load_address, request->alignment,
+                              request->kernel_image, extents, max_extents);
+    }
+
+    FILE *file = fopen(request->name, "r");
+    if (!file) {
+        ZF_LOGE("Module \"%s\" not found.", request->name);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t module_size = ftell(file);
+    fclose(file);
+    if (!module_size) {
+        ZF_LOGE("Module has zero size. This is probably not what you want.");
+        fclose(file);
+        return -1;
+    }
+
+    extents[0] = (guest_image_extent_t) {
+        .file_offset = 0,
+        .paddr = request->load_address,
+        .file_size = module_size,
+        .mem_size = module_size,
+    };
+    return 1;
+}
+
+int guest_image_arch_finish(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                            int num_extents)
+{
+    if (!request->is_kernel) {
+        request->image->load_paddr = extents[0].paddr;
+        request->image->size = extents[0].mem_size;
+        return 0;
+    }
+
+    guest_kernel_image_t *guest_kernel_image = request->kernel_image;
+    if (guest_kernel_image->kernel_image_arch.is_reloc_enabled) {
+        vm_boot_phase_begin(vm, VM_BOOT_PHASE_RELOCATION);
+        int err = guest_elf_relocate(vm, guest_kernel_image->kernel_image_arch.relocs_file, guest_kernel_image);
+        vm_boot_phase_end(vm, VM_BOOT_PHASE_RELOCATION);
+        if (err) {
+            ZF_LOGE("Failed to relocation guest kernel elf");
+            return err;
+        }
+    }
+    return 0;
+}
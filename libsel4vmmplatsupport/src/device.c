@@ -12,6 +12,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vmmplatsupport/device.h>
@@ -23,9 +24,22 @@ int device_list_init(device_list_t *list)
     return 0;
 }
 
-static int dev_cmp(const void *a, const void *b)
+/* Index of the first device that ends after addr. Devices are kept sorted by
+ * address and never overlap, so their end addresses are sorted too */
+static int device_search(device_list_t *list, uintptr_t addr)
 {
-    return ((const struct device *)a)->pstart - ((const struct device *)b)->pstart;
+    int lo = 0;
+    int hi = list->num_devices;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct device *dev = &list->devices[mid];
+        if (addr < dev->pstart + dev->size) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
 }
 
 int add_device(device_list_t *list, const struct device *d)
@@ -34,31 +48,33 @@ int add_device(device_list_t *list, const struct device *d)
         return -1;
     }
 
+    int index = device_search(list, d->pstart);
+    if (index < list->num_devices && list->devices[index].pstart < d->pstart + d->size) {
+        ZF_LOGE("Device %s [0x%"PRIxPTR", 0x%"PRIxPTR") overlaps %s [0x%"PRIxPTR", 0x%"PRIxPTR")",
+                d->name, (uintptr_t)d->pstart, (uintptr_t)(d->pstart + d->size), list->devices[index].name,
+                (uintptr_t)list->devices[index].pstart,
+                (uintptr_t)(list->devices[index].pstart + list->devices[index].size));
+        return -1;
+    }
+
     struct device *updated_devices = realloc(list->devices, sizeof(struct device) * (list->num_devices + 1));
     if (!updated_devices) {
         return -1;
     }
     list->devices = updated_devices;
-    memcpy(&list->devices[list->num_devices++], d, sizeof(struct device));
-    qsort(list->devices, list->num_devices, sizeof(struct device), dev_cmp);
+    memmove(&list->devices[index + 1], &list->devices[index],
+            sizeof(struct device) * (list->num_devices - index));
+    memcpy(&list->devices[index], d, sizeof(struct device));
+    list->num_devices++;
     return 0;
 }
 
 struct device *
 find_device_by_pa(device_list_t *dev_list, uintptr_t addr)
 {
-    struct device *dev = NULL;
-    for (int i = 0; i < dev_list->num_devices; i++) {
-        struct device *curr_dev = &dev_list->devices[i];
-        if (addr < curr_dev->pstart) {
-            break;
-        }
-
-        if (addr < curr_dev->pstart + curr_dev->size) {
-            /* Found a match */
-            dev = curr_dev;
-            break;
-        }
+    int index = device_search(dev_list, addr);
+    if (index < dev_list->num_devices && addr >= dev_list->devices[index].pstart) {
+        return &dev_list->devices[index];
     }
-    return dev;
+    return NULL;
 }
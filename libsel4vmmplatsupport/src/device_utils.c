@@ -13,12 +13,13 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/boot_timing.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/device.h>
 #include <sel4vmmplatsupport/device_utils.h>
 
-int vm_install_ram_only_device(vm_t *vm, const struct device *device)
+static int install_ram_only_device(vm_t *vm, const struct device *device)
 {
     struct device d;
     uintptr_t paddr;
@@ -36,6 +37,14 @@ int vm_install_ram_only_device(vm_t *vm, const struct device *device)
     return err;
 }
 
+int vm_install_ram_only_device(vm_t *vm, const struct device *device)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_DEVICES);
+    int err = install_ram_only_device(vm, device);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_DEVICES);
+    return err;
+}
+
 static memory_fault_result_t passthrough_device_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                       size_t fault_length, void *cookie)
 {
@@ -43,7 +52,7 @@ static memory_fault_result_t passthrough_device_fault(vm_t *vm, vm_vcpu_t *vcpu,
     return FAULT_ERROR;
 }
 
-int vm_install_passthrough_device(vm_t *vm, const struct device *device)
+static int install_passthrough_device(vm_t *vm, const struct device *device)
 {
     struct device d;
     uintptr_t paddr;
@@ -75,6 +84,14 @@ int vm_install_passthrough_device(vm_t *vm, const struct device *device)
     return err;
 }
 
+int vm_install_passthrough_device(vm_t *vm, const struct device *device)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_DEVICES);
+    int err = install_passthrough_device(vm, device);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_DEVICES);
+    return err;
+}
+
 static memory_fault_result_t handle_listening_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                     size_t fault_length, void *cookie)
 {
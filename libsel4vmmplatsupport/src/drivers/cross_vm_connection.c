@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <sel4/sel4.h>
 #include <vka/capops.h>
+#include <vka/object.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
@@ -43,6 +44,15 @@ struct connection_info {
     size_t dataport_size_bits;
     crossvm_handle_t connection;
     int connection_irq;
+    /* Backings of the bars, when the bar emulation reserves them */
+    vmm_pci_bar_backing_t event_backing;
+    vmm_pci_bar_backing_t dataport_backing;
+};
+
+struct event_frame_cookie {
+    vm_t *vm;
+    cspacepath_t frame;
+    uintptr_t event_address;
 };
 
 struct dataport_iterator_cookie {
@@ -87,10 +97,9 @@ static int construct_connection_bar(vm_t *vm, struct connection_info *info, int
             {
                 .mem_type = PREFETCH_MEM,
                 .address = info[conn_idx].event_address,
-                /* if size_bits isn't the same for all resources then Linux tries
-                   to remap the resources which the vmm driver doesn't support.
-                 */
-                .size_bits = info[conn_idx].dataport_size_bits
+                /* if size_bits isn't the same for all resources then Linux tries to remap
+                 * the resources, which only the x86 bar emulation supports */
+                .size_bits = config_set(CONFIG_ARCH_X86) ? seL4_PageBits : info[conn_idx].dataport_size_bits
             },
             {
                 .mem_type = PREFETCH_MEM,
@@ -102,6 +111,14 @@ static int construct_connection_bar(vm_t *vm, struct connection_info *info, int
         /* TODO: Make both architecture go through the same interface */
         if (config_set(CONFIG_ARCH_X86)) {
             connection_pci_bar = vmm_pci_create_bar_emulation(entry, 2, bars);
+            int err = vmm_pci_bar_emulation_add_backing(vm, connection_pci_bar, 0, info[conn_idx].event_backing);
+            if (!err) {
+                err = vmm_pci_bar_emulation_add_backing(vm, connection_pci_bar, 1, info[conn_idx].dataport_backing);
+            }
+            if (err) {
+                ZF_LOGE("Failed to reserve bars of connection %d", conn_idx);
+                return -1;
+            }
         } else if (config_set(CONFIG_ARCH_ARM)) {
             connection_pci_bar = vmm_pci_create_passthrough_bar_emulation(entry, 2, bars);
         }
@@ -139,6 +156,63 @@ static memory_fault_result_t handle_event_bar_fault(vm_t *vm, vm_vcpu_t *vcpu, u
     return FAULT_HANDLED;
 }
 
+static vm_frame_t event_frame_iterator(uintptr_t addr, void *cookie)
+{
+    cspacepath_t return_frame;
+    vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
+    struct event_frame_cookie *event_cookie = (struct event_frame_cookie *)cookie;
+    vm_t *vm = event_cookie->vm;
+
+    /* Each mapping of the bar needs its own copy of the cap */
+    int error = vka_cspace_alloc_path(vm->vka, &return_frame);
+    if (error) {
+        ZF_LOGE("Failed to allocate cspace path for event frame");
+        return frame_result;
+    }
+    error = vka_cnode_copy(&return_frame, &event_cookie->frame, seL4_AllRights);
+    if (error) {
+        ZF_LOGE("Failed to cnode_copy for event frame");
+        vka_cspace_free_path(vm->vka, return_frame);
+        return frame_result;
+    }
+    frame_result.cptr = return_frame.capPtr;
+    frame_result.rights = seL4_CanRead;
+    frame_result.vaddr = event_cookie->event_address;
+    frame_result.size_bits = seL4_PageBits;
+    return frame_result;
+}
+
+/* Allocate the event registers and the backing of the event bar, but leave reserving the bar to the bar emulation */
+static void *create_event_registers(vm_t *vm, uintptr_t event_bar_address, vmm_pci_bar_backing_t *backing)
+{
+    vka_object_t frame;
+    struct event_frame_cookie *event_cookie = calloc(1, sizeof(struct event_frame_cookie));
+    if (!event_cookie) {
+        ZF_LOGE("Failed to allocate event frame cookie");
+        return NULL;
+    }
+    int err = vka_alloc_frame(vm->vka, seL4_PageBits, &frame);
+    if (err) {
+        ZF_LOGE("Failed to allocate event frame");
+        free(event_cookie);
+        return NULL;
+    }
+    vka_cspace_make_path(vm->vka, frame.cptr, &event_cookie->frame);
+    void *event_registers = vspace_map_pages(&vm->mem.vmm_vspace, &frame.cptr, NULL, seL4_AllRights, 1,
+                                             seL4_PageBits, 0);
+    if (!event_registers) {
+        ZF_LOGE("Failed to map event frame into vmm vspace");
+        vka_free_object(vm->vka, &frame);
+        free(event_cookie);
+        return NULL;
+    }
+    event_cookie->vm = vm;
+    event_cookie->event_address = event_bar_address;
+    backing->map_iterator = event_frame_iterator;
+    backing->map_cookie = event_cookie;
+    return event_registers;
+}
+
 static int reserve_event_bar(vm_t *vm, uintptr_t event_bar_address, struct connection_info *info)
 {
     struct device *event_bar = calloc(1, sizeof(struct device));
@@ -149,8 +223,15 @@ static int reserve_event_bar(vm_t *vm, uintptr_t event_bar_address, struct conne
     event_bar->pstart = event_bar_address;
     event_bar->priv = (void *)info;
 
-    info->event_registers = create_allocated_reservation_frame(vm, event_bar_address, seL4_CanRead,
-                                                               handle_event_bar_fault, event_bar);
+    if (config_set(CONFIG_ARCH_X86)) {
+        /* The bar emulation reserves the bar so that the guest can move it */
+        info->event_registers = create_event_registers(vm, event_bar_address, &info->event_backing);
+        info->event_backing.fault_callback = handle_event_bar_fault;
+        info->event_backing.fault_cookie = event_bar;
+    } else {
+        info->event_registers = create_allocated_reservation_frame(vm, event_bar_address, seL4_CanRead,
+                                                                   handle_event_bar_fault, event_bar);
+    }
     if (info->event_registers == NULL) {
         ZF_LOGE("Failed to map emulated event bar space");
         return -1;
@@ -180,7 +261,21 @@ static vm_frame_t dataport_memory_iterator(uintptr_t addr, void *cookie)
         return frame_result;
     }
     int page_idx = (frame_start - dataport_start) / BIT(page_size);
-    frame_result.cptr = dataport_frames[page_idx];
+    /* Each mapping of the dataport needs its own copy of the caps, as they are deleted when the bar is moved */
+    cspacepath_t frame_path;
+    vka_cspace_make_path(vm->vka, dataport_frames[page_idx], &frame_path);
+    error = vka_cspace_alloc_path(vm->vka, &return_frame);
+    if (error) {
+        ZF_LOGE("Failed to allocate cspace path for dataport frame");
+        return frame_result;
+    }
+    error = vka_cnode_copy(&return_frame, &frame_path, seL4_AllRights);
+    if (error) {
+        ZF_LOGE("Failed to cnode_copy for dataport frame");
+        vka_cspace_free_path(vm->vka, return_frame);
+        return frame_result;
+    }
+    frame_result.cptr = return_frame.capPtr;
     frame_result.rights = seL4_AllRights;
     frame_result.vaddr = frame_start;
     frame_result.size_bits = page_size;
@@ -195,9 +290,6 @@ static int reserve_dataport_memory(vm_t *vm, crossvm_dataport_handle_t *dataport
     unsigned int num_frames = dataport->num_frames;
     seL4_CPtr *frames = dataport->frames;
 
-    vm_memory_reservation_t *dataport_reservation = vm_reserve_memory_at(vm, dataport_address, size,
-                                                                         default_error_fault_callback,
-                                                                         NULL);
     struct dataport_iterator_cookie *dataport_cookie = malloc(sizeof(struct dataport_iterator_cookie));
     if (!dataport_cookie) {
         ZF_LOGE("Failed to allocate dataport iterator cookie");
@@ -207,10 +299,26 @@ static int reserve_dataport_memory(vm_t *vm, crossvm_dataport_handle_t *dataport
     dataport_cookie->dataport_frames = frames;
     dataport_cookie->dataport_start = dataport_address;
     dataport_cookie->dataport_size = size;
-    err = vm_map_reservation(vm, dataport_reservation, dataport_memory_iterator, (void *)dataport_cookie);
-    if (err) {
-        ZF_LOGE("Failed to map dataport memory");
-        return -1;
+    if (config_set(CONFIG_ARCH_X86)) {
+        /* The bar emulation reserves the bar so that the guest can move it */
+        info->dataport_backing = (vmm_pci_bar_backing_t) {
+            .fault_callback = default_error_fault_callback,
+            .map_iterator = dataport_memory_iterator,
+            .map_cookie = dataport_cookie
+        };
+    } else {
+        vm_memory_reservation_t *dataport_reservation = vm_reserve_memory_at(vm, dataport_address, size,
+                                                                             default_error_fault_callback,
+                                                                             NULL);
+        if (!dataport_reservation) {
+            ZF_LOGE("Failed to reserve dataport memory");
+            return -1;
+        }
+        err = vm_map_reservation(vm, dataport_reservation, dataport_memory_iterator, (void *)dataport_cookie);
+        if (err) {
+            ZF_LOGE("Failed to map dataport memory");
+            return -1;
+        }
     }
     info->dataport_address = dataport_address;
     info->dataport_size_bits = BYTES_TO_SIZE_BITS(size);
@@ -267,17 +375,25 @@ static int initialise_connections(vm_t *vm, uintptr_t connection_base_addr, cros
     int err;
     uintptr_t connection_curr_addr = connection_base_addr;
     for (int i = 0; i < num_connections; i++) {
-        /* We need to round everything up to the largest sized resource to prevent
-         * Linux from remapping the devices, which the vpci device can't emulate.
+        /* On ARM we need to round everything up to the largest sized resource to prevent
+         * Linux from remapping the devices, which the vpci device can't emulate there.
+         * On x86 the bars have their natural size and are only aligned to it.
          */
         crossvm_dataport_handle_t *dataport = connections[i].dataport;
         uintptr_t dataport_size = dataport->size;
+        if (config_set(CONFIG_ARCH_X86)) {
+            connection_curr_addr = ROUND_UP(connection_curr_addr, PAGE_SIZE_4K);
+        }
         err = reserve_event_bar(vm, connection_curr_addr, &info[i]);
         if (err) {
             ZF_LOGE("Failed to create event bar (id:%d)", i);
             return -1;
         }
-        connection_curr_addr += dataport_size;
+        if (config_set(CONFIG_ARCH_X86)) {
+            connection_curr_addr = ROUND_UP(connection_curr_addr + PAGE_SIZE_4K, dataport_size);
+        } else {
+            connection_curr_addr += dataport_size;
+        }
         err = reserve_dataport_memory(vm, dataport, connection_curr_addr, &info[i]);
         if (err) {
             ZF_LOGE("Failed to create dataport bar (id %d)", i);
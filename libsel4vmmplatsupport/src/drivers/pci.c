@@ -25,8 +25,121 @@
 #include <sel4vmmplatsupport/drivers/pci.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
-#define NUM_DEVICES 32
-#define NUM_FUNCTIONS 8
+/* Device slot on each bus that holds the bridge to the next bus */
+#define BRIDGE_SLOT (VMM_PCI_NUM_DEVICES - 1)
+
+#define PCI_BRIDGE_CONFIG_SIZE 0x40
+#define PCI_BRIDGE_DEVICE_ID 0x43
+#define PCI_BRIDGE_CLASS 0x0604
+
+/* An emulated PCI-to-PCI bridge with a type 1 configuration header. The bus numbers are fixed by the topology,
+ * the windows are only storage as there is no routing between buses to configure */
+typedef struct pci_bridge {
+    uint8_t config[PCI_BRIDGE_CONFIG_SIZE];
+} pci_bridge_t;
+
+/* Bits of each byte of the type 1 header that the guest may write */
+static const uint8_t pci_bridge_write_mask[PCI_BRIDGE_CONFIG_SIZE] = {
+    [PCI_COMMAND] = 0xff, [PCI_COMMAND + 1] = 0xff,
+    [PCI_CACHE_LINE_SIZE] = 0xff,
+    [PCI_SEC_LATENCY_TIMER] = 0xff,
+    [PCI_IO_BASE] = 0xf0, [PCI_IO_LIMIT] = 0xf0,
+    [PCI_MEMORY_BASE] = 0xf0, [PCI_MEMORY_BASE + 1] = 0xff,
+    [PCI_MEMORY_LIMIT] = 0xf0, [PCI_MEMORY_LIMIT + 1] = 0xff,
+    [PCI_PREF_MEMORY_BASE] = 0xf0, [PCI_PREF_MEMORY_BASE + 1] = 0xff,
+    [PCI_PREF_MEMORY_LIMIT] = 0xf0, [PCI_PREF_MEMORY_LIMIT + 1] = 0xff,
+    [PCI_INTERRUPT_LINE] = 0xff,
+    [PCI_BRIDGE_CONTROL] = 0xff, [PCI_BRIDGE_CONTROL + 1] = 0xff,
+};
+
+static int pci_bridge_read(void *cookie, int offset, int size, uint32_t *result)
+{
+    pci_bridge_t *bridge = cookie;
+    *result = 0;
+    if (offset < 0 || size > sizeof(*result)) {
+        ZF_LOGE("Invalid bridge read of size %d at offset 0x%x", size, offset);
+        return -1;
+    }
+    if (offset + size <= PCI_BRIDGE_CONFIG_SIZE) {
+        memcpy(result, &bridge->config[offset], size);
+    }
+    return 0;
+}
+
+static int pci_bridge_write(void *cookie, int offset, int size, uint32_t value)
+{
+    pci_bridge_t *bridge = cookie;
+    if (offset < 0 || size > sizeof(value)) {
+        ZF_LOGE("Invalid bridge write of size %d at offset 0x%x", size, offset);
+        return -1;
+    }
+    for (int i = 0; i < size && offset + i < PCI_BRIDGE_CONFIG_SIZE; i++) {
+        uint8_t mask = pci_bridge_write_mask[offset + i];
+        uint8_t byte = value >> (i * 8);
+        bridge->config[offset + i] = (bridge->config[offset + i] & ~mask) | (byte & mask);
+    }
+    return 0;
+}
+
+static vmm_pci_entry_t **pci_entry_slot(vmm_pci_space_t *space, int bus, int dev, int fun)
+{
+    return &space->entries[VMM_PCI_BDF_INDEX(bus, dev, fun)];
+}
+
+static int pci_place_entry(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t addr)
+{
+    vmm_pci_entry_t *new_entry = calloc(1, sizeof(entry));
+    if (!new_entry) {
+        ZF_LOGE("Failed to calloc memory for pci entry");
+        return -1;
+    }
+    *new_entry = entry;
+    *pci_entry_slot(space, addr.bus, addr.dev, addr.fun) = new_entry;
+    ZF_LOGI("Adding virtual PCI device at %02x:%02x.%d", addr.bus, addr.dev, addr.fun);
+    return 0;
+}
+
+/* Extend the topology with a bridge in the last slot of the last bus */
+static int pci_add_bridge(vmm_pci_space_t *space)
+{
+    int primary = space->num_buses - 1;
+    int secondary = space->num_buses;
+
+    pci_bridge_t *bridge = calloc(1, sizeof(*bridge));
+    if (!bridge) {
+        ZF_LOGE("Failed to calloc memory for pci bridge");
+        return -1;
+    }
+    uint16_t vendor_id = 0x5E14;
+    uint16_t device_id = PCI_BRIDGE_DEVICE_ID;
+    memcpy(&bridge->config[PCI_VENDOR_ID], &vendor_id, sizeof(vendor_id));
+    memcpy(&bridge->config[PCI_DEVICE_ID], &device_id, sizeof(device_id));
+    bridge->config[PCI_REVISION_ID] = 0x1;
+    bridge->config[PCI_CLASS_DEVICE] = PCI_BRIDGE_CLASS & MASK(8);
+    bridge->config[PCI_CLASS_DEVICE + 1] = PCI_BRIDGE_CLASS >> 8;
+    bridge->config[PCI_HEADER_TYPE] = PCI_HEADER_TYPE_BRIDGE;
+    bridge->config[PCI_PRIMARY_BUS] = primary;
+    bridge->config[PCI_SECONDARY_BUS] = secondary;
+
+    int err = pci_place_entry(space, (vmm_pci_entry_t) {
+        .cookie = bridge, .ioread = pci_bridge_read, .iowrite = pci_bridge_write
+    }, (vmm_pci_address_t) {
+        .bus = primary, .dev = BRIDGE_SLOT, .fun = 0
+    });
+    if (err) {
+        free(bridge);
+        return -1;
+    }
+    space->num_buses++;
+
+    /* Every bridge up the chain now leads to the new bus */
+    for (int bus = 0; bus < primary + 1; bus++) {
+        vmm_pci_entry_t *entry = *pci_entry_slot(space, bus, BRIDGE_SLOT, 0);
+        pci_bridge_t *upstream = entry->cookie;
+        upstream->config[PCI_SUBORDINATE_BUS] = secondary;
+    }
+    return 0;
+}
 
 int vmm_pci_init(vmm_pci_space_t **space)
 {
@@ -36,11 +149,7 @@ int vmm_pci_init(vmm_pci_space_t **space)
         return -1;
     }
 
-    for (int i = 0; i < NUM_DEVICES; i++) {
-        for (int j = 0; j < NUM_FUNCTIONS; j++) {
-            pci_space->bus0[i][j] = NULL;
-        }
-    }
+    pci_space->num_buses = 1;
     pci_space->conf_port_addr = 0;
     /* Define the initial PCI bridge */
     vmm_pci_device_def_t *bridge = calloc(1, sizeof(*bridge));
@@ -57,27 +166,92 @@ int vmm_pci_init(vmm_pci_space_t **space)
 
 int vmm_pci_add_entry(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t *addr)
 {
-    /* Find empty dev */
-    for (int i = 0; i < 32; i++) {
-        if (!space->bus0[i][0]) {
-            /* Allocate an entry */
-            space->bus0[i][0] = calloc(1, sizeof(entry));
-
-            *space->bus0[i][0] = entry;
+    /* Find empty dev. Buses are only added as they fill, so this is the first free slot of the last bus unless
+     * entries were placed explicitly */
+    for (int bus = 0; bus < space->num_buses; bus++) {
+        for (int dev = 0; dev < VMM_PCI_NUM_DEVICES; dev++) {
+            if (*pci_entry_slot(space, bus, dev, 0)) {
+                continue;
+            }
+            if (dev == BRIDGE_SLOT && bus == space->num_buses - 1 && space->num_buses < VMM_PCI_MAX_BUSES) {
+                /* Give the last slot to a bridge and continue on the new bus */
+                if (pci_add_bridge(space)) {
+                    return -1;
+                }
+                continue;
+            }
+            vmm_pci_address_t location = {
+                .bus = bus, .dev = dev, .fun = 0
+            };
+            if (pci_place_entry(space, entry, location)) {
+                return -1;
+            }
             /* Report addr if reqeusted */
             if (addr) {
-                *addr = (vmm_pci_address_t) {
-                    .bus = 0, .dev = i, .fun = 0
-                };
+                *addr = location;
             }
-            ZF_LOGI("Adding virtual PCI device at %02x:%02x.%d", 0, i, 0);
             return 0;
         }
     }
-    ZF_LOGE("No free device slot on bus 0 to add virtual pci device");
+    ZF_LOGE("No free device slot on any bus to add virtual pci device");
+    return -1;
+}
+
+int vmm_pci_add_entry_at(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t addr)
+{
+    if (addr.bus >= space->num_buses || addr.dev >= VMM_PCI_NUM_DEVICES || addr.fun >= VMM_PCI_NUM_FUNCTIONS) {
+        ZF_LOGE("Invalid PCI address %02x:%02x.%d", addr.bus, addr.dev, addr.fun);
+        return -1;
+    }
+    if (*pci_entry_slot(space, addr.bus, addr.dev, addr.fun)) {
+        ZF_LOGE("PCI address %02x:%02x.%d is already in use", addr.bus, addr.dev, addr.fun);
+        return -1;
+    }
+    if (addr.fun != 0 && !*pci_entry_slot(space, addr.bus, addr.dev, 0)) {
+        ZF_LOGE("PCI device %02x:%02x needs function 0 before function %d", addr.bus, addr.dev, addr.fun);
+        return -1;
+    }
+    return pci_place_entry(space, entry, addr);
+}
+
+int vmm_pci_add_function(vmm_pci_space_t *space, vmm_pci_entry_t entry, vmm_pci_address_t dev_addr,
+                         vmm_pci_address_t *addr)
+{
+    dev_addr.fun = 0;
+    if (!find_device(space, dev_addr) || vmm_pci_is_bridge(space, dev_addr)) {
+        ZF_LOGE("No PCI device at %02x:%02x to add a function to", dev_addr.bus, dev_addr.dev);
+        return -1;
+    }
+    for (int fun = 1; fun < VMM_PCI_NUM_FUNCTIONS; fun++) {
+        if (*pci_entry_slot(space, dev_addr.bus, dev_addr.dev, fun)) {
+            continue;
+        }
+        vmm_pci_address_t location = {
+            .bus = dev_addr.bus, .dev = dev_addr.dev, .fun = fun
+        };
+        if (pci_place_entry(space, entry, location)) {
+            return -1;
+        }
+        if (addr) {
+            *addr = location;
+        }
+        return 0;
+    }
+    ZF_LOGE("No free function on PCI device %02x:%02x", dev_addr.bus, dev_addr.dev);
     return -1;
 }
 
+bool vmm_pci_is_bridge(vmm_pci_space_t *space, vmm_pci_address_t addr)
+{
+    if (addr.fun != 0) {
+        return false;
+    }
+    if (addr.bus == 0 && addr.dev == 0) {
+        return true;
+    }
+    return addr.dev == BRIDGE_SLOT && addr.bus + 1 < space->num_buses;
+}
+
 void make_addr_reg_from_config(uint32_t conf, vmm_pci_address_t *addr, uint8_t *reg)
 {
     addr->bus = (conf >> 16) & MASK(8);
@@ -86,10 +260,67 @@ void make_addr_reg_from_config(uint32_t conf, vmm_pci_address_t *addr, uint8_t *
     *reg = conf & MASK(8);
 }
 
+void make_addr_reg_from_ecam(uint32_t offset, vmm_pci_address_t *addr, uint16_t *reg)
+{
+    addr->bus = (offset >> 20) & MASK(8);
+    addr->dev = (offset >> 15) & MASK(5);
+    addr->fun = (offset >> 12) & MASK(3);
+    *reg = offset & MASK(12);
+}
+
 vmm_pci_entry_t *find_device(vmm_pci_space_t *self, vmm_pci_address_t addr)
 {
-    if (addr.bus != 0 || addr.dev >= 32 || addr.fun >= 8) {
+    if (addr.bus >= self->num_buses || addr.dev >= VMM_PCI_NUM_DEVICES || addr.fun >= VMM_PCI_NUM_FUNCTIONS) {
         return NULL;
     }
-    return self->bus0[addr.dev][addr.fun];
+    return *pci_entry_slot(self, addr.bus, addr.dev, addr.fun);
+}
+
+static bool pci_is_multi_function(vmm_pci_space_t *space, vmm_pci_address_t addr)
+{
+    for (int fun = 1; fun < VMM_PCI_NUM_FUNCTIONS; fun++) {
+        if (*pci_entry_slot(space, addr.bus, addr.dev, fun)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int vmm_pci_config_read(vmm_pci_space_t *space, vmm_pci_address_t addr, int offset, int size, uint32_t *result)
+{
+    vmm_pci_entry_t *dev = find_device(space, addr);
+    if (!dev) {
+        /* Random reads could just be the guest probing for devices */
+        ZF_LOGI("Ignoring guest probe for device %02x:%02x.%d register 0x%x", addr.bus, addr.dev, addr.fun, offset);
+        *result = -1;
+        return 0;
+    }
+    int err = dev->ioread(dev->cookie, offset, size, result);
+    if (err) {
+        return -1;
+    }
+    /* The entry cannot know about the rest of the topology, so report multi function from the topology. This also
+     * hides the multi function bit of passthrough devices that only have some of their functions passed through */
+    if (offset + size > PCI_HEADER_TYPE && offset <= PCI_HEADER_TYPE) {
+        /* This read overlapped with the header type, work out where it is */
+        int header_offset = PCI_HEADER_TYPE - offset;
+        uint32_t mf_bit = BIT(7) << (header_offset * 8);
+        if (addr.fun == 0 && pci_is_multi_function(space, addr)) {
+            (*result) |= mf_bit;
+        } else {
+            (*result) &= ~mf_bit;
+        }
+    }
+    return 0;
+}
+
+int vmm_pci_config_write(vmm_pci_space_t *space, vmm_pci_address_t addr, int offset, int size, uint32_t value)
+{
+    vmm_pci_entry_t *dev = find_device(space, addr);
+    if (!dev) {
+        ZF_LOGI("Guest attempted access to non existent device %02x:%02x.%d register 0x%x", addr.bus, addr.dev,
+                addr.fun, offset);
+        return 0;
+    }
+    return dev->iowrite(dev->cookie, offset, size, value) ? -1 : 0;
 }
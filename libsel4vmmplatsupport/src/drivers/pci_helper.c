@@ -13,15 +13,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sel4/sel4.h>
 
 #include <pci/virtual_pci.h>
 #include <pci/helper.h>
 
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
 #define PCI_CAPABILITY_SPACE_OFFSET 0x40
 
+/* Guest memory behind a bar that the guest can move */
+struct pci_bar_backing {
+    vm_t *vm;
+    vmm_pci_bar_backing_t backing;
+    vm_memory_reservation_t *reservation;
+    size_t size;
+    /* Address the bar was created at, which is what the backing callbacks are given */
+    uintptr_t origin;
+    /* Where the guest currently has the bar */
+    uintptr_t address;
+};
+
 /* Read PCI memory device */
 int vmm_pci_mem_device_read(void *cookie, int offset, int size, uint32_t *result)
 {
@@ -110,9 +126,86 @@ void define_pci_host_bridge(vmm_pci_device_def_t *bridge)
     };
 }
 
+static bool passthrough_is_shadowed(pci_passthrough_device_t *dev, int offset, int size)
+{
+    if (offset < 0 || offset + size > VMM_PCI_CONFIG_SIZE) {
+        return false;
+    }
+    for (int i = offset; i < offset + size; i++) {
+        if (!(dev->shadowed[i / 64] & (1ULL << (i % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void passthrough_shadow_range(pci_passthrough_device_t *dev, int offset, int size)
+{
+    for (int i = offset; i < offset + size && i < VMM_PCI_CONFIG_SIZE; i++) {
+        dev->shadow[i] = dev->config.ioread8(dev->config.cookie, dev->addr, i);
+        dev->shadowed[i / 64] |= (1ULL << (i % 64));
+    }
+}
+
+/* Capture the registers that can't change while the guest owns the device */
+static void passthrough_shadow_init(pci_passthrough_device_t *dev)
+{
+    uint8_t header_type = dev->config.ioread8(dev->config.cookie, dev->addr, PCI_HEADER_TYPE) & ~BIT(7);
+    passthrough_shadow_range(dev, PCI_VENDOR_ID, 4);
+    passthrough_shadow_range(dev, PCI_CLASS_REVISION, 4);
+    passthrough_shadow_range(dev, PCI_HEADER_TYPE, 1);
+    passthrough_shadow_range(dev, PCI_INTERRUPT_PIN, 1);
+    if (header_type == PCI_HEADER_TYPE_NORMAL) {
+        /* These hold bridge windows and the bridge control in a type 1 header */
+        passthrough_shadow_range(dev, PCI_SUBSYSTEM_VENDOR_ID, 4);
+        passthrough_shadow_range(dev, PCI_MIN_GNT, 2);
+    }
+
+    uint16_t status = dev->config.ioread16(dev->config.cookie, dev->addr, PCI_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST) || header_type == PCI_HEADER_TYPE_CARDBUS) {
+        return;
+    }
+    passthrough_shadow_range(dev, PCI_CAPABILITY_LIST, 1);
+    uint8_t cap = dev->shadow[PCI_CAPABILITY_LIST] & ~MASK(2);
+    /* Bound the walk in case the list loops */
+    for (int i = 0; cap && i < VMM_PCI_CONFIG_SIZE / 4; i++) {
+        passthrough_shadow_range(dev, cap, 2);
+        switch (dev->shadow[cap]) {
+        case PCI_CAP_ID_PM:
+            /* Power management capabilities */
+            passthrough_shadow_range(dev, cap + 2, 2);
+            break;
+        case PCI_CAP_ID_EXP:
+            /* PCIe capabilities, device capabilities and link capabilities */
+            passthrough_shadow_range(dev, cap + 2, 2);
+            passthrough_shadow_range(dev, cap + 4, 4);
+            passthrough_shadow_range(dev, cap + 12, 4);
+            break;
+        case PCI_CAP_ID_MSIX:
+            /* Table and PBA locations */
+            passthrough_shadow_range(dev, cap + 4, 8);
+            break;
+        }
+        cap = dev->shadow[cap + 1] & ~MASK(2);
+    }
+}
+
 static int passthrough_pci_config_ioread(void *cookie, int offset, int size, uint32_t *result)
 {
     pci_passthrough_device_t *dev = (pci_passthrough_device_t *)cookie;
+    if (offset >= VMM_PCI_CONFIG_SIZE && !dev->config.extended) {
+        /* The host accessors would alias into the regular header. An empty extended
+         * capability header tells the guest there is nothing here */
+        *result = 0;
+        return 0;
+    }
+    if (passthrough_is_shadowed(dev, offset, size)) {
+        *result = 0;
+        memcpy(result, &dev->shadow[offset], size);
+        dev->shadow_hits++;
+        return 0;
+    }
+    dev->shadow_misses++;
     switch (size) {
     case 1:
         *result = dev->config.ioread8(dev->config.cookie, dev->addr, offset);
@@ -132,6 +225,9 @@ static int passthrough_pci_config_ioread(void *cookie, int offset, int size, uin
 static int passthrough_pci_config_iowrite(void *cookie, int offset, int size, uint32_t val)
 {
     pci_passthrough_device_t *dev = (pci_passthrough_device_t *)cookie;
+    if (offset >= VMM_PCI_CONFIG_SIZE && !dev->config.extended) {
+        return 0;
+    }
     switch (size) {
     case 1:
         dev->config.iowrite8(dev->config.cookie, dev->addr, offset, val);
@@ -156,13 +252,23 @@ static int pci_bar_emul_check_range(unsigned int offset, unsigned int size)
     return 0;
 }
 
+static uint32_t pci_bar_address_mask(vmm_pci_bar_t *bar)
+{
+    return ~(uint32_t)MASK(bar->size_bits);
+}
+
 static uint32_t pci_make_bar(pci_bar_emulation_t *emul, int bar)
 {
     if (bar >= emul->num_bars) {
         return 0;
     }
     uint32_t raw = 0;
-    raw |= emul->bars[bar].address;
+    if (emul->sizing[bar]) {
+        /* Only the bits that can hold an address read back as set, which gives the size */
+        raw |= pci_bar_address_mask(&emul->bars[bar]);
+    } else {
+        raw |= emul->bars[bar].address;
+    }
     if (!(emul->bars[bar].mem_type)) {
         raw |= 1;
     } else {
@@ -170,10 +276,77 @@ static uint32_t pci_make_bar(pci_bar_emulation_t *emul, int bar)
             raw |= BIT(3);
         }
     }
-    raw |= (emul->bar_writes[bar] & ~MASK(emul->bars[bar].size_bits));
     return raw;
 }
 
+static memory_fault_result_t pci_bar_backing_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                   size_t fault_length, void *cookie)
+{
+    struct pci_bar_backing *backing = (struct pci_bar_backing *)cookie;
+    return backing->backing.fault_callback(vm, vcpu, fault_addr - backing->address + backing->origin, fault_length,
+                                           backing->backing.fault_cookie);
+}
+
+static vm_frame_t pci_bar_backing_iterator(uintptr_t addr, void *cookie)
+{
+    struct pci_bar_backing *backing = (struct pci_bar_backing *)cookie;
+    vm_frame_t frame = backing->backing.map_iterator(addr - backing->address + backing->origin,
+                                                     backing->backing.map_cookie);
+    frame.vaddr = frame.vaddr - backing->origin + backing->address;
+    return frame;
+}
+
+static vm_memory_reservation_t *pci_bar_backing_reserve(struct pci_bar_backing *backing, uintptr_t address)
+{
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(backing->vm, address, backing->size,
+                                                                pci_bar_backing_fault, backing);
+    if (!reservation) {
+        return NULL;
+    }
+    /* The iterator maps relative to the current address */
+    uintptr_t old_address = backing->address;
+    backing->address = address;
+    if (backing->backing.map_iterator &&
+        vm_map_reservation(backing->vm, reservation, pci_bar_backing_iterator, backing)) {
+        backing->address = old_address;
+        vm_free_reserved_memory(backing->vm, reservation);
+        return NULL;
+    }
+    return reservation;
+}
+
+static int pci_bar_backing_move(struct pci_bar_backing *backing, uintptr_t address)
+{
+    /* A bar is aligned to its size, so the new location can't overlap the old one */
+    vm_memory_reservation_t *reservation = pci_bar_backing_reserve(backing, address);
+    if (!reservation) {
+        return -1;
+    }
+    if (vm_free_reserved_memory(backing->vm, backing->reservation)) {
+        ZF_LOGE("Failed to free the old reservation of a moved bar");
+    }
+    backing->reservation = reservation;
+    return 0;
+}
+
+/* Act on a completed write of a bar */
+static void pci_bar_emul_update(pci_bar_emulation_t *emul, int bar)
+{
+    vmm_pci_bar_t *pci_bar = &emul->bars[bar];
+    uint32_t address_mask = pci_bar_address_mask(pci_bar);
+    uint32_t address = emul->bar_writes[bar] & address_mask;
+
+    emul->sizing[bar] = address == address_mask;
+    if (emul->sizing[bar] || address == pci_bar->address) {
+        return;
+    }
+    if (!emul->backings[bar] || pci_bar_backing_move(emul->backings[bar], address)) {
+        ZF_LOGW("Unable to move bar %d from %p to %p", bar, (void *)pci_bar->address, (void *)(uintptr_t)address);
+        return;
+    }
+    pci_bar->address = address;
+}
+
 static int pci_irq_emul_read(void *cookie, int offset, int size, uint32_t *result)
 {
     pci_irq_emulation_t *emul = (pci_irq_emulation_t *)cookie;
@@ -233,6 +406,10 @@ static int pci_bar_emul_write(void *cookie, int offset, int size, uint32_t value
     int bar_offset = offset & 3;
     char *barp = (char *)&emul->bar_writes[bar];
     memcpy(barp + bar_offset, &value, size);
+    /* Only act once the top byte has been written, the guest may write the bar in parts */
+    if (bar < emul->num_bars && bar_offset + size == sizeof(uint32_t)) {
+        pci_bar_emul_update(emul, bar);
+    }
     return 0;
 }
 
@@ -261,6 +438,42 @@ vmm_pci_entry_t vmm_pci_create_bar_emulation(vmm_pci_entry_t existing, int num_b
     };
 }
 
+int vmm_pci_bar_emulation_add_backing(vm_t *vm, vmm_pci_entry_t entry, int bar, vmm_pci_bar_backing_t backing)
+{
+    if (entry.ioread != pci_bar_emul_read) {
+        ZF_LOGE("Entry is not a bar emulation");
+        return -1;
+    }
+    pci_bar_emulation_t *emul = (pci_bar_emulation_t *)entry.cookie;
+    if (bar < 0 || bar >= emul->num_bars || emul->bars[bar].mem_type == NON_MEM) {
+        ZF_LOGE("Bar %d is not a memory bar", bar);
+        return -1;
+    }
+    if (emul->backings[bar] || !backing.fault_callback) {
+        ZF_LOGE("Invalid backing for bar %d", bar);
+        return -1;
+    }
+
+    struct pci_bar_backing *bar_backing = calloc(1, sizeof(*bar_backing));
+    if (!bar_backing) {
+        ZF_LOGE("Failed to allocate bar backing");
+        return -1;
+    }
+    bar_backing->vm = vm;
+    bar_backing->backing = backing;
+    bar_backing->size = BIT(emul->bars[bar].size_bits);
+    bar_backing->origin = emul->bars[bar].address;
+    bar_backing->address = emul->bars[bar].address;
+    bar_backing->reservation = pci_bar_backing_reserve(bar_backing, bar_backing->address);
+    if (!bar_backing->reservation) {
+        ZF_LOGE("Failed to reserve bar %d at %p", bar, (void *)bar_backing->address);
+        free(bar_backing);
+        return -1;
+    }
+    emul->backings[bar] = bar_backing;
+    return 0;
+}
+
 vmm_pci_entry_t vmm_pci_create_passthrough_bar_emulation(vmm_pci_entry_t existing, int num_bars, vmm_pci_bar_t *bars)
 {
     pci_bar_emulation_t *bar_emul = calloc(1, sizeof(*bar_emul));
@@ -292,11 +505,25 @@ vmm_pci_entry_t vmm_pci_create_passthrough(vmm_pci_address_t addr, vmm_pci_confi
     dev->addr = addr;
     dev->config = config;
     ZF_LOGI("Creating passthrough device for %02x:%02x.%d", addr.bus, addr.dev, addr.fun);
+    passthrough_shadow_init(dev);
     return (vmm_pci_entry_t) {
         .cookie = dev, .ioread = passthrough_pci_config_ioread, .iowrite = passthrough_pci_config_iowrite
     };
 }
 
+void vmm_pci_passthrough_print_stats(vmm_pci_entry_t passthrough)
+{
+    if (passthrough.ioread != passthrough_pci_config_ioread) {
+        ZF_LOGE("Entry is not a passthrough device");
+        return;
+    }
+    pci_passthrough_device_t *dev = (pci_passthrough_device_t *)passthrough.cookie;
+    uint64_t total = dev->shadow_hits + dev->shadow_misses;
+    printf("Passthrough device %02x:%02x.%d config reads: %"PRIu64" from shadow, %"PRIu64" from host (%u%% shadowed)\n",
+           dev->addr.bus, dev->addr.dev, dev->addr.fun, dev->shadow_hits, dev->shadow_misses,
+           total ? (unsigned int)(dev->shadow_hits * 100 / total) : 0);
+}
+
 static int pci_cap_emul_read(void *cookie, int offset, int size, uint32_t *result)
 {
     pci_cap_emulation_t *emul = (pci_cap_emulation_t *)cookie;
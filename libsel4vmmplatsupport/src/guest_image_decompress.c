@@ -0,0 +1,794 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Streaming decompression of guest images.
+ *
+ * Output goes into a window of IMAGE_DECOMPRESS_CHUNK_SIZE bytes plus the
+ * history the format may refer back to (32KiB for deflate, 64KiB for LZ4).
+ * Whenever the window fills up it is handed to the output callback and all but
+ * the history is discarded, so the whole image is never held in memory.
+ *
+ * The inflate implementation follows the structure of zlib's puff.c.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/util.h>
+#include <utils/zf_log.h>
+#include <sel4vmmplatsupport/gen_config.h>
+
+#ifdef CONFIG_VMM_PLATSUPPORT_ZSTD_IMAGES
+#include <zstd.h>
+#endif
+
+#include "guest_image_decompress.h"
+
+#define GZIP_MAGIC0 0x1f
+#define GZIP_MAGIC1 0x8b
+#define GZIP_METHOD_DEFLATE 8
+#define GZIP_FHCRC    BIT(1)
+#define GZIP_FEXTRA   BIT(2)
+#define GZIP_FNAME    BIT(3)
+#define GZIP_FCOMMENT BIT(4)
+
+#define LZ4_FRAME_MAGIC      0x184D2204
+#define LZ4_LEGACY_MAGIC     0x184C2102
+#define LZ4_SKIPPABLE_MAGIC  0x184D2A50
+#define LZ4_SKIPPABLE_MASK   0xFFFFFFF0
+#define LZ4_FLG_VERSION(flg) ((flg) >> 6)
+#define LZ4_FLG_BLOCK_CHECKSUM   BIT(4)
+#define LZ4_FLG_CONTENT_SIZE     BIT(3)
+#define LZ4_FLG_CONTENT_CHECKSUM BIT(2)
+#define LZ4_FLG_DICT_ID          BIT(0)
+#define LZ4_BLOCK_UNCOMPRESSED   BIT(31)
+#define LZ4_MIN_MATCH 4
+
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+
+#define DEFLATE_HISTORY BIT(15)
+#define LZ4_HISTORY     BIT(16)
+
+#define IN_BUF_SIZE BIT(16)
+
+typedef struct decomp_state {
+    /* input */
+    int fd;
+    uint8_t *in;
+    size_t in_pos;
+    size_t in_len;
+    bool eof;
+    uint32_t bitbuf;
+    int bitcnt;
+
+    /* output window */
+    uint8_t *out;
+    size_t out_size;
+    size_t out_pos;
+    /* first byte of the window not yet handed to the callback */
+    size_t out_start;
+    size_t history;
+    /* bytes handed to the callback so far */
+    size_t total;
+    image_output_fn out_fn;
+    void *cookie;
+
+    bool error;
+} decomp_state_t;
+
+static int in_byte(decomp_state_t *s)
+{
+    if (s->in_pos == s->in_len) {
+        if (s->eof) {
+            return -1;
+        }
+        ssize_t len = read(s->fd, s->in, IN_BUF_SIZE);
+        if (len <= 0) {
+            s->eof = true;
+            return -1;
+        }
+        s->in_len = len;
+        s->in_pos = 0;
+    }
+    return s->in[s->in_pos++];
+}
+
+/* as in_byte, but running out of input is an error */
+static uint8_t need_byte(decomp_state_t *s)
+{
+    int byte = in_byte(s);
+    if (byte < 0) {
+        s->error = true;
+        return 0;
+    }
+    return byte;
+}
+
+static int in_u32(decomp_state_t *s, uint32_t *value)
+{
+    int byte = in_byte(s);
+    if (byte < 0) {
+        return -1;
+    }
+    *value = byte;
+    for (int i = 1; i < 4; i++) {
+        *value |= (uint32_t)need_byte(s) << (8 * i);
+    }
+    return s->error ? -1 : 0;
+}
+
+static void in_skip(decomp_state_t *s, size_t len)
+{
+    while (len-- && !s->error) {
+        need_byte(s);
+    }
+}
+
+static void out_flush(decomp_state_t *s)
+{
+    if (s->out_pos == s->out_start) {
+        return;
+    }
+    if (s->out_fn(s->cookie, s->total, s->out + s->out_start, s->out_pos - s->out_start)) {
+        ZF_LOGE("Failed to write decompressed image at offset %zu", s->total);
+        s->error = true;
+    }
+    s->total += s->out_pos - s->out_start;
+
+    /* keep only what later data may refer back to */
+    size_t keep = MIN(s->history, s->out_pos);
+    memmove(s->out, s->out + s->out_pos - keep, keep);
+    s->out_pos = keep;
+    s->out_start = keep;
+}
+
+static void out_byte(decomp_state_t *s, uint8_t byte)
+{
+    if (s->out_pos == s->out_size) {
+        out_flush(s);
+    }
+    s->out[s->out_pos++] = byte;
+}
+
+static void out_copy(decomp_state_t *s, size_t dist, size_t len)
+{
+    if (dist == 0 || dist > s->out_pos || dist > s->history) {
+        ZF_LOGE("Invalid back reference distance %zu", dist);
+        s->error = true;
+        return;
+    }
+    while (len--) {
+        if (s->out_pos == s->out_size) {
+            out_flush(s);
+        }
+        s->out[s->out_pos] = s->out[s->out_pos - dist];
+        s->out_pos++;
+    }
+}
+
+/* Deflate */
+
+#define MAXBITS   15
+#define MAXLCODES 286
+#define MAXDCODES 30
+#define MAXCODES  (MAXLCODES + MAXDCODES)
+#define FIXLCODES 288
+
+struct huffman {
+    short count[MAXBITS + 1];
+    short symbol[FIXLCODES];
+};
+
+static const short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const short length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const short dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static int bits(decomp_state_t *s, int need)
+{
+    uint32_t val = s->bitbuf;
+    while (s->bitcnt < need) {
+        val |= (uint32_t)need_byte(s) << s->bitcnt;
+        s->bitcnt += 8;
+    }
+    s->bitbuf = val >> need;
+    s->bitcnt -= need;
+    return val & (BIT(need) - 1);
+}
+
+static int huffman_decode(decomp_state_t *s, const struct huffman *h)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= MAXBITS && !s->error; len++) {
+        code |= bits(s, 1);
+        int count = h->count[len];
+        if (code - count < first) {
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    s->error = true;
+    return -1;
+}
+
+/* Build a canonical huffman decoding table, returns -1 if the code is over-subscribed */
+static int huffman_construct(struct huffman *h, const short *length, int n)
+{
+    short offs[MAXBITS + 1];
+
+    memset(h->count, 0, sizeof(h->count));
+    for (int symbol = 0; symbol < n; symbol++) {
+        h->count[length[symbol]]++;
+    }
+    if (h->count[0] == n) {
+        return 0;
+    }
+
+    int left = 1;
+    for (int len = 1; len <= MAXBITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) {
+            return -1;
+        }
+    }
+
+    offs[1] = 0;
+    for (int len = 1; len < MAXBITS; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+    for (int symbol = 0; symbol < n; symbol++) {
+        if (length[symbol] != 0) {
+            h->symbol[offs[length[symbol]]++] = symbol;
+        }
+    }
+    return 0;
+}
+
+static int inflate_stored(decomp_state_t *s)
+{
+    /* discard the rest of the current byte */
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+
+    unsigned len = need_byte(s);
+    len |= need_byte(s) << 8;
+    unsigned nlen = need_byte(s);
+    nlen |= need_byte(s) << 8;
+    if (s->error || len != (~nlen & 0xffff)) {
+        ZF_LOGE("Invalid stored block length");
+        return -1;
+    }
+    while (len-- && !s->error) {
+        out_byte(s, need_byte(s));
+    }
+    return s->error ? -1 : 0;
+}
+
+static int inflate_codes(decomp_state_t *s, const struct huffman *lencode, const struct huffman *distcode)
+{
+    int symbol;
+    do {
+        symbol = huffman_decode(s, lencode);
+        if (s->error) {
+            return -1;
+        }
+        if (symbol < 256) {
+            out_byte(s, symbol);
+        } else if (symbol > 256) {
+            symbol -= 257;
+            if (symbol >= ARRAY_SIZE(length_base)) {
+                return -1;
+            }
+            int len = length_base[symbol] + bits(s, length_extra[symbol]);
+            symbol = huffman_decode(s, distcode);
+            if (s->error || symbol < 0 || symbol >= ARRAY_SIZE(dist_base)) {
+                return -1;
+            }
+            int dist = dist_base[symbol] + bits(s, dist_extra[symbol]);
+            out_copy(s, dist, len);
+        }
+    } while (symbol != 256 && !s->error);
+    return s->error ? -1 : 0;
+}
+
+static int inflate_fixed(decomp_state_t *s)
+{
+    /* built on the stack, images may be loaded from several threads at once */
+    struct huffman lencode, distcode;
+    short lengths[FIXLCODES];
+    int symbol;
+
+    for (symbol = 0; symbol < 144; symbol++) {
+        lengths[symbol] = 8;
+    }
+    for (; symbol < 256; symbol++) {
+        lengths[symbol] = 9;
+    }
+    for (; symbol < 280; symbol++) {
+        lengths[symbol] = 7;
+    }
+    for (; symbol < FIXLCODES; symbol++) {
+        lengths[symbol] = 8;
+    }
+    huffman_construct(&lencode, lengths, FIXLCODES);
+    for (symbol = 0; symbol < MAXDCODES; symbol++) {
+        lengths[symbol] = 5;
+    }
+    huffman_construct(&distcode, lengths, MAXDCODES);
+
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static int inflate_dynamic(decomp_state_t *s)
+{
+    static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    short lengths[MAXCODES];
+    struct huffman lencode, distcode;
+
+    int nlen = bits(s, 5) + 257;
+    int ndist = bits(s, 5) + 1;
+    int ncode = bits(s, 4) + 4;
+    if (s->error || nlen > MAXLCODES || ndist > MAXDCODES) {
+        return -1;
+    }
+
+    int index;
+    for (index = 0; index < ncode; index++) {
+        lengths[order[index]] = bits(s, 3);
+    }
+    for (; index < 19; index++) {
+        lengths[order[index]] = 0;
+    }
+    if (huffman_construct(&lencode, lengths, 19)) {
+        return -1;
+    }
+
+    index = 0;
+    while (index < nlen + ndist) {
+        int symbol = huffman_decode(s, &lencode);
+        if (s->error || symbol < 0) {
+            return -1;
+        }
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+        short len = 0;
+        if (symbol == 16) {
+            if (index == 0) {
+                return -1;
+            }
+            len = lengths[index - 1];
+            symbol = 3 + bits(s, 2);
+        } else if (symbol == 17) {
+            symbol = 3 + bits(s, 3);
+        } else {
+            symbol = 11 + bits(s, 7);
+        }
+        if (index + symbol > nlen + ndist) {
+            return -1;
+        }
+        while (symbol--) {
+            lengths[index++] = len;
+        }
+    }
+
+    /* there has to be an end-of-block code */
+    if (lengths[256] == 0) {
+        return -1;
+    }
+    if (huffman_construct(&lencode, lengths, nlen) || huffman_construct(&distcode, lengths + nlen, ndist)) {
+        return -1;
+    }
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static int inflate(decomp_state_t *s)
+{
+    int last;
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    do {
+        int err;
+        last = bits(s, 1);
+        switch (bits(s, 2)) {
+        case 0:
+            err = inflate_stored(s);
+            break;
+        case 1:
+            err = inflate_fixed(s);
+            break;
+        case 2:
+            err = inflate_dynamic(s);
+            break;
+        default:
+            err = -1;
+        }
+        if (err || s->error) {
+            ZF_LOGE("Corrupt deflate stream");
+            return -1;
+        }
+    } while (!last);
+
+    /* the member trailer starts at the next byte boundary */
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    return 0;
+}
+
+static int gzip_decompress(decomp_state_t *s)
+{
+    int members = 0;
+    s->history = DEFLATE_HISTORY;
+
+    while (1) {
+        int magic0 = in_byte(s);
+        int magic1 = in_byte(s);
+        if (magic0 != GZIP_MAGIC0 || magic1 != GZIP_MAGIC1) {
+            /* end of input, or padding after the last member */
+            if (members > 0) {
+                return 0;
+            }
+            ZF_LOGE("Not a gzip image");
+            return -1;
+        }
+        if (need_byte(s) != GZIP_METHOD_DEFLATE) {
+            ZF_LOGE("Unsupported gzip compression method");
+            return -1;
+        }
+        uint8_t flags = need_byte(s);
+        /* mtime, extra flags and os */
+        in_skip(s, 6);
+        if (flags & GZIP_FEXTRA) {
+            size_t xlen = need_byte(s);
+            xlen |= need_byte(s) << 8;
+            in_skip(s, xlen);
+        }
+        if (flags & GZIP_FNAME) {
+            while (need_byte(s) && !s->error);
+        }
+        if (flags & GZIP_FCOMMENT) {
+            while (need_byte(s) && !s->error);
+        }
+        if (flags & GZIP_FHCRC) {
+            in_skip(s, 2);
+        }
+        if (s->error) {
+            ZF_LOGE("Truncated gzip header");
+            return -1;
+        }
+
+        size_t member_start = s->total + s->out_pos - s->out_start;
+        if (inflate(s)) {
+            return -1;
+        }
+
+        /* crc32 is not checked, but the size is */
+        uint32_t crc, isize;
+        if (in_u32(s, &crc) || in_u32(s, &isize)) {
+            ZF_LOGE("Truncated gzip trailer");
+            return -1;
+        }
+        if (isize != (uint32_t)(s->total + s->out_pos - s->out_start - member_start)) {
+            ZF_LOGE("gzip size mismatch");
+            return -1;
+        }
+        members++;
+    }
+}
+
+/* LZ4 */
+
+static int lz4_block(decomp_state_t *s, size_t remaining)
+{
+#define LZ4_NEXT() (remaining-- ? need_byte(s) : (s->error = true, 0))
+    while (remaining > 0 && !s->error) {
+        uint8_t token = LZ4_NEXT();
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t byte;
+            do {
+                byte = LZ4_NEXT();
+                literals += byte;
+            } while (byte == 255 && !s->error);
+        }
+        if (literals > remaining) {
+            s->error = true;
+            break;
+        }
+        remaining -= literals;
+        while (literals--) {
+            out_byte(s, need_byte(s));
+        }
+
+        /* the last sequence has only literals */
+        if (remaining == 0) {
+            break;
+        }
+
+        size_t offset = LZ4_NEXT();
+        offset |= LZ4_NEXT() << 8;
+        size_t match = token & 0xf;
+        if (match == 15) {
+            uint8_t byte;
+            do {
+                byte = LZ4_NEXT();
+                match += byte;
+            } while (byte == 255 && !s->error);
+        }
+        if (!s->error) {
+            out_copy(s, offset, match + LZ4_MIN_MATCH);
+        }
+    }
+#undef LZ4_NEXT
+    if (s->error) {
+        ZF_LOGE("Corrupt LZ4 block");
+        return -1;
+    }
+    return 0;
+}
+
+static int lz4_frame(decomp_state_t *s)
+{
+    uint8_t flg = need_byte(s);
+    /* block descriptor */
+    need_byte(s);
+    if (LZ4_FLG_VERSION(flg) != 1) {
+        ZF_LOGE("Unsupported LZ4 frame version");
+        return -1;
+    }
+    if (flg & LZ4_FLG_CONTENT_SIZE) {
+        in_skip(s, 8);
+    }
+    if (flg & LZ4_FLG_DICT_ID) {
+        in_skip(s, 4);
+    }
+    /* header checksum */
+    need_byte(s);
+
+    while (!s->error) {
+        uint32_t size;
+        if (in_u32(s, &size)) {
+            ZF_LOGE("Truncated LZ4 frame");
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (size & LZ4_BLOCK_UNCOMPRESSED) {
+            size &= ~LZ4_BLOCK_UNCOMPRESSED;
+            while (size-- && !s->error) {
+                out_byte(s, need_byte(s));
+            }
+        } else if (lz4_block(s, size)) {
+            return -1;
+        }
+        if (flg & LZ4_FLG_BLOCK_CHECKSUM) {
+            in_skip(s, 4);
+        }
+    }
+    if (flg & LZ4_FLG_CONTENT_CHECKSUM) {
+        in_skip(s, 4);
+    }
+    return s->error ? -1 : 0;
+}
+
+/* The legacy format (lz4 -l) is what the Linux build uses for LZ4 compressed images */
+static int lz4_legacy(decomp_state_t *s, uint32_t *next_magic)
+{
+    uint32_t size;
+    while (in_u32(s, &size) == 0) {
+        /* legacy frames have no end mark, they end where another frame starts */
+        if (size == LZ4_LEGACY_MAGIC || size == LZ4_FRAME_MAGIC ||
+            (size & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+            *next_magic = size;
+            return 1;
+        }
+        if (lz4_block(s, size)) {
+            return -1;
+        }
+    }
+    return s->error ? -1 : 0;
+}
+
+static int lz4_decompress(decomp_state_t *s)
+{
+    int frames = 0;
+    uint32_t magic;
+    s->history = LZ4_HISTORY;
+
+    if (in_u32(s, &magic)) {
+        return -1;
+    }
+    while (1) {
+        if (magic == LZ4_LEGACY_MAGIC) {
+            int ret = lz4_legacy(s, &magic);
+            if (ret <= 0) {
+                return ret;
+            }
+            frames++;
+            continue;
+        } else if (magic == LZ4_FRAME_MAGIC) {
+            if (lz4_frame(s)) {
+                return -1;
+            }
+        } else if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+            uint32_t size;
+            if (in_u32(s, &size)) {
+                return -1;
+            }
+            in_skip(s, size);
+        } else if (frames > 0) {
+            /* padding after the last frame */
+            return 0;
+        } else {
+            ZF_LOGE("Not an LZ4 image");
+            return -1;
+        }
+        frames++;
+        if (in_u32(s, &magic)) {
+            return s->error ? -1 : 0;
+        }
+    }
+}
+
+/* zstd */
+
+#ifdef CONFIG_VMM_PLATSUPPORT_ZSTD_IMAGES
+static int zstd_decompress(decomp_state_t *s)
+{
+    ZSTD_DStream *zds = ZSTD_createDStream();
+    if (!zds) {
+        ZF_LOGE("Failed to create zstd stream");
+        return -1;
+    }
+    ZSTD_initDStream(zds);
+
+    /* zstd keeps its own window, so none of the output needs to be kept */
+    s->history = 0;
+    size_t ret = 1;
+    bool eof = false;
+    while (1) {
+        if (s->in_pos == s->in_len && !eof) {
+            ssize_t len = read(s->fd, s->in, IN_BUF_SIZE);
+            if (len <= 0) {
+                if (ret == 0) {
+                    /* the last frame is complete */
+                    break;
+                }
+                /* zstd may still hold output, so keep going with no input
+                 * until it has all been flushed */
+                eof = true;
+                len = 0;
+            }
+            s->in_len = len;
+            s->in_pos = 0;
+        }
+        ZSTD_inBuffer input = { s->in, s->in_len, s->in_pos };
+        ZSTD_outBuffer output = { s->out + s->out_pos, s->out_size - s->out_pos, 0 };
+        ret = ZSTD_decompressStream(zds, &output, &input);
+        if (ZSTD_isError(ret)) {
+            ZF_LOGE("Corrupt zstd image: %s", ZSTD_getErrorName(ret));
+            ZSTD_freeDStream(zds);
+            return -1;
+        }
+        s->in_pos = input.pos;
+        s->out_pos += output.pos;
+        if (s->out_pos == s->out_size) {
+            out_flush(s);
+        }
+        if (s->error) {
+            break;
+        }
+        if (eof && (ret == 0 || output.pos == 0)) {
+            /* flushed, or no more progress can be made without input */
+            break;
+        }
+    }
+    ZSTD_freeDStream(zds);
+
+    if (ret != 0) {
+        ZF_LOGE("Truncated zstd image");
+        return -1;
+    }
+    return s->error ? -1 : 0;
+}
+#endif
+
+enum image_compression image_get_compression(const void *header, size_t len)
+{
+    const uint8_t *bytes = header;
+    if (len < sizeof(uint32_t)) {
+        return IMAGE_COMPRESSION_NONE;
+    }
+    uint32_t magic = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+
+    if (bytes[0] == GZIP_MAGIC0 && bytes[1] == GZIP_MAGIC1 && bytes[2] == GZIP_METHOD_DEFLATE) {
+        return IMAGE_COMPRESSION_GZIP;
+    } else if (magic == LZ4_FRAME_MAGIC || magic == LZ4_LEGACY_MAGIC) {
+        return IMAGE_COMPRESSION_LZ4;
+    } else if (magic == ZSTD_FRAME_MAGIC) {
+        return IMAGE_COMPRESSION_ZSTD;
+    }
+    return IMAGE_COMPRESSION_NONE;
+}
+
+int image_decompress(int fd, enum image_compression compression, image_output_fn out, void *cookie,
+                     size_t *image_size)
+{
+    decomp_state_t s = {
+        .fd = fd,
+        .out_fn = out,
+        .cookie = cookie,
+    };
+    /* room for a full chunk on top of the largest history */
+    s.out_size = IMAGE_DECOMPRESS_CHUNK_SIZE + LZ4_HISTORY;
+    s.in = malloc(IN_BUF_SIZE);
+    s.out = malloc(s.out_size);
+    if (!s.in || !s.out) {
+        ZF_LOGE("Failed to allocate decompression buffers");
+        free(s.in);
+        free(s.out);
+        return -1;
+    }
+
+    int err;
+    switch (compression) {
+    case IMAGE_COMPRESSION_GZIP:
+        err = gzip_decompress(&s);
+        break;
+    case IMAGE_COMPRESSION_LZ4:
+        err = lz4_decompress(&s);
+        break;
+#ifdef CONFIG_VMM_PLATSUPPORT_ZSTD_IMAGES
+    case IMAGE_COMPRESSION_ZSTD:
+        err = zstd_decompress(&s);
+        break;
+#endif
+    default:
+        ZF_LOGE("Unsupported image compression %d", compression);
+        err = -1;
+    }
+
+    if (!err) {
+        out_flush(&s);
+        err = s.error ? -1 : 0;
+    }
+    free(s.in);
+    free(s.out);
+    if (!err && image_size) {
+        *image_size = s.total;
+    }
+    return err;
+}
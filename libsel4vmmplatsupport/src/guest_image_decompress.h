@@ -0,0 +1,49 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utils/util.h>
+
+enum image_compression {
+    IMAGE_COMPRESSION_NONE,
+    IMAGE_COMPRESSION_GZIP,
+    IMAGE_COMPRESSION_LZ4,
+    IMAGE_COMPRESSION_ZSTD,
+};
+
+/* Approximate size of the chunks handed to the output callback */
+#define IMAGE_DECOMPRESS_CHUNK_SIZE BIT(20)
+
+/*
+ * Called with consecutive chunks of the decompressed image.
+ * @param cookie    User supplied cookie
+ * @param offset    Offset of data within the decompressed image
+ * @param data      Decompressed data, only valid for the duration of the call
+ * @param len       Length of data
+ * @return          0 on success, otherwise decompression is aborted
+ */
+typedef int (*image_output_fn)(void *cookie, size_t offset, const void *data, size_t len);
+
+/* Identify the compression format of an image from its first 'len' bytes */
+enum image_compression image_get_compression(const void *header, size_t len);
+
+/*
+ * Decompress the image in fd, read from its current position, streaming the
+ * output through 'out'. Only a chunk sized output window and a small input
+ * buffer are used, never a buffer the size of the whole image.
+ * @return 0 on success, -1 on a corrupt or unsupported image or if 'out' failed
+ */
+int image_decompress(int fd, enum image_compression compression, image_output_fn out, void *cookie,
+                     size_t *image_size);
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Concurrent loading of guest images. A reader walks the extents of every
+ * image in round robin order, reading chunks into a small ring of buffers.
+ * The calling thread, which owns the vka and vspace needed to map guest RAM,
+ * copies completed chunks into the guest. With a reader thread the file reads
+ * overlap the mapping and copying; without one the calling thread alternates
+ * between the two. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <utils/fence.h>
+#include <utils/util.h>
+#include <utils/zf_log.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/boot_timing.h>
+
+#include <sel4vmmplatsupport/guest_image.h>
+
+#include "guest_image_loader.h"
+
+typedef struct loader_image {
+    guest_image_load_request_t *request;
+    guest_image_extent_t extents[GUEST_IMAGE_MAX_EXTENTS];
+    int num_extents;
+    int fd;
+    /* Read position: the current extent and the offset within it */
+    int extent;
+    size_t extent_offset;
+    uint64_t start;
+} loader_image_t;
+
+typedef struct loader_chunk {
+    loader_image_t *image;
+    uintptr_t paddr;
+    /* Bytes of data in the buffer, followed by zero_len bytes of zeros */
+    size_t len;
+    size_t zero_len;
+    /* The final chunk of its image */
+    bool last;
+    char *data;
+} loader_chunk_t;
+
+typedef struct image_loader {
+    vm_t *vm;
+    guest_image_load_ops_t *ops;
+    loader_image_t *images;
+    int num_images;
+    int next_image;
+    size_t chunk_size;
+    loader_chunk_t chunks[GUEST_IMAGE_LOAD_BUFFERS];
+    /* Chunks are produced at head by the reader and consumed at tail */
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    bool threaded;
+    volatile bool abort;
+    volatile bool reader_done;
+    volatile bool reader_error;
+} image_loader_t;
+
+static uint64_t loader_clock(image_loader_t *loader)
+{
+    return loader->ops->clock ? loader->ops->clock(loader->ops->cookie) : 0;
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t result = read(fd, buf, len);
+        if (result <= 0) {
+            return -1;
+        }
+        buf += result;
+        len -= result;
+    }
+    return 0;
+}
+
+/* Read the next chunk of the next image with work left into the ring.
+ * Returns 1 if a chunk was produced, 0 if every image has been read and -1 on error */
+static int loader_read_chunk(image_loader_t *loader)
+{
+    loader_image_t *image = NULL;
+    for (int i = 0; i < loader->num_images; i++) {
+        int index = (loader->next_image + i) % loader->num_images;
+        if (loader->images[index].extent < loader->images[index].num_extents) {
+            image = &loader->images[index];
+            loader->next_image = (index + 1) % loader->num_images;
+            break;
+        }
+    }
+    if (!image) {
+        return 0;
+    }
+
+    loader_chunk_t *chunk = &loader->chunks[loader->head % GUEST_IMAGE_LOAD_BUFFERS];
+    guest_image_extent_t *extent = &image->extents[image->extent];
+    if (image->extent == 0 && image->extent_offset == 0) {
+        image->start = loader_clock(loader);
+    }
+
+    if (image->extent_offset < extent->file_size) {
+        if (image->extent_offset == 0 && lseek(image->fd, extent->file_offset, SEEK_SET) < 0) {
+            ZF_LOGE("Failed to seek in \"%s\"", image->request->name);
+            return -1;
+        }
+        chunk->paddr = extent->paddr + image->extent_offset;
+        chunk->len = MIN(loader->chunk_size, extent->file_size - image->extent_offset);
+        chunk->zero_len = 0;
+        if (read_full(image->fd, chunk->data, chunk->len)) {
+            ZF_LOGE("Failed to read \"%s\"", image->request->name);
+            return -1;
+        }
+        image->extent_offset += chunk->len;
+    } else {
+        /* The zero filled tail of the extent needs no buffer space */
+        chunk->paddr = extent->paddr + extent->file_size;
+        chunk->len = 0;
+        chunk->zero_len = extent->mem_size - extent->file_size;
+        image->extent_offset = extent->mem_size;
+    }
+    if (image->extent_offset >= extent->mem_size) {
+        image->extent++;
+        image->extent_offset = 0;
+    }
+    chunk->image = image;
+    chunk->last = image->extent == image->num_extents;
+
+    /* The chunk must be complete before it is published */
+    THREAD_MEMORY_RELEASE();
+    loader->head++;
+    return 1;
+}
+
+static void loader_reader(void *arg)
+{
+    image_loader_t *loader = arg;
+    guest_image_load_ops_t *ops = loader->ops;
+
+    while (!loader->abort) {
+        if (loader->head - loader->tail == GUEST_IMAGE_LOAD_BUFFERS) {
+            ops->wait(ops->cookie, GUEST_IMAGE_LOAD_DRAINED);
+            continue;
+        }
+        /* The copier must be finished with a buffer before it is refilled */
+        THREAD_MEMORY_ACQUIRE();
+        int produced = loader_read_chunk(loader);
+        if (produced <= 0) {
+            loader->reader_error = produced < 0;
+            break;
+        }
+        ops->signal(ops->cookie, GUEST_IMAGE_LOAD_FILLED);
+    }
+    THREAD_MEMORY_RELEASE();
+    loader->reader_done = true;
+    ops->signal(ops->cookie, GUEST_IMAGE_LOAD_FILLED);
+}
+
+static int loader_copy_chunk(image_loader_t *loader, loader_chunk_t *chunk)
+{
+    int err;
+    vm_ram_mark_allocated(loader->vm, chunk->paddr, chunk->len + chunk->zero_len);
+    if (chunk->len) {
+        err = vm_ram_touch_batch(loader->vm, chunk->paddr, chunk->len, guest_image_arch_write, chunk->data);
+        if (err) {
+            return err;
+        }
+    }
+    if (chunk->zero_len) {
+        err = vm_ram_touch_batch(loader->vm, chunk->paddr + chunk->len, chunk->zero_len, guest_image_arch_write,
+                                 NULL);
+        if (err) {
+            return err;
+        }
+    }
+    if (chunk->last) {
+        chunk->image->request->load_time = loader_clock(loader) - chunk->image->start;
+    }
+    return 0;
+}
+
+/* Returns once every chunk has been copied, or on error */
+static int loader_copy(image_loader_t *loader)
+{
+    guest_image_load_ops_t *ops = loader->ops;
+
+    while (1) {
+        if (loader->tail == loader->head) {
+            if (!loader->threaded) {
+                int produced = loader_read_chunk(loader);
+                if (produced <= 0) {
+                    return produced;
+                }
+            } else if (loader->reader_done) {
+                THREAD_MEMORY_ACQUIRE();
+                if (loader->tail == loader->head) {
+                    return loader->reader_error ? -1 : 0;
+                }
+            } else {
+                ops->wait(ops->cookie, GUEST_IMAGE_LOAD_FILLED);
+            }
+            continue;
+        }
+        THREAD_MEMORY_ACQUIRE();
+        loader_chunk_t *chunk = &loader->chunks[loader->tail % GUEST_IMAGE_LOAD_BUFFERS];
+        int err = loader_copy_chunk(loader, chunk);
+        if (err) {
+            ZF_LOGE("Failed to load \"%s\" into guest RAM", chunk->image->request->name);
+            return -1;
+        }
+        THREAD_MEMORY_RELEASE();
+        loader->tail++;
+        if (loader->threaded) {
+            ops->signal(ops->cookie, GUEST_IMAGE_LOAD_DRAINED);
+        }
+    }
+}
+
+static int load_image_directly(vm_t *vm, guest_image_load_request_t *request, image_loader_t *loader)
+{
+    int err;
+    uint64_t start = loader_clock(loader);
+    if (request->is_kernel) {
+        err = vm_load_guest_kernel(vm, request->name, request->load_address, request->alignment,
+                                   request->kernel_image);
+    } else {
+        err = vm_load_guest_module(vm, request->name, request->load_address, request->alignment, request->image);
+    }
+    request->load_time = loader_clock(loader) - start;
+    return err;
+}
+
+static char *alloc_chunk_buffers(size_t *chunk_size)
+{
+    /* Reduce the chunk size if there isn't enough memory available */
+    for (size_t size = VM_RAM_TOUCH_BATCH_PAGES * PAGE_SIZE_4K; size >= PAGE_SIZE_4K; size /= 2) {
+        char *buffers = malloc(size * GUEST_IMAGE_LOAD_BUFFERS);
+        if (buffers) {
+            *chunk_size = size;
+            return buffers;
+        }
+    }
+    return NULL;
+}
+
+static int load_guest_images(vm_t *vm, guest_image_load_request_t *requests, int num_requests,
+                             guest_image_load_ops_t *ops)
+{
+    int err = 0;
+    image_loader_t loader = {
+        .vm = vm,
+        .ops = ops,
+    };
+
+    if (!vm || !requests || !ops) {
+        ZF_LOGE("Invalid arguments");
+        return -1;
+    }
+
+    loader.images = calloc(num_requests, sizeof(loader_image_t));
+    if (!loader.images) {
+        ZF_LOGE("Failed to allocate image state");
+        return -1;
+    }
+
+    for (int i = 0; i < num_requests && !err; i++) {
+        loader_image_t *image = &loader.images[loader.num_images];
+        image->request = &requests[i];
+        int num_extents = guest_image_arch_plan(vm, &requests[i], image->extents, GUEST_IMAGE_MAX_EXTENTS);
+        if (num_extents < 0) {
+            err = -1;
+        } else if (num_extents == 0) {
+            err = load_image_directly(vm, &requests[i], &loader);
+        } else {
+            image->num_extents = num_extents;
+            image->fd = open(requests[i].name, 0);
+            if (image->fd == -1) {
+                ZF_LOGE("Error: Unable to open image \"%s\"", requests[i].name);
+                err = -1;
+            } else {
+                loader.num_images++;
+            }
+        }
+    }
+
+    char *buffers = NULL;
+    if (!err && loader.num_images) {
+        buffers = alloc_chunk_buffers(&loader.chunk_size);
+        if (!buffers) {
+            ZF_LOGE("Not enough memory for image buffers");
+            err = -1;
+        }
+    }
+
+    if (!err && loader.num_images) {
+        for (int i = 0; i < GUEST_IMAGE_LOAD_BUFFERS; i++) {
+            loader.chunks[i].data = buffers + i * loader.chunk_size;
+        }
+        if (ops->start_reader && ops->signal && ops->wait) {
+            loader.threaded = !ops->start_reader(ops->cookie, loader_reader, &loader);
+            if (!loader.threaded) {
+                ZF_LOGW("Failed to start image reader, reading on the calling thread");
+            }
+        }
+        err = loader_copy(&loader);
+        if (loader.threaded) {
+            /* The reader must stop before its buffers go away */
+            loader.abort = true;
+            ops->signal(ops->cookie, GUEST_IMAGE_LOAD_DRAINED);
+            while (!loader.reader_done) {
+                ops->wait(ops->cookie, GUEST_IMAGE_LOAD_FILLED);
+            }
+        }
+    }
+
+    for (int i = 0; i < loader.num_images; i++) {
+        loader_image_t *image = &loader.images[i];
+        close(image->fd);
+        if (!err) {
+            err = guest_image_arch_finish(vm, image->request, image->extents, image->num_extents);
+        }
+    }
+
+    if (!err && ops->clock) {
+        for (int i = 0; i < num_requests; i++) {
+            ZF_LOGI("Loaded \"%s\" in %"PRIu64" ticks", requests[i].name, requests[i].load_time);
+        }
+    }
+
+    free(buffers);
+    free(loader.images);
+    return err ? -1 : 0;
+}
+
+int vm_load_guest_images(vm_t *vm, guest_image_load_request_t *requests, int num_requests,
+                         guest_image_load_ops_t *ops)
+{
+    vm_boot_phase_begin(vm, VM_BOOT_PHASE_IMAGE_LOAD);
+    int err = load_guest_images(vm, requests, num_requests, ops);
+    vm_boot_phase_end(vm, VM_BOOT_PHASE_IMAGE_LOAD);
+    return err;
+}
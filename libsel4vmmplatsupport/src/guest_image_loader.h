@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vmmplatsupport/guest_image.h>
+
+/* Most extents a single image may be split into */
+#define GUEST_IMAGE_MAX_EXTENTS 16
+
+/* A contiguous part of an image file and where it belongs in guest RAM. Any
+ * memory beyond file_size up to mem_size is zero filled. */
+typedef struct guest_image_extent {
+    size_t file_offset;
+    uintptr_t paddr;
+    size_t file_size;
+    size_t mem_size;
+} guest_image_extent_t;
+
+/*
+ * Work out where the extents of an image go in guest RAM, filling in any load
+ * results that are already known.
+ * @return number of extents, 0 if the image cannot be streamed and should be
+ *         loaded with vm_load_guest_kernel/vm_load_guest_module, -1 on error
+ */
+int guest_image_arch_plan(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                          int max_extents);
+
+/* Finish loading an image once all of its extents are in guest RAM */
+int guest_image_arch_finish(vm_t *vm, guest_image_load_request_t *request, guest_image_extent_t *extents,
+                            int num_extents);
+
+/* ram_touch_callback_fn copying 'cookie' + offset into guest RAM, or zero
+ * filling it if 'cookie' is NULL, with any cache maintenance the platform needs */
+int guest_image_arch_write(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie);
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <stddef.h>
+
+#include "idmac.h"
+
+bool idmac_range_within(uintptr_t start, size_t size, uintptr_t addr, size_t len)
+{
+    return addr >= start && addr - start <= size && len <= size - (addr - start);
+}
+
+static bool idmac_buffer(uint32_t addr, uint32_t len, uint32_t *out, idmac_translate_fn translate, void *cookie)
+{
+    if (len == 0) {
+        *out = 0;
+        return true;
+    }
+    *out = translate(cookie, addr, len);
+    return *out != 0;
+}
+
+int idmac_shadow_build(const struct idmac_desc *guest, struct idmac_desc *shadow, bool *rejected,
+                       uintptr_t guest_base, uintptr_t shadow_base, idmac_translate_fn translate, void *cookie)
+{
+    bool valid = true;
+
+    for (size_t i = 0; i < IDMAC_NUM_DESC; i++) {
+        const struct idmac_desc *g = &guest[i];
+        struct idmac_desc desc = { .des0 = g->des0, .des1 = g->des1 };
+        rejected[i] = false;
+        if (g->des0 & IDMAC_DES0_OWN) {
+            valid = valid && idmac_buffer(g->des2, IDMAC_DES1_BS1(g->des1), &desc.des2, translate, cookie);
+            if (g->des0 & IDMAC_DES0_CH) {
+                /* The next descriptor must be within the shadowed list */
+                uintptr_t next = g->des3 - guest_base;
+                valid = valid && next < IDMAC_NUM_DESC * sizeof(struct idmac_desc) &&
+                        !(next % sizeof(struct idmac_desc));
+                desc.des3 = shadow_base + next;
+            } else {
+                valid = valid && idmac_buffer(g->des3, IDMAC_DES1_BS2(g->des1), &desc.des3, translate, cookie);
+            }
+        }
+        if (i == IDMAC_NUM_DESC - 1) {
+            /* Never let the controller walk off the end of the shadow */
+            desc.des0 |= IDMAC_DES0_ER;
+        }
+        shadow[i] = desc;
+    }
+
+    if (valid) {
+        return 0;
+    }
+
+    /* One bad descriptor spoils the whole transfer, so the controller gets
+     * none of it. Finding them unowned, it stops with descriptor unavailable */
+    for (size_t i = 0; i < IDMAC_NUM_DESC; i++) {
+        if (guest[i].des0 & IDMAC_DES0_OWN) {
+            shadow[i].des0 &= ~IDMAC_DES0_OWN;
+            rejected[i] = true;
+        }
+    }
+    return -1;
+}
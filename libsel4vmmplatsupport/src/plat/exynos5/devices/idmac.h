@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#pragma once
+
+/*
+ * DesignWare eMMC internal DMA controller descriptors, as shadowed for a guest
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Internal DMA controller descriptor, 32 bit addressing */
+#define IDMAC_DES0_OWN          (1U << 31)
+#define IDMAC_DES0_CES          (1U << 30)
+#define IDMAC_DES0_ER           (1U << 5)
+#define IDMAC_DES0_CH           (1U << 4)
+#define IDMAC_DES1_BS1(x)       ((x) & 0x1fff)
+#define IDMAC_DES1_BS2(x)       (((x) >> 13) & 0x1fff)
+
+struct idmac_desc {
+    uint32_t des0;
+    uint32_t des1;
+    uint32_t des2;
+    uint32_t des3;
+};
+
+/* The guest's descriptor list is shadowed in a single page */
+#define IDMAC_NUM_DESC          (4096 / sizeof(struct idmac_desc))
+
+/**
+ * Check that a buffer lies entirely within a region, without overflowing
+ * @param[in] start   Start of the region
+ * @param[in] size    Size of the region
+ * @param[in] addr    Start of the buffer
+ * @param[in] len     Length of the buffer
+ * @return            true if [addr, addr + len) is inside [start, start + size)
+ */
+bool idmac_range_within(uintptr_t start, size_t size, uintptr_t addr, size_t len);
+
+/**
+ * Translate a guest buffer for the controller
+ * @param[in] cookie  Cookie given to idmac_shadow_build
+ * @param[in] addr    Guest physical address of the buffer
+ * @param[in] len     Length of the buffer, non-zero
+ * @return            The address the controller should use, or 0 if the guest
+ *                    may not DMA into all of the buffer
+ */
+typedef uint32_t (*idmac_translate_fn)(void *cookie, uint32_t addr, uint32_t len);
+
+/**
+ * Build the descriptor list the controller will use from the guest's. The
+ * descriptors the guest owns are only handed to the controller if every one
+ * of them is valid, otherwise none are and all of them are marked rejected.
+ * @param[in]  guest       The guest's copy of its descriptor list
+ * @param[out] shadow      The list given to the controller
+ * @param[out] rejected    Set for each guest owned descriptor withheld from the controller
+ * @param[in]  guest_base  Guest address of the guest's list
+ * @param[in]  shadow_base Controller address of the shadow list
+ * @param[in]  translate   Translates guest buffers
+ * @param[in]  cookie      Passed to translate
+ * @return                 0 if the chain was handed over, -1 if it was rejected
+ */
+int idmac_shadow_build(const struct idmac_desc *guest, struct idmac_desc *shadow, bool *rejected,
+                       uintptr_t guest_base, uintptr_t shadow_base, idmac_translate_fn translate, void *cookie);
@@ -44,6 +44,9 @@ struct irq_combiner_map {
 struct irq_group_data {
     combiner_irq_handler_fn cb;
     void *priv;
+    /* Handed to cb. The source stays disabled until it is acked, so only
+     * one can be outstanding at a time */
+    struct combiner_irq token;
 };
 
 struct combiner_data {
@@ -67,31 +70,25 @@ static inline struct virq_combiner *vcombiner_priv_get_vcombiner(void *priv)
 void vm_combiner_irq_handler(vm_t *vm, int irq)
 {
     struct combiner_data *combiner = &_combiner;
-    struct combiner_irq *cirq;
     uint32_t imsr;
     int i, g;
 
-    /* Decode group and index */
+    /* Decode group and service every pending index */
     g = irq - 32;
     imsr = irq_combiner_group_pending(&combiner->pcombiner, g);
-    i = __builtin_ctz(imsr);
-    /* Disable the IRQ */
-    irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
+    while (imsr) {
+        i = CTZ(imsr);
+        imsr &= ~BIT(i);
+        /* Disable the IRQ until it is acked */
+        irq_combiner_disable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
+        if (combiner->data[g] == NULL || combiner->data[g][i].cb == NULL) {
+            ZF_LOGW("Unregistered combiner IRQ (%d, %d)", g, i);
+            continue;
+        }
 
-    /* Allocate a combiner IRQ structure */
-    cirq = (struct combiner_irq *)calloc(1, sizeof(*cirq));
-    assert(cirq);
-    if (!cirq) {
-        printf("No memory to allocate combiner IRQ\n");
-        return;
+        /* Forward the IRQ */
+        combiner->data[g][i].cb(&combiner->data[g][i].token);
     }
-    cirq->priv = combiner->data[g][i].priv;
-    cirq->index = i;
-    cirq->group = g;
-    cirq->combiner_priv = combiner;
-
-    /* Forward the IRQ */
-    combiner->data[g][i].cb(cirq);
 }
 
 void combiner_irq_ack(struct combiner_irq *cirq)
@@ -104,7 +101,6 @@ void combiner_irq_ack(struct combiner_irq *cirq)
     i = cirq->index;
     /* Re-enable the IRQ */
     irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
-    free(cirq);
 }
 
 
@@ -132,6 +128,12 @@ int vmm_register_combiner_irq(int group, int idx, combiner_irq_handler_fn cb, vo
     /* Register the callback */
     combiner->data[group][idx].cb = cb;
     combiner->data[group][idx].priv = priv;
+    combiner->data[group][idx].token = (struct combiner_irq) {
+        .group = group,
+        .index = idx,
+        .combiner_priv = combiner,
+        .priv = priv
+    };
 
     /* Enable the irq */
     irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(group, idx));
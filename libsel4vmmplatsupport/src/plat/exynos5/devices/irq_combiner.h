@@ -37,7 +37,9 @@ extern const struct device dev_irq_combiner;
 int vmm_register_combiner_irq(int group, int index, combiner_irq_handler_fn cb, void *priv);
 
 /**
- * Call to acknlowledge an IRQ with the combiner
+ * Call to acknlowledge an IRQ with the combiner. The IRQ description
+ * belongs to the combiner and is reused for the next delivery of the
+ * same IRQ, so it must not be freed or used after this call
  * @param[in] irq a description of the IRQ to ACK
  */
 void combiner_irq_ack(struct combiner_irq *irq);
@@ -317,8 +317,8 @@ vm_install_ac_clock(vm_t *vm, enum vacdev_default default_ac, enum vacdev_action
         }
         memset(clkd->mask[i], ac, BIT(12));
         /* Install generic access control */
-        err = vm_install_generic_ac_device(vm, clock_devices[i], clkd->mask[i],
-                                           BIT(12), action);
+        err = vm_install_generic_ac_device_ro(vm, clock_devices[i], clkd->mask[i],
+                                              BIT(12), action);
         if (err) {
             return NULL;
         }
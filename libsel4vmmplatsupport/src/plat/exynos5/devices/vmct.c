@@ -12,9 +12,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <utils/util.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
 
+#include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/plat/vmct.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
@@ -33,10 +36,30 @@
 #define GWSTAT_COMP0L        (1U << 0)
 
 
+#define MCT_G_CNT_L          0x100
+#define MCT_G_CNT_WSTAT      0x110
+#define MCT_G_COMP0_L        0x200
+#define MCT_G_TCON           0x240
+#define MCT_G_WSTAT          0x24C
+#define MCT_L_BASE           0x300
+#define MCT_L_SIZE           0x100
+#define MCT_L_TCNTB          0x00
+#define MCT_L_ICNTB          0x08
+#define MCT_L_FRCNTB         0x10
+#define MCT_L_TCON           0x20
+#define MCT_L_WSTAT          0x40
+
+#define LWSTAT_TCNTB         (1U << 0)
+#define LWSTAT_ICNTB         (1U << 1)
+#define LWSTAT_FRCNTB        (1U << 2)
+#define LWSTAT_TCON          (1U << 3)
+
 struct vmct_priv {
     uint32_t wstat;
     uint32_t cnt_wstat;
     uint32_t lwstat[4];
+    /* Physical registers, when the guest reads them directly */
+    void *regs;
 };
 
 static inline struct vmct_priv *vmct_get_priv(void *priv)
@@ -123,6 +146,88 @@ handle_vmct_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_
     return FAULT_HANDLED;
 }
 
+/* Writes to a directly read MCT are not passed on. A guest polls the write
+ * status after each write though, and reads that from the hardware. For
+ * registers where it is harmless, rewrite the value the register already
+ * holds so the hardware reports the write as complete */
+static void vmct_ack_write(struct vmct_priv *mct_priv, int offset, uint32_t *wstat, uint32_t bit)
+{
+    volatile uint32_t *reg = (volatile uint32_t *)(mct_priv->regs + offset);
+    *reg = *reg;
+    *wstat |= bit;
+}
+
+/* Only clear write status bits that were set on the guest's behalf */
+static void vmct_clear_wstat(struct vmct_priv *mct_priv, int offset, uint32_t *wstat, uint32_t clear)
+{
+    clear &= *wstat;
+    if (clear) {
+        *(volatile uint32_t *)(mct_priv->regs + offset) = clear;
+        *wstat &= ~clear;
+    }
+}
+
+static memory_fault_result_t
+handle_vmct_ro_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length, void *cookie)
+{
+    struct device *dev = (struct device *)cookie;
+    struct vmct_priv *mct_priv = vmct_get_priv(dev->priv);
+    int offset = (fault_addr - dev->pstart) & ~0x3;
+
+    if (is_vcpu_read_fault(vcpu)) {
+        /* Reads don't fault with the page mapped, but just in case */
+        set_vcpu_fault_data(vcpu, *(volatile uint32_t *)(mct_priv->regs + offset));
+        advance_vcpu_fault(vcpu);
+        return FAULT_HANDLED;
+    }
+
+    uint32_t data = get_vcpu_fault_data(vcpu) & get_vcpu_fault_data_mask(vcpu);
+    if (offset >= MCT_L_BASE) {
+        unsigned int timer = (offset - MCT_L_BASE) / MCT_L_SIZE;
+        int loffset = (offset - MCT_L_BASE) % MCT_L_SIZE;
+        int wstat_offset = offset - loffset + MCT_L_WSTAT;
+        if (timer >= ARRAY_SIZE(mct_priv->lwstat)) {
+            /* Past the last local timer, nothing to forward to */
+            ZF_LOGD("MCT write to offset 0x%x ignored\n", offset);
+            advance_vcpu_fault(vcpu);
+            return FAULT_HANDLED;
+        }
+        uint32_t *lwstat = &mct_priv->lwstat[timer];
+        switch (loffset) {
+        case MCT_L_TCNTB:
+            vmct_ack_write(mct_priv, offset, lwstat, LWSTAT_TCNTB);
+            break;
+        case MCT_L_ICNTB:
+            vmct_ack_write(mct_priv, offset, lwstat, LWSTAT_ICNTB);
+            break;
+        case MCT_L_FRCNTB:
+            vmct_ack_write(mct_priv, offset, lwstat, LWSTAT_FRCNTB);
+            break;
+        case MCT_L_TCON:
+            vmct_ack_write(mct_priv, offset, lwstat, LWSTAT_TCON);
+            break;
+        case MCT_L_WSTAT:
+            vmct_clear_wstat(mct_priv, wstat_offset, lwstat, data);
+            break;
+        default:
+            ZF_LOGD("local MCT write to offset 0x%x ignored\n", offset);
+        }
+    } else if (offset >= MCT_G_COMP0_L && offset <= MCT_G_TCON) {
+        /* Compare and control registers */
+        vmct_ack_write(mct_priv, offset, &mct_priv->wstat, 1U << (offset - MCT_G_COMP0_L) / 4);
+    } else if (offset == MCT_G_WSTAT) {
+        vmct_clear_wstat(mct_priv, offset, &mct_priv->wstat, data);
+    } else if (offset == MCT_G_CNT_WSTAT) {
+        vmct_clear_wstat(mct_priv, offset, &mct_priv->cnt_wstat, data);
+    } else {
+        /* Rewriting the counter would disturb everyone else using it, so
+         * writes to it are never reported as complete */
+        ZF_LOGD("global MCT write to offset 0x%x ignored\n", offset);
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
 const struct device dev_vmct_timer = {
     .name = "mct",
 
@@ -160,3 +265,30 @@ int vm_install_vmct(vm_t *vm)
     }
     return 0;
 }
+
+int vm_install_vmct_ro(vm_t *vm)
+{
+    struct vmct_priv *vmct_data;
+    struct device *d;
+
+    d = (struct device *)calloc(1, sizeof(struct device));
+    if (!d) {
+        return -1;
+    }
+    memcpy(d, &dev_vmct_timer, sizeof(struct device));
+    vmct_data = calloc(1, sizeof(struct vmct_priv));
+    if (vmct_data == NULL) {
+        free(d);
+        return -1;
+    }
+    d->priv = vmct_data;
+    /* The guest reads the counter straight from the hardware */
+    vmct_data->regs = create_device_reservation_frame(vm, d->pstart, seL4_CanRead,
+                                                      handle_vmct_ro_fault, (void *)d);
+    if (vmct_data->regs == NULL) {
+        free(d);
+        free(vmct_data);
+        return -1;
+    }
+    return 0;
+}
@@ -15,19 +15,36 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+
+#include <utils/fence.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/arch/guest_memory_arch.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/plat/vsdhc.h>
 #include <sel4vmmplatsupport/device.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
+#include "idmac.h"
+
+#define DWEMMC_CMD_OFFSET       0x02C
+#define DWEMMC_PLDMND_OFFSET    0x084
 #define DWEMMC_DBADDR_OFFSET    0x088
+#define DWEMMC_IDSTS_OFFSET     0x08C
 #define DWEMMC_DSCADDR_OFFSET   0x094
 #define DWEMMC_BUFADDR_OFFSET   0x098
 
+#define DWEMMC_CMD_START        BIT(31)
+#define DWEMMC_CMD_DATA_EXP     BIT(9)
+
+/* IDSTS bits reported for a rejected descriptor chain */
+#define DWEMMC_IDSTS_CES        BIT(5)
+#define DWEMMC_IDSTS_AIS        BIT(9)
+
 struct sdhc_priv {
     /* The VM associated with this device */
     vm_t *vm;
@@ -35,8 +52,103 @@ struct sdhc_priv {
     void* regs;
     /* Residual for 64 bit atomic access to FIFO */
     uint32_t a64;
+    /* Descriptor list the controller actually uses, with guest addresses
+     * translated. NULL if guest DMA is not allowed */
+    struct idmac_desc *shadow;
+    uintptr_t shadow_paddr;
+    /* Guest copy of the descriptor list */
+    struct idmac_desc guest[IDMAC_NUM_DESC];
+    uintptr_t guest_dbaddr;
+    /* Guest descriptors that were withheld from the controller */
+    bool rejected[IDMAC_NUM_DESC];
+    /* Error bits reported in IDSTS on top of the hardware's, until the guest clears them */
+    uint32_t idsts_err;
 };
 
+static int sdhc_read_guest(vm_t *vm, uintptr_t phys, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    memcpy(cookie + offset, vaddr, size);
+    return 0;
+}
+
+static int sdhc_write_guest(vm_t *vm, uintptr_t phys, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    memcpy(vaddr, cookie + offset, size);
+    return 0;
+}
+
+/* Whether the guest can write all of [addr, addr + len). Only guest RAM
+ * qualifies, device frames mapped into the guest (even read-only ones) don't */
+static bool idmac_guest_ram(vm_t *vm, uintptr_t addr, size_t len)
+{
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        struct vm_ram_region *region = &vm->mem.ram_regions[i];
+        if (idmac_range_within(region->start, region->size, addr, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Translate a guest buffer for the controller. Returns 0 if the guest doesn't own all of it */
+static uint32_t idmac_translate(void *cookie, uint32_t addr, uint32_t len)
+{
+    struct sdhc_priv *sdhc_data = cookie;
+    if (!idmac_guest_ram(sdhc_data->vm, addr, len)) {
+        return 0;
+    }
+    uintptr_t paddr = vm_arm_ipa_to_pa(sdhc_data->vm, addr, len);
+    if (paddr == 0 || paddr + len - 1 > UINT32_MAX) {
+        return 0;
+    }
+    return paddr;
+}
+
+/* Copy the guest's descriptor list in one go and build the list the controller
+ * will use. If any descriptor refers to memory outside of guest RAM the whole
+ * chain is withheld from the controller and the guest sees an error */
+static void idmac_shadow_sync(struct device *d, struct sdhc_priv *sdhc_data)
+{
+    int err = vm_ram_touch(sdhc_data->vm, sdhc_data->guest_dbaddr, sizeof(sdhc_data->guest),
+                           sdhc_read_guest, sdhc_data->guest);
+    if (err) {
+        ZF_LOGE("[%s] Unable to read descriptors at 0x%"PRIxPTR, d->name, sdhc_data->guest_dbaddr);
+        memset(sdhc_data->guest, 0, sizeof(sdhc_data->guest));
+    }
+
+    err = idmac_shadow_build(sdhc_data->guest, sdhc_data->shadow, sdhc_data->rejected, sdhc_data->guest_dbaddr,
+                             sdhc_data->shadow_paddr, idmac_translate, sdhc_data);
+    if (err) {
+        ZF_LOGE("[%s] Descriptor chain refers to memory outside of guest RAM", d->name);
+        sdhc_data->idsts_err |= DWEMMC_IDSTS_CES | DWEMMC_IDSTS_AIS;
+    }
+    THREAD_MEMORY_RELEASE();
+}
+
+/* Report descriptors the controller has finished with back to the guest */
+static void idmac_shadow_complete(struct device *d, struct sdhc_priv *sdhc_data)
+{
+    bool changed = false;
+    THREAD_MEMORY_ACQUIRE();
+    for (int i = 0; i < IDMAC_NUM_DESC; i++) {
+        struct idmac_desc *g = &sdhc_data->guest[i];
+        uint32_t des0 = sdhc_data->shadow[i].des0;
+        if ((g->des0 & IDMAC_DES0_OWN) && !(des0 & IDMAC_DES0_OWN)) {
+            /* A rejected descriptor was never run, so it must not look successful */
+            if (sdhc_data->rejected[i]) {
+                des0 |= IDMAC_DES0_CES;
+                sdhc_data->rejected[i] = false;
+            }
+            g->des0 = (g->des0 & ~(IDMAC_DES0_OWN | IDMAC_DES0_CES)) | (des0 & IDMAC_DES0_CES);
+            changed = true;
+        }
+    }
+    if (changed && vm_ram_touch(sdhc_data->vm, sdhc_data->guest_dbaddr, sizeof(sdhc_data->guest),
+                                sdhc_write_guest, sdhc_data->guest)) {
+        ZF_LOGE("[%s] Unable to write back descriptors", d->name);
+    }
+}
+
 static memory_fault_result_t
 handle_sdhc_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                   void *cookie)
@@ -65,17 +177,47 @@ handle_sdhc_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_
             }
         } else {
             assert(fault_length == sizeof(seL4_Word));
-            set_vcpu_fault_data(vcpu, *reg);
+            uint32_t value = *reg;
+            if ((offset & ~0x3) == DWEMMC_IDSTS_OFFSET) {
+                value |= sdhc_data->idsts_err;
+            }
+            set_vcpu_fault_data(vcpu, value);
         }
         ZF_LOGD("[%s] pc0x%x| r0x%x:0x%x\n", d->name, get_vcpu_fault_ip(vcpu),
                 fault_addr, get_vcpu_fault_data(vcpu));
     } else {
+        uint32_t data = get_vcpu_fault_data(vcpu);
         switch (offset & ~0x3) {
         case DWEMMC_DBADDR_OFFSET:
+            if (sdhc_data->shadow) {
+                /* The controller only ever sees the shadow list */
+                sdhc_data->guest_dbaddr = data;
+                *reg = sdhc_data->shadow_paddr;
+                break;
+            }
+        /* Fall through */
         case DWEMMC_DSCADDR_OFFSET:
         case DWEMMC_BUFADDR_OFFSET:
             printf("[%s] Restricting DMA access offset 0x%x\n", d->name, offset);
             break;
+        case DWEMMC_CMD_OFFSET:
+        case DWEMMC_PLDMND_OFFSET:
+            /* The controller may start fetching descriptors */
+            if (sdhc_data->shadow && ((offset & ~0x3) == DWEMMC_PLDMND_OFFSET ||
+                                      (data & (DWEMMC_CMD_START | DWEMMC_CMD_DATA_EXP)) ==
+                                      (DWEMMC_CMD_START | DWEMMC_CMD_DATA_EXP))) {
+                idmac_shadow_sync(d, sdhc_data);
+            }
+            *reg = data;
+            break;
+        case DWEMMC_IDSTS_OFFSET:
+            /* The guest is handling a DMA interrupt */
+            *reg = data;
+            sdhc_data->idsts_err &= ~data;
+            if (sdhc_data->shadow) {
+                idmac_shadow_complete(d, sdhc_data);
+            }
+            break;
         default:
             if (fault_length == sizeof(uint64_t)) {
                 if (offset & 0x4) {
@@ -115,7 +257,7 @@ const struct device dev_msh2 = {
     .priv = NULL
 };
 
-static int vm_install_nodma_sdhc(vm_t *vm, int idx)
+static int vm_install_sdhc(vm_t *vm, int idx, bool dma)
 {
     struct sdhc_priv *sdhc_data;
     struct device *d;
@@ -143,6 +285,17 @@ static int vm_install_nodma_sdhc(vm_t *vm, int idx)
         return -1;
     }
     sdhc_data->vm = vm;
+    if (dma) {
+        ps_dma_man_t *dma_man = &vm->io_ops->dma_manager;
+        sdhc_data->shadow = ps_dma_alloc(dma_man, PAGE_SIZE_4K, PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
+        if (sdhc_data->shadow == NULL) {
+            ZF_LOGE("Unable to allocate IDMAC descriptors");
+            free(sdhc_data);
+            return -1;
+        }
+        sdhc_data->shadow_paddr = ps_dma_pin(dma_man, sdhc_data->shadow, PAGE_SIZE_4K);
+        memset(sdhc_data->shadow, 0, PAGE_SIZE_4K);
+    }
     sdhc_data->regs = create_device_reservation_frame(vm, d->pstart, seL4_CanRead,
                                                        handle_sdhc_fault, (void *)d);
     if (sdhc_data->regs == NULL) {
@@ -155,10 +308,20 @@ static int vm_install_nodma_sdhc(vm_t *vm, int idx)
 
 int vm_install_nodma_sdhc0(vm_t *vm)
 {
-    return vm_install_nodma_sdhc(vm, 0);
+    return vm_install_sdhc(vm, 0, false);
 }
 
 int vm_install_nodma_sdhc2(vm_t *vm)
 {
-    return vm_install_nodma_sdhc(vm, 2);
+    return vm_install_sdhc(vm, 2, false);
+}
+
+int vm_install_idmac_sdhc0(vm_t *vm)
+{
+    return vm_install_sdhc(vm, 0, true);
+}
+
+int vm_install_idmac_sdhc2(vm_t *vm)
+{
+    return vm_install_sdhc(vm, 2, true);
 }
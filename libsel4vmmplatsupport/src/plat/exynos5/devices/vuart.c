@@ -9,6 +9,7 @@
  *
  * @TAG(DATA61_BSD)
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -17,11 +18,12 @@
 #include <sel4vm/guest_memory.h>
 
 #include <sel4vmmplatsupport/device.h>
+#include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/plat/device_map.h>
 #include <sel4vmmplatsupport/plat/vuart.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
-#define VUART_BUFLEN 300
+#define VUART_BUFLEN 4096
 
 #define ULCON       0x000 /* line control */
 #define UCON        0x004 /* control */
@@ -40,6 +42,8 @@
 #define UINTM       0x038 /* interrupt mask */
 #define UART_SIZE   0x03C
 
+#define UTRSTAT_TX_EMPTY    (BIT(1) | BIT(2))
+#define UFSTAT_TX_MASK      (BIT(24) | (0xff << 16))
 
 
 struct vuart_priv {
@@ -47,6 +51,8 @@ struct vuart_priv {
     char buffer[VUART_BUFLEN];
     int buf_pos;
     vm_t *vm;
+    vuart_sink_fn sink;
+    void *sink_cookie;
 };
 
 static inline void *vuart_priv_get_regs(struct device *d)
@@ -54,6 +60,15 @@ static inline void *vuart_priv_get_regs(struct device *d)
     return ((struct vuart_priv *)d->priv)->regs;
 }
 
+/* Output is buffered by the VMM, so as far as the guest can tell every byte
+ * is sent as soon as it is written and the TX FIFO is always empty */
+static void vuart_tx_status(struct device *d)
+{
+    uint32_t *regs = vuart_priv_get_regs(d);
+    regs[UTRSTAT / 4] |= UTRSTAT_TX_EMPTY;
+    regs[UFSTAT / 4] &= ~UFSTAT_TX_MASK;
+}
+
 static void vuart_reset(struct device *d)
 {
     const uint32_t reset_data[] = {
@@ -64,6 +79,13 @@ static void vuart_reset(struct device *d)
     };
     assert(sizeof(reset_data) == UART_SIZE);
     memcpy(vuart_priv_get_regs(d), reset_data, sizeof(reset_data));
+    vuart_tx_status(d);
+}
+
+static void vuart_stdout_sink(void *cookie, const char *buf, size_t len)
+{
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
 }
 
 static void flush_vconsole_device(struct device *d)
@@ -71,18 +93,23 @@ static void flush_vconsole_device(struct device *d)
     struct vuart_priv *vuart_data;
     char *buf;
     int i;
+    int len = 0;
     assert(d->priv);
     vuart_data = (struct vuart_priv *)d->priv;
     buf = vuart_data->buffer;
+    /* Strip escape sequences in place and hand the rest to the sink in one go */
     for (i = 0; i < vuart_data->buf_pos; i++) {
         if (buf[i] != '\033') {
-            putchar(buf[i]);
+            buf[len++] = buf[i];
         } else {
             while (i < vuart_data->buf_pos && buf[i] != 'm') {
                 i++;
             }
         }
     }
+    if (len) {
+        vuart_data->sink(vuart_data->sink_cookie, buf, len);
+    }
     vuart_data->buf_pos = 0;
 }
 
@@ -137,6 +164,7 @@ handle_vuart_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault
         if (offset == UTXH) {
             vuart_putchar(dev, get_vcpu_fault_data(vcpu));
         }
+        vuart_tx_status(dev);
         advance_vcpu_fault(vcpu);
     }
     return FAULT_HANDLED;
@@ -174,11 +202,21 @@ const struct device dev_uart3 = {
 
 
 int vm_install_vconsole(vm_t *vm)
+{
+    return vm_install_vconsole_with_sink(vm, vuart_stdout_sink, NULL);
+}
+
+int vm_install_vconsole_with_sink(vm_t *vm, vuart_sink_fn sink, void *sink_cookie)
 {
     struct vuart_priv *vuart_data;
     struct device *d;
     int err;
 
+    if (!sink) {
+        ZF_LOGE("A vconsole sink is required");
+        return -1;
+    }
+
     d = (struct device *)calloc(1, sizeof(struct device));
     if (!d) {
         return -1;
@@ -189,22 +227,23 @@ int vm_install_vconsole(vm_t *vm)
     vuart_data = calloc(1, sizeof(struct vuart_priv));
     if (vuart_data == NULL) {
         assert(vuart_data);
+        free(d);
         return -1;
     }
     vuart_data->vm = vm;
+    vuart_data->sink = sink;
+    vuart_data->sink_cookie = sink_cookie;
+    d->priv = vuart_data;
 
-    vuart_data->regs = calloc(1, UART_SIZE);
+    /* The guest reads the registers directly, so polling the status registers
+     * doesn't fault. Only writes are trapped */
+    vuart_data->regs = create_allocated_reservation_frame(vm, d->pstart, seL4_CanRead,
+                                                          handle_vuart_fault, (void *)d);
     if (vuart_data->regs == NULL) {
-        assert(vuart_data->regs);
+        free(vuart_data);
+        free(d);
         return -1;
     }
-
-    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d->pstart, d->size,
-            handle_vuart_fault, (void *)d);
-    if (!reservation) {
-        return -1;
-    }
-    d->priv = vuart_data;
     vuart_reset(d);
     return 0;
 }
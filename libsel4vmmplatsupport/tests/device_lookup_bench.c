@@ -0,0 +1,107 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Host benchmark for find_device_by_pa, against the linear walk it replaced.
+ * src/device.c is built as is, with tests/host standing in for the seL4
+ * headers:
+ *
+ *   cc -O2 -I tests/host -I include tests/device_lookup_bench.c src/device.c -o device_lookup_bench
+ *   ./device_lookup_bench [num_devices] [num_lookups]
+ *
+ * Devices are a page each, added in a scattered order with a free page after
+ * each one, and lookups alternate between hits and misses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sel4vmmplatsupport/device.h>
+
+#define DEVICE_BASE     0x10000000u
+#define DEVICE_SIZE     0x1000u
+
+static struct device *linear_find(device_list_t *list, uintptr_t addr)
+{
+    for (int i = 0; i < list->num_devices; i++) {
+        struct device *dev = &list->devices[i];
+        if (addr >= dev->pstart && addr < dev->pstart + dev->size) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uintptr_t lookup_addr(int i, int num_devices)
+{
+    return DEVICE_BASE + (uintptr_t)(i % (2 * num_devices)) * DEVICE_SIZE + 8;
+}
+
+int main(int argc, char **argv)
+{
+    int num_devices = argc > 1 ? atoi(argv[1]) : 300;
+    int num_lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (num_devices <= 0 || num_lookups <= 0) {
+        fprintf(stderr, "usage: %s [num_devices] [num_lookups]\n", argv[0]);
+        return 1;
+    }
+
+    device_list_t list;
+    device_list_init(&list);
+    for (int i = 0; i < num_devices; i++) {
+        /* 7919 is prime, so this visits every slot once in a scattered order */
+        int slot = (int)(((long)i * 7919) % num_devices);
+        struct device dev = {
+            .name = "bench",
+            .pstart = DEVICE_BASE + (uintptr_t)slot * 2 * DEVICE_SIZE,
+            .size = DEVICE_SIZE,
+        };
+        if (add_device(&list, &dev)) {
+            fprintf(stderr, "Failed to add device %d\n", i);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < 2 * num_devices; i++) {
+        uintptr_t addr = lookup_addr(i, num_devices);
+        if (find_device_by_pa(&list, addr) != linear_find(&list, addr)) {
+            fprintf(stderr, "Lookups disagree at 0x%lx\n", (unsigned long)addr);
+            return 1;
+        }
+    }
+
+    volatile uintptr_t sink = 0;
+    double start = now_ns();
+    for (int i = 0; i < num_lookups; i++) {
+        sink += (uintptr_t)find_device_by_pa(&list, lookup_addr(i, num_devices));
+    }
+    double search = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < num_lookups; i++) {
+        sink += (uintptr_t)linear_find(&list, lookup_addr(i, num_devices));
+    }
+    double linear = now_ns() - start;
+
+    printf("%d devices, %d lookups\n", num_devices, num_lookups);
+    printf("  find_device_by_pa  %8.1f ns/lookup\n", search / num_lookups);
+    printf("  linear walk        %8.1f ns/lookup\n", linear / num_lookups);
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Stand-in for the real header when building host tests and benchmarks of
+ * code that only needs the VM types by name, e.g. src/device.c.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uintptr_t seL4_Word;
+typedef struct vm vm_t;
+typedef struct vm_vcpu vm_vcpu_t;
+
+#define ZF_LOGE(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } while (0)
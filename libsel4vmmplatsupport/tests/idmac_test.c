@@ -0,0 +1,130 @@
+/*
+ * Copyright 2019, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Host test for the Exynos vsdhc IDMAC descriptor shadowing. It has no seL4
+ * dependencies and is built and run on the host:
+ *
+ *   cc -I src/plat/exynos5/devices tests/idmac_test.c src/plat/exynos5/devices/idmac.c -o idmac_test
+ *   ./idmac_test
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "idmac.h"
+
+#define RAM_BASE        0x40000000u
+#define RAM_SIZE        0x04000000u
+/* A device frame mapped read-only into the guest, e.g. the clock controller */
+#define DEVICE_FRAME    0x10010000u
+/* Where the guest's list lives and where the controller sees the shadow */
+#define GUEST_LIST      (RAM_BASE + 0x1000)
+#define SHADOW_LIST     0x80000000u
+/* Host physical address the fake stage 2 maps guest RAM to */
+#define RAM_PADDR       0x60000000u
+
+/* Mirrors the vsdhc policy: stage 2 translates both RAM and device frames,
+ * but only guest RAM may be handed to the controller */
+static uint32_t translate(void *cookie, uint32_t addr, uint32_t len)
+{
+    if (idmac_range_within(RAM_BASE, RAM_SIZE, addr, len)) {
+        return addr - RAM_BASE + RAM_PADDR;
+    }
+    return 0;
+}
+
+static struct idmac_desc guest[IDMAC_NUM_DESC];
+static struct idmac_desc shadow[IDMAC_NUM_DESC];
+static bool rejected[IDMAC_NUM_DESC];
+
+/* A chain of three descriptors, each with one 512 byte buffer in guest RAM */
+static void make_chain(void)
+{
+    memset(guest, 0, sizeof(guest));
+    for (int i = 0; i < 3; i++) {
+        guest[i].des0 = IDMAC_DES0_OWN | IDMAC_DES0_CH;
+        guest[i].des1 = 512;
+        guest[i].des2 = RAM_BASE + 0x10000 + i * 512;
+        guest[i].des3 = GUEST_LIST + (i + 1) * sizeof(struct idmac_desc);
+    }
+}
+
+static int build(void)
+{
+    return idmac_shadow_build(guest, shadow, rejected, GUEST_LIST, SHADOW_LIST, translate, NULL);
+}
+
+static void assert_chain_rejected(void)
+{
+    assert(build() == -1);
+    for (int i = 0; i < 3; i++) {
+        assert(!(shadow[i].des0 & IDMAC_DES0_OWN));
+        assert(rejected[i]);
+    }
+    assert(!rejected[3]);
+}
+
+static void test_valid_chain(void)
+{
+    make_chain();
+    assert(build() == 0);
+    for (int i = 0; i < 3; i++) {
+        assert(shadow[i].des0 & IDMAC_DES0_OWN);
+        assert(shadow[i].des2 == RAM_PADDR + 0x10000 + i * 512);
+        assert(shadow[i].des3 == SHADOW_LIST + (i + 1) * sizeof(struct idmac_desc));
+        assert(!rejected[i]);
+    }
+    assert(shadow[IDMAC_NUM_DESC - 1].des0 & IDMAC_DES0_ER);
+}
+
+static void test_device_frame(void)
+{
+    make_chain();
+    /* The last descriptor of the chain points at the read-only device frame */
+    guest[2].des2 = DEVICE_FRAME;
+    assert_chain_rejected();
+}
+
+static void test_crosses_out_of_ram(void)
+{
+    make_chain();
+    guest[1].des2 = RAM_BASE + RAM_SIZE - 256;
+    assert_chain_rejected();
+}
+
+static void test_chain_outside_list(void)
+{
+    make_chain();
+    guest[0].des3 = DEVICE_FRAME;
+    assert_chain_rejected();
+}
+
+static void test_range_within(void)
+{
+    assert(idmac_range_within(RAM_BASE, RAM_SIZE, RAM_BASE, RAM_SIZE));
+    assert(!idmac_range_within(RAM_BASE, RAM_SIZE, RAM_BASE - 1, 2));
+    assert(!idmac_range_within(RAM_BASE, RAM_SIZE, RAM_BASE + RAM_SIZE, 1));
+    assert(!idmac_range_within(RAM_BASE, RAM_SIZE, RAM_BASE + 1, (size_t) -1));
+}
+
+int main(void)
+{
+    test_valid_chain();
+    test_device_frame();
+    test_crosses_out_of_ram();
+    test_chain_outside_list();
+    test_range_within();
+    printf("idmac: all tests passed\n");
+    return 0;
+}